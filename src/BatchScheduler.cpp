@@ -0,0 +1,169 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+#include "BatchScheduler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace {
+    // Weight of a new sample in the moving averages.
+    constexpr auto ARRIVAL_DECAY = 0.05;
+    constexpr auto LATENCY_DECAY = 0.2;
+    // A larger batch must be this much better to be preferred, at equal
+    // throughput the smaller batch has the lower latency.
+    constexpr auto LARGER_BATCH_MARGIN = 1.02;
+    // Full batches in a row before trying a batch size that timed out.
+    constexpr auto PROBE_AFTER = 8;
+}
+
+BatchScheduler::BatchScheduler(size_t max_batch_size, duration latency_bound)
+    : m_max_batch_size(std::max(max_batch_size, size_t{1})),
+      m_latency_bound(latency_bound.count()),
+      m_latency(m_max_batch_size + 1, -1.0),
+      m_reachable(m_max_batch_size),
+      m_batch_size(m_max_batch_size),
+      m_timeout(m_latency_bound) {
+}
+
+void BatchScheduler::add_arrival(clock::time_point when) {
+    if (m_have_arrival) {
+        const auto interval = std::chrono::duration<double, std::micro>(
+            when - m_last_arrival).count();
+        if (m_interval < 0.0) {
+            m_interval = interval;
+        } else {
+            m_interval += ARRIVAL_DECAY * (interval - m_interval);
+        }
+    }
+    m_last_arrival = when;
+    m_have_arrival = true;
+    m_outstanding++;
+}
+
+void BatchScheduler::add_batch(size_t size, duration latency, bool timed_out) {
+    size = std::min(std::max(size, size_t{1}), m_max_batch_size);
+
+    // The batch is still counted, it was waiting for the backend too.
+    const auto load = std::max(m_outstanding, size);
+    if (m_load < 0.0) {
+        m_load = load;
+    } else {
+        m_load += LATENCY_DECAY * (load - m_load);
+    }
+    m_outstanding -= std::min(m_outstanding, size);
+
+    auto& average = m_latency[size];
+    if (average < 0.0) {
+        average = latency.count();
+    } else {
+        average += LATENCY_DECAY * (latency.count() - average);
+    }
+
+    if (timed_out) {
+        m_reachable = size;
+        m_full_batches = 0;
+    } else if (load > m_reachable) {
+        // Enough evaluations are waiting now to fill larger batches.
+        m_reachable = std::min(load, m_max_batch_size);
+        m_full_batches = 0;
+    } else if (size >= m_reachable && m_reachable < m_max_batch_size
+               && ++m_full_batches >= PROBE_AFTER) {
+        m_reachable++;
+        m_full_batches = 0;
+    }
+    update();
+}
+
+size_t BatchScheduler::batch_size() const {
+    return m_batch_size;
+}
+
+BatchScheduler::duration BatchScheduler::timeout() const {
+    return duration{static_cast<duration::rep>(m_timeout)};
+}
+
+BatchScheduler::duration BatchScheduler::estimated_latency(size_t size) const {
+    return duration{static_cast<duration::rep>(latency(size))};
+}
+
+// Sizes that were never run are estimated from the nearest smaller size
+// that was, so they look cheap and get tried. Failing that, from the
+// nearest larger one.
+double BatchScheduler::latency(size_t size) const {
+    size = std::min(std::max(size, size_t{1}), m_max_batch_size);
+    for (auto i = size; i >= 1; i--) {
+        if (m_latency[i] >= 0.0) {
+            return m_latency[i];
+        }
+    }
+    for (auto i = size + 1; i <= m_max_batch_size; i++) {
+        if (m_latency[i] >= 0.0) {
+            return m_latency[i];
+        }
+    }
+    return 0.0;
+}
+
+void BatchScheduler::update() {
+    const auto interval = std::max(m_interval, 0.0);
+    // Larger batches than the load would only fill up by timing out.
+    auto largest = m_reachable;
+    if (m_load >= 0.0) {
+        const auto load = static_cast<size_t>(std::ceil(m_load));
+        largest = std::min(largest, std::max(load, size_t{1}));
+    }
+
+    auto best_size = size_t{1};
+    auto best_throughput = 0.0;
+    for (auto size = size_t{1}; size <= largest; size++) {
+        const auto run = latency(size);
+        const auto fill = (size - 1) * interval;
+        if (size > 1 && fill + run > m_latency_bound) {
+            break;
+        }
+        const auto throughput = run > 0.0
+            ? size / run : std::numeric_limits<double>::infinity();
+        if (size == 1 || throughput > best_throughput * LARGER_BATCH_MARGIN) {
+            best_size = size;
+            best_throughput = throughput;
+        }
+    }
+
+    m_batch_size = best_size;
+    // Wait no longer than the latency budget leaves, nor much longer
+    // than the batch should take to fill up.
+    m_timeout = std::max(0.0, m_latency_bound - latency(best_size));
+    if (m_interval >= 0.0) {
+        m_timeout = std::min(m_timeout, 2.0 * best_size * interval);
+    }
+}
@@ -0,0 +1,98 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef BATCHSCHEDULER_H_INCLUDED
+#define BATCHSCHEDULER_H_INCLUDED
+
+#include "config.h"
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+/*
+    Decides how many evaluations a batched backend groups together and how
+    long the oldest queued evaluation may wait for its batch to fill up.
+
+    It keeps moving averages of the time between arrivals, of the backend
+    latency for every batch size and of the offered load, the evaluations
+    queued or running when a batch comes back. From those it picks the
+    batch size with the best throughput whose expected latency, filling
+    the batch plus running it, stays within the latency bound.
+
+    The load and not the arrival rate bounds the useful batch size: each
+    search thread waits for its own evaluation, so evaluations never
+    arrive faster than they are served, whatever the batch size.
+
+    Not thread safe, the backend calls it under its queue lock.
+*/
+class BatchScheduler {
+public:
+    using clock = std::chrono::steady_clock;
+    using duration = std::chrono::microseconds;
+
+    BatchScheduler(size_t max_batch_size, duration latency_bound);
+
+    // An evaluation was queued.
+    void add_arrival(clock::time_point when = clock::now());
+    // A batch came back from the backend. timed_out is set when it was
+    // dispatched before it reached batch_size(). Every evaluation passed
+    // to add_arrival() must come back in some batch.
+    void add_batch(size_t size, duration latency, bool timed_out);
+
+    size_t batch_size() const;
+    duration timeout() const;
+    duration estimated_latency(size_t size) const;
+
+private:
+    double latency(size_t size) const;
+    void update();
+
+    size_t m_max_batch_size;
+    double m_latency_bound;
+
+    // Moving averages in microseconds, negative while there is no data.
+    double m_interval{-1.0};
+    std::vector<double> m_latency;
+    clock::time_point m_last_arrival;
+    bool m_have_arrival{false};
+    double m_load{-1.0};
+    // Evaluations that arrived and didn't come back yet.
+    size_t m_outstanding{0};
+
+    // Batches larger than this recently failed to fill up in time,
+    // likely because there aren't enough threads to fill them.
+    size_t m_reachable;
+    int m_full_batches{0};
+
+    size_t m_batch_size;
+    double m_timeout;
+};
+
+#endif
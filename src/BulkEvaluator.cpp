@@ -0,0 +1,295 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#include "config.h"
+#include "BulkEvaluator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "SGFParser.h"
+#include "SGFTree.h"
+#include "Timing.h"
+#include "Training.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+#include "half/half.hpp"
+
+using namespace Utils;
+
+namespace {
+    void put_le(std::string& out, std::uint32_t value, int bytes) {
+        for (auto i = 0; i < bytes; i++) {
+            out.push_back(char((value >> (8 * i)) & 0xFF));
+        }
+    }
+
+    void put_float(std::string& out, float value) {
+        auto bits = std::uint32_t{};
+        std::memcpy(&bits, &value, sizeof(bits));
+        put_le(out, bits, 4);
+    }
+
+    void put_half(std::string& out, float value) {
+        put_le(out,
+               half_float::detail::float2half<std::round_to_nearest>(value),
+               2);
+    }
+}
+
+BulkEvaluator::BulkEvaluator(Network& network, bool search)
+    : m_network(network), m_search(search) {
+}
+
+std::string BulkEvaluator::header() const {
+    auto header = std::string{"LZEV"};
+    header.push_back(char(VERSION));
+    header.push_back(char(BOARD_SIZE));
+    header.push_back(char(m_search ? 1 : 0));
+    header.push_back(char(0));
+    assert(header.size() == HEADER_SIZE);
+    return header;
+}
+
+void BulkEvaluator::write_record(std::string& out,
+                                 std::uint32_t line_number,
+                                 const GameState& state,
+                                 const Network::Netresult& result) {
+    auto record = std::string{};
+    put_le(record, line_number, 4);
+    put_le(record, std::uint32_t(state.get_movenum()), 2);
+    put_le(record, state.get_to_move() == FastBoard::BLACK ? 0 : 1, 1);
+    put_float(record, result.winrate);
+    for (const auto prob : result.policy) {
+        put_half(record, prob);
+    }
+    put_half(record, result.policy_pass);
+    assert(record.size() == RECORD_SIZE);
+    out += record;
+}
+
+void BulkEvaluator::search(std::string& out, const GameState& state) {
+    const auto to_move = state.get_to_move();
+    auto search_state = std::make_unique<GameState>(state);
+    auto search = std::make_unique<UCTSearch>(*search_state, m_network);
+    search->set_thread_count(1);
+    const auto move = search->think(to_move, UCTSearch::NORESIGN);
+    // Only the search result is wanted, not the training data.
+    Training::clear_training();
+
+    auto move_idx = NUM_INTERSECTIONS;
+    if (move == FastBoard::RESIGN) {
+        move_idx = -1;
+    } else if (move != FastBoard::PASS) {
+        const auto xy = state.board.get_xy(move);
+        move_idx = xy.second * BOARD_SIZE + xy.first;
+    }
+    auto record = std::string{};
+    put_le(record, std::uint16_t(std::int16_t(move_idx)), 2);
+    put_float(record, search->get_root_eval(to_move));
+    put_le(record, search->get_root_visits(), 4);
+    assert(record.size() == SEARCH_SIZE);
+    out += record;
+}
+
+std::string BulkEvaluator::evaluate_line(std::uint32_t line_number,
+                                         const std::string& line,
+                                         size_t& positions) {
+    positions = 0;
+    auto in = std::istringstream{line};
+    auto filename = std::string{};
+    if (!(in >> filename)) {
+        return "";
+    }
+    auto wanted = std::vector<bool>{};
+    auto all = true;
+    auto movenum = 0;
+    while (in >> movenum) {
+        if (movenum < 0) {
+            continue;
+        }
+        all = false;
+        wanted.resize(std::max(wanted.size(), size_t(movenum) + 1));
+        wanted[movenum] = true;
+    }
+
+    auto tree = std::make_unique<SGFTree>();
+    try {
+        // Not SGFTree::load_from_file: that shares one cached file
+        // between all threads and reads it under a lock.
+        tree->load_from_string(SGFCollection{filename}.get_game(0));
+    } catch (const std::exception& e) {
+        myprintf_error("Line %u: %s: %s\n", line_number,
+                       filename.c_str(), e.what());
+        return "";
+    }
+    auto state = tree->follow_mainline_state();
+    tree.reset();
+    if (state.board.get_boardsize() != BOARD_SIZE) {
+        myprintf_error("Line %u: %s: wrong board size\n", line_number,
+                       filename.c_str());
+        return "";
+    }
+    // Searches are limited by visits, not by the game's time settings.
+    state.set_timecontrol(0, 1, 0, 0);
+
+    auto states = std::vector<GameState>{};
+    state.rewind();
+    do {
+        const auto current = state.get_movenum();
+        if (all || (current < wanted.size() && wanted[current])) {
+            states.emplace_back(state);
+        }
+        if (!all && current + 1 >= wanted.size()) {
+            break;
+        }
+    } while (state.forward_move());
+
+    auto batch = std::vector<const GameState*>{};
+    for (const auto& position : states) {
+        batch.emplace_back(&position);
+    }
+    const auto results =
+        m_network.get_output_batch(batch, Network::IDENTITY_SYMMETRY);
+
+    auto out = std::string{};
+    for (auto i = size_t{0}; i < states.size(); i++) {
+        write_record(out, line_number, states[i], results[i]);
+        if (m_search) {
+            search(out, states[i]);
+        }
+    }
+    positions = states.size();
+    return out;
+}
+
+bool BulkEvaluator::run(const std::string& input, const std::string& output) {
+    auto ins = std::ifstream{input};
+    if (!ins) {
+        myprintf_error("Could not open %s\n", input.c_str());
+        return false;
+    }
+    auto outs = std::ofstream{output, std::ios::binary};
+    if (!outs) {
+        myprintf_error("Could not create %s\n", output.c_str());
+        return false;
+    }
+    outs << header();
+
+    const auto threads = std::max(size_t{cfg_num_threads}, size_t{1});
+    const auto max_in_flight = 16 * threads;
+    if (m_search) {
+        UCTSearch::reserve_pool_threads(threads);
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<std::uint32_t, std::string>> queue;
+    auto input_done = false;
+    // Evaluated lines waiting for their predecessors, so the output is
+    // in input order.
+    auto pending = std::map<std::uint32_t, std::string>{};
+    auto lines_read = std::uint32_t{0};
+    auto lines_done = std::uint32_t{0};
+    auto positions = size_t{0};
+
+    Time start;
+    auto worker = [&]() {
+        for (;;) {
+            auto line = std::pair<std::uint32_t, std::string>{};
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return input_done || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                line = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            auto count = size_t{0};
+            auto records = evaluate_line(line.first, line.second, count);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.emplace(line.first, std::move(records));
+            positions += count;
+            while (!pending.empty()
+                   && pending.begin()->first == lines_done + 1) {
+                outs << pending.begin()->second;
+                pending.erase(pending.begin());
+                lines_done++;
+            }
+            cv.notify_all();
+        }
+    };
+
+    auto workers = std::vector<std::thread>{};
+    for (auto i = size_t{0}; i < threads; i++) {
+        workers.emplace_back(worker);
+    }
+
+    auto line = std::string{};
+    while (std::getline(ins, line)) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() {
+            return lines_read - lines_done < max_in_flight;
+        });
+        // Line numbers start at 1, like in an editor.
+        queue.emplace_back(++lines_read, std::move(line));
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        input_done = true;
+    }
+    cv.notify_all();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    outs.close();
+
+    const auto seconds = Time::timediff_seconds(start, Time());
+    myprintf_error("Evaluated %zu positions from %u lines in %.1fs, "
+                   "%.0f positions/s with %zu threads.\n",
+                   positions, lines_read, seconds,
+                   positions / std::max(seconds, 0.001), threads);
+    return !outs.fail();
+}
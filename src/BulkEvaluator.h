@@ -0,0 +1,88 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#ifndef BULKEVALUATOR_H_INCLUDED
+#define BULKEVALUATOR_H_INCLUDED
+
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "GameState.h"
+#include "Network.h"
+
+// Evaluates many positions from game records, for offline analysis.
+// Every line of the input names an SGF file, optionally followed by the
+// move numbers to evaluate (0 = the starting position). Without move
+// numbers every position of the main line is evaluated. Games are spread
+// over cfg_num_threads threads, and the positions of one line go through
+// the network as one batch.
+class BulkEvaluator {
+public:
+    BulkEvaluator(Network& network, bool search);
+
+    // Returns false if the input can't be read.
+    bool run(const std::string& input, const std::string& output);
+
+    // Output layout, all multi-byte values little endian:
+    //   header: "LZEV", version, board size, 1 if searched else 0, 0
+    //   record: input line (uint32), move number (uint16),
+    //           side to move (uint8, 0 = black),
+    //           network winrate for the side to move (float32),
+    //           POTENTIAL_MOVES network probabilities (fp16),
+    //   and if searched:
+    //           best move (int16, y * size + x, NUM_INTERSECTIONS = pass,
+    //           -1 = resign), search winrate (float32), visits (uint32)
+    static constexpr auto VERSION = 1;
+    static constexpr auto HEADER_SIZE = size_t{8};
+    static constexpr auto RECORD_SIZE = size_t{4 + 2 + 1 + 4}
+                                        + 2 * POTENTIAL_MOVES;
+    static constexpr auto SEARCH_SIZE = size_t{2 + 4 + 4};
+    std::string header() const;
+
+private:
+    // Evaluates the positions asked for on one input line, returns the
+    // records and how many positions they hold.
+    std::string evaluate_line(std::uint32_t line_number,
+                              const std::string& line, size_t& positions);
+    // Appends the record of state, evaluated as result.
+    void write_record(std::string& out, std::uint32_t line_number,
+                      const GameState& state,
+                      const Network::Netresult& result);
+    void search(std::string& out, const GameState& state);
+
+    Network& m_network;
+    bool m_search;
+};
+
+#endif
@@ -45,6 +45,7 @@
 #include "CPUPipe.h"
 #include "Network.h"
 #include "Im2Col.h"
+#include "PerfCounters.h"
 
 #ifndef USE_BLAS
 // Eigen helpers
@@ -382,6 +383,41 @@ void batchnorm(const size_t channels,
 void CPUPipe::forward(const std::vector<float>& input,
                       std::vector<float>& output_pol,
                       std::vector<float>& output_val) {
+    forward_batch(1, input, output_pol, output_val);
+}
+
+void CPUPipe::forward_batch(size_t batch,
+                            const std::vector<float>& input,
+                            std::vector<float>& output_pol,
+                            std::vector<float>& output_val) {
+    constexpr auto in_size = Network::INPUT_CHANNELS * NUM_INTERSECTIONS;
+    constexpr auto pol_size = Network::OUTPUTS_POLICY * NUM_INTERSECTIONS;
+    constexpr auto val_size = Network::OUTPUTS_VALUE * NUM_INTERSECTIONS;
+    assert(input.size() == batch * in_size);
+    Perf::record_batch(batch);
+
+    // The convolutions go one position at a time, the heads then read
+    // their weights once for the whole batch.
+    auto batch_pol = std::vector<float>(batch * pol_size);
+    auto batch_val = std::vector<float>(batch * val_size);
+    auto position = std::vector<float>(in_size);
+    auto head_pol = std::vector<float>(pol_size);
+    auto head_val = std::vector<float>(val_size);
+    for (auto b = size_t{0}; b < batch; b++) {
+        std::copy(begin(input) + b * in_size,
+                  begin(input) + (b + 1) * in_size, begin(position));
+        forward_convolutions(position, head_pol, head_val);
+        std::copy(begin(head_pol), end(head_pol),
+                  begin(batch_pol) + b * pol_size);
+        std::copy(begin(head_val), end(head_val),
+                  begin(batch_val) + b * val_size);
+    }
+    m_heads->compute(batch, batch_pol, batch_val, output_pol, output_val);
+}
+
+void CPUPipe::forward_convolutions(const std::vector<float>& input,
+                                   std::vector<float>& head_pol,
+                                   std::vector<float>& head_val) {
     // Input convolution
     constexpr auto P = WINOGRAD_P;
     // Calculate output channels
@@ -422,8 +458,8 @@ void CPUPipe::forward(const std::vector<float>& input,
                                      m_weights->m_batchnorm_stddevs[i + 1].data(),
                                      res.data());
     }
-    convolve<1>(Network::OUTPUTS_POLICY, conv_out, m_conv_pol_w, m_conv_pol_b, output_pol);
-    convolve<1>(Network::OUTPUTS_VALUE, conv_out, m_conv_val_w, m_conv_val_b, output_val);
+    convolve<1>(Network::OUTPUTS_POLICY, conv_out, m_conv_pol_w, m_conv_pol_b, head_pol);
+    convolve<1>(Network::OUTPUTS_VALUE, conv_out, m_conv_val_w, m_conv_val_b, head_val);
 }
 
 void CPUPipe::push_weights(unsigned int /*filter_size*/,
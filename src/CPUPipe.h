@@ -42,12 +42,21 @@ public:
     virtual void forward(const std::vector<float>& input,
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val);
+    virtual void forward_batch(size_t batch,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val);
 
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights);
 private:
+    // The residual tower and the head convolutions of one position.
+    void forward_convolutions(const std::vector<float>& input,
+                              std::vector<float>& head_pol,
+                              std::vector<float>& head_val);
+
     void winograd_transform_in(const std::vector<float>& in,
                                std::vector<float>& V,
                                const int C);
@@ -0,0 +1,351 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+
+#include "config.h"
+#include "EvalServer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <thread>
+
+#include "GTP.h"
+#include "Timing.h"
+#include "Utils.h"
+
+using namespace Utils;
+using namespace boost::interprocess;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "The ring needs address-free atomics to work across processes.");
+
+static constexpr std::array<char, 4> RING_MAGIC{{'L', 'Z', 'N', 'N'}};
+
+static std::uint64_t make_state(EvalRing::SlotState state,
+                                std::uint32_t owner) {
+    return (std::uint64_t{owner} << 32) | state;
+}
+
+static std::uint64_t with_state(std::uint64_t value,
+                                EvalRing::SlotState state) {
+    return (value & ~std::uint64_t{0xFFFFFFFF}) | state;
+}
+
+EvalRing::SlotState EvalRing::state(const Slot& slot) {
+    return SlotState(slot.state.load(std::memory_order_acquire)
+                     & 0xFFFFFFFF);
+}
+
+std::uint64_t EvalRing::now_ms() {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+bool EvalRing::claim(Slot& slot, std::uint32_t owner, std::uint64_t now) {
+    auto expected = make_state(FREE, 0);
+    if (!slot.state.compare_exchange_strong(expected,
+                                            make_state(CLAIMED, owner),
+                                            std::memory_order_acquire)) {
+        return false;
+    }
+    slot.since.store(now, std::memory_order_relaxed);
+    return true;
+}
+
+void EvalRing::submit(Slot& slot) {
+    const auto value = slot.state.load(std::memory_order_relaxed);
+    assert((value & 0xFFFFFFFF) == CLAIMED);
+    slot.state.store(with_state(value, SUBMITTED), std::memory_order_release);
+}
+
+void EvalRing::release(Slot& slot) {
+    assert((slot.state.load(std::memory_order_relaxed) & 0xFFFFFFFF) == DONE);
+    slot.state.store(make_state(FREE, 0), std::memory_order_release);
+}
+
+bool EvalRing::start(Slot& slot) {
+    auto value = slot.state.load(std::memory_order_relaxed);
+    return (value & 0xFFFFFFFF) == SUBMITTED
+        && slot.state.compare_exchange_strong(value,
+                                              with_state(value, RUNNING),
+                                              std::memory_order_acquire);
+}
+
+void EvalRing::finish(Slot& slot, std::uint64_t now) {
+    const auto value = slot.state.load(std::memory_order_relaxed);
+    assert((value & 0xFFFFFFFF) == RUNNING);
+    slot.since.store(now, std::memory_order_relaxed);
+    slot.state.store(with_state(value, DONE), std::memory_order_release);
+}
+
+bool EvalRing::reclaim(Slot& slot, std::uint64_t now,
+                       const std::function<bool(std::uint32_t)>& alive) {
+    auto value = slot.state.load(std::memory_order_acquire);
+    const auto state = value & 0xFFFFFFFF;
+    if (state != CLAIMED && state != DONE) {
+        return false;
+    }
+    // A slot that was just claimed may still show the time of its
+    // previous owner, but then its owner is alive.
+    const auto since = slot.since.load(std::memory_order_relaxed);
+    if (now < since + STALE_MS || alive(std::uint32_t(value >> 32))) {
+        return false;
+    }
+    // Nobody else moves a slot out of CLAIMED or DONE, so this only
+    // fails if the slot was freed meanwhile.
+    return slot.state.compare_exchange_strong(value, make_state(FREE, 0),
+                                              std::memory_order_acq_rel);
+}
+
+EvalServer::EvalServer(Network& network, const std::string& name)
+    : m_network(network), m_name(name) {
+    shared_memory_object::remove(m_name.c_str());
+    m_shm = shared_memory_object(create_only, m_name.c_str(), read_write);
+    m_shm.truncate(EvalRing::SIZE);
+    m_region = mapped_region(m_shm, read_write);
+
+    auto base = static_cast<char*>(m_region.get_address());
+    m_header = new (base) EvalRing::Header;
+    m_slots = reinterpret_cast<EvalRing::Slot*>(base + sizeof(EvalRing::Header));
+    for (auto i = size_t{0}; i < EvalRing::SLOTS; i++) {
+        new (&m_slots[i]) EvalRing::Slot;
+        m_slots[i].state = EvalRing::FREE;
+        m_slots[i].since = 0;
+    }
+    m_header->version = EvalRing::VERSION;
+    m_header->board_size = BOARD_SIZE;
+    m_header->slots = EvalRing::SLOTS;
+    m_header->next_slot = 0;
+    m_header->heartbeat = 0;
+    m_header->serving = 1;
+    // Publish the magic last, engines check it before anything else.
+    std::atomic_thread_fence(std::memory_order_release);
+    m_header->magic = RING_MAGIC;
+}
+
+EvalServer::~EvalServer() {
+    m_header->serving = 0;
+    shared_memory_object::remove(m_name.c_str());
+}
+
+void EvalServer::run() {
+    const auto threads = std::max(size_t{cfg_num_threads}, size_t{1});
+    myprintf("Serving evaluations on %s with %zu thread(s).\n",
+             m_name.c_str(), threads);
+
+    const auto start = Time();
+    auto workers = std::vector<std::thread>{};
+    for (auto i = size_t{0}; i < threads; i++) {
+        workers.emplace_back(&EvalServer::worker, this, i);
+    }
+
+    auto input = std::string{};
+    while (std::getline(std::cin, input) && input != "quit") {
+    }
+
+    m_header->serving = 0;
+    m_running = false;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    const auto seconds = Time::timediff_seconds(start, Time());
+    myprintf("Served %zu evaluations in %.0f s, %.1f per second.\n",
+             m_served.load(), seconds, m_served / std::max(seconds, 1.0));
+}
+
+void EvalServer::worker(size_t index) {
+    auto features = std::vector<float>(
+        Network::INPUT_CHANNELS * NUM_INTERSECTIONS);
+    auto cursor = index;
+    auto idle = 0;
+    auto last_sweep = EvalRing::now_ms();
+    while (m_running) {
+        auto found = false;
+        for (auto i = size_t{0}; i < EvalRing::SLOTS; i++) {
+            auto& slot = m_slots[(cursor + i) % EvalRing::SLOTS];
+            if (EvalRing::start(slot)) {
+                serve(slot, features);
+                EvalRing::finish(slot, EvalRing::now_ms());
+                cursor += i + 1;
+                found = true;
+                break;
+            }
+        }
+        if (index == 0 && EvalRing::now_ms() - last_sweep
+                          >= EvalRing::STALE_MS) {
+            reclaim_slots();
+            last_sweep = EvalRing::now_ms();
+        }
+        // Stay responsive while engines are busy, but don't burn a
+        // core when they are not.
+        if (found) {
+            idle = 0;
+        } else if (++idle < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+}
+
+void EvalServer::reclaim_slots() {
+    // Once a second from one thread keeps the header cache line, which
+    // every engine reads, mostly quiet.
+    ++m_header->heartbeat;
+    const auto now = EvalRing::now_ms();
+    auto reclaimed = size_t{0};
+    for (auto i = size_t{0}; i < EvalRing::SLOTS; i++) {
+        if (EvalRing::reclaim(m_slots[i], now, process_alive)) {
+            reclaimed++;
+        }
+    }
+    if (reclaimed > 0) {
+        myprintf("Freed %zu slot(s) held by engines that exited.\n",
+                 reclaimed);
+    }
+}
+
+void EvalServer::serve(EvalRing::Slot& slot, std::vector<float>& features) {
+    std::copy(begin(slot.planes), end(slot.planes), begin(features));
+    slot.result = m_network.get_output_for_features(
+        features, slot.symmetry, slot.hash,
+        (slot.flags & EvalRing::READ_CACHE) != 0,
+        (slot.flags & EvalRing::WRITE_CACHE) != 0);
+    ++m_served;
+}
+
+EvalClient::EvalClient(const std::string& name) {
+    try {
+        m_shm = shared_memory_object(open_only, name.c_str(), read_write);
+        m_region = mapped_region(m_shm, read_write);
+    } catch (const interprocess_exception& e) {
+        myprintf_error("Cannot connect to evaluation server %s: %s\n",
+                       name.c_str(), e.what());
+        exit(EXIT_FAILURE);
+    }
+    auto base = static_cast<char*>(m_region.get_address());
+    m_header = reinterpret_cast<EvalRing::Header*>(base);
+    m_slots = reinterpret_cast<EvalRing::Slot*>(base + sizeof(EvalRing::Header));
+
+    if (m_region.get_size() < EvalRing::SIZE
+        || m_header->magic != RING_MAGIC
+        || m_header->version != EvalRing::VERSION
+        || m_header->board_size != BOARD_SIZE
+        || m_header->slots != EvalRing::SLOTS
+        || !m_header->serving) {
+        myprintf_error("%s is not a running evaluation server of this "
+                       "version.\n", name.c_str());
+        exit(EXIT_FAILURE);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    myprintf("Using evaluation server %s.\n", name.c_str());
+}
+
+void EvalClient::server_lost() {
+    myprintf_error("The evaluation server stopped.\n");
+    // Search threads are waiting on the server as well, so exit()
+    // would hang joining them.
+    std::_Exit(EXIT_FAILURE);
+}
+
+Network::Netresult EvalClient::evaluate(const std::vector<float>& features,
+                                        int symmetry, std::uint64_t hash,
+                                        bool read_cache, bool write_cache) {
+    // How long the server may go without a heartbeat before we
+    // assume it died without cleaning up.
+    constexpr auto SERVER_TIMEOUT = std::chrono::seconds(5);
+
+    auto server_alive = [this, SERVER_TIMEOUT](std::uint64_t& heartbeat,
+                            std::chrono::steady_clock::time_point& seen) {
+        const auto now = std::chrono::steady_clock::now();
+        const auto beat = m_header->heartbeat.load();
+        if (beat != heartbeat) {
+            heartbeat = beat;
+            seen = now;
+        }
+        return m_header->serving && now - seen < SERVER_TIMEOUT;
+    };
+    auto backoff = [](int& spins) {
+        if (++spins < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    };
+    auto heartbeat = m_header->heartbeat.load();
+    auto seen = std::chrono::steady_clock::now();
+
+    // Claim a free slot.
+    static const auto pid = process_id();
+    auto spins = 0;
+    EvalRing::Slot* slot;
+    for (;;) {
+        const auto index = m_header->next_slot++ % EvalRing::SLOTS;
+        slot = &m_slots[index];
+        if (EvalRing::claim(*slot, pid, EvalRing::now_ms())) {
+            break;
+        }
+        if (index == EvalRing::SLOTS - 1) {
+            // Went around the whole ring, wait for the server to catch up.
+            if (!server_alive(heartbeat, seen)) {
+                server_lost();
+            }
+            backoff(spins);
+        }
+    }
+
+    for (auto i = size_t{0}; i < slot->planes.size(); i++) {
+        slot->planes[i] = static_cast<std::uint8_t>(features[i]);
+    }
+    slot->symmetry = symmetry;
+    slot->hash = hash;
+    slot->flags = (read_cache ? EvalRing::READ_CACHE : 0)
+                | (write_cache ? EvalRing::WRITE_CACHE : 0);
+    EvalRing::submit(*slot);
+
+    spins = 0;
+    while (EvalRing::state(*slot) != EvalRing::DONE) {
+        if (!server_alive(heartbeat, seen)) {
+            server_lost();
+        }
+        backoff(spins);
+    }
+    const auto result = slot->result;
+    EvalRing::release(*slot);
+    return result;
+}
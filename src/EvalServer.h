@@ -0,0 +1,172 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+
+#ifndef EVALSERVER_H_INCLUDED
+#define EVALSERVER_H_INCLUDED
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+#include "Network.h"
+
+/*
+    Network evaluations shared by the engines on one host. The server
+    owns the network and its cache. Engines started with --remote-eval
+    put their positions in a ring of slots in shared memory and wait
+    for the server to fill in the result.
+
+    Slots move FREE -> CLAIMED -> SUBMITTED -> RUNNING -> DONE -> FREE.
+    Engines claim a slot with a compare-and-swap and hand it over with
+    a release store, server threads do the same in the other direction,
+    so there are no locks between the processes.
+
+    An engine that exits while it holds a slot (CLAIMED or DONE) would
+    take the slot out of the ring for good. The server gives such slots
+    back: the state records which process holds the slot, and slots
+    that stay with an engine for longer than STALE_MS are freed once
+    that process is gone.
+*/
+namespace EvalRing {
+    static constexpr std::uint32_t VERSION = 2;
+    static constexpr std::size_t SLOTS = 512;
+    static constexpr std::uint64_t STALE_MS = 1000;
+
+    enum SlotState : std::uint32_t {
+        FREE, CLAIMED, SUBMITTED, RUNNING, DONE
+    };
+
+    // Request flags, see Network::get_output().
+    static constexpr std::uint32_t READ_CACHE = 1 << 0;
+    static constexpr std::uint32_t WRITE_CACHE = 1 << 1;
+
+    struct Slot {
+        // SlotState in the low half, the process id of the engine that
+        // claimed the slot in the high half.
+        std::atomic<std::uint64_t> state;
+        // Steady clock milliseconds when the slot last went to the
+        // engine.
+        std::atomic<std::uint64_t> since;
+        std::uint32_t symmetry;
+        std::uint32_t flags;
+        std::uint64_t hash;
+        // Input planes from Network::gather_features(), one byte each.
+        std::array<std::uint8_t,
+                   Network::INPUT_CHANNELS * NUM_INTERSECTIONS> planes;
+        Network::Netresult result;
+    };
+
+    struct Header {
+        std::array<char, 4> magic;
+        std::uint32_t version;
+        std::uint32_t board_size;
+        std::uint32_t slots;
+        std::atomic<std::uint32_t> serving;
+        // Bumped every STALE_MS by the server, tells engines it is alive.
+        std::atomic<std::uint64_t> heartbeat;
+        // Where engines start looking for a free slot.
+        std::atomic<std::uint64_t> next_slot;
+    };
+
+    static constexpr std::size_t SIZE = sizeof(Header) + SLOTS * sizeof(Slot);
+
+    SlotState state(const Slot& slot);
+    std::uint64_t now_ms();
+
+    // Engine side. claim() returns false if the slot isn't free.
+    bool claim(Slot& slot, std::uint32_t owner, std::uint64_t now);
+    void submit(Slot& slot);
+    void release(Slot& slot);
+
+    // Server side. start() returns false if the slot isn't submitted.
+    bool start(Slot& slot);
+    void finish(Slot& slot, std::uint64_t now);
+    // Frees the slot if an engine has held it since before
+    // now - STALE_MS and alive says that engine is gone.
+    bool reclaim(Slot& slot, std::uint64_t now,
+                 const std::function<bool(std::uint32_t)>& alive);
+}
+
+class EvalServer {
+public:
+    // Creates the shared memory object name, replacing a stale one.
+    EvalServer(Network& network, const std::string& name);
+    ~EvalServer();
+
+    // Serve with cfg_num_threads threads until stdin is closed or
+    // reads "quit".
+    void run();
+
+private:
+    void worker(size_t index);
+    // Bumps the heartbeat and frees slots of engines that exited.
+    void reclaim_slots();
+    void serve(EvalRing::Slot& slot, std::vector<float>& features);
+
+    Network& m_network;
+    std::string m_name;
+    boost::interprocess::shared_memory_object m_shm;
+    boost::interprocess::mapped_region m_region;
+    EvalRing::Header* m_header;
+    EvalRing::Slot* m_slots;
+    std::atomic<bool> m_running{true};
+    std::atomic<std::size_t> m_served{0};
+};
+
+class EvalClient {
+public:
+    // Opens the shared memory of a running EvalServer, exits if
+    // there is none.
+    explicit EvalClient(const std::string& name);
+
+    Network::Netresult evaluate(const std::vector<float>& features,
+                                int symmetry, std::uint64_t hash,
+                                bool read_cache, bool write_cache);
+
+private:
+    [[noreturn]] static void server_lost();
+
+    boost::interprocess::shared_memory_object m_shm;
+    boost::interprocess::mapped_region m_region;
+    EvalRing::Header* m_header;
+    EvalRing::Slot* m_slots;
+};
+
+#endif
@@ -156,7 +156,7 @@ void FastState::display_state() {
     board.display_board(get_last_move());
 }
 
-std::string FastState::move_to_text(int move) {
+std::string FastState::move_to_text(int move) const {
     return board.move_to_text(move);
 }
 
@@ -53,17 +53,45 @@ public:
         std::vector<float> m_conv_val_b;
     };
 
+    // The fully connected policy and value heads. Pipes run them
+    // after the head convolutions, over all positions of a batch.
+    class OutputHeads {
+    public:
+        virtual ~OutputHeads() = default;
+        // pol and val hold the head convolution outputs of batch
+        // positions. Writes the policy logits and the value logit of
+        // every position to policy_out and value_out.
+        virtual void compute(size_t batch,
+                             std::vector<float>& pol,
+                             std::vector<float>& val,
+                             std::vector<float>& policy_out,
+                             std::vector<float>& value_out) const = 0;
+    };
+
     virtual ~ForwardPipe() = default;
 
     virtual void initialize(const int channels) = 0;
     virtual bool needs_autodetect() { return false; };
+    // Returns the outputs of the heads set with set_output_heads().
     virtual void forward(const std::vector<float>& input,
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val) = 0;
+    // forward() for batch positions stored one after the other in
+    // input. The outputs are stored the same way.
+    virtual void forward_batch(size_t batch,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val) = 0;
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights) = 0;
+    void set_output_heads(std::shared_ptr<const OutputHeads> heads) {
+        m_heads = std::move(heads);
+    }
+
+protected:
+    std::shared_ptr<const OutputHeads> m_heads;
 };
 
 #endif
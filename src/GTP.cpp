@@ -48,8 +48,10 @@
 #include "FullBoard.h"
 #include "GameState.h"
 #include "Network.h"
+#include "PerfCounters.h"
 #include "SGFTree.h"
 #include "SMP.h"
+#include "SessionManager.h"
 #include "Training.h"
 #include "UCTSearch.h"
 #include "Utils.h"
@@ -59,12 +61,15 @@ using namespace Utils;
 // Configuration flags
 bool cfg_gtp_mode;
 bool cfg_allow_pondering;
+int cfg_ponder_replies;
 unsigned int cfg_num_threads;
 unsigned int cfg_batch_size;
 int cfg_max_playouts;
 int cfg_max_visits;
 size_t cfg_max_memory;
 size_t cfg_max_tree_size;
+bool cfg_tree_gc;
+bool cfg_deterministic;
 int cfg_max_cache_ratio_percent;
 TimeManagement::enabled_t cfg_timemanage;
 int cfg_lagbuffer_cs;
@@ -73,12 +78,29 @@ int cfg_noise;
 int cfg_random_cnt;
 int cfg_random_min_visits;
 float cfg_random_temp;
+bool cfg_binary_training;
+int cfg_training_compression;
+bool cfg_sgf_index;
+int cfg_selfplay_games;
+std::string cfg_selfplay_output;
+std::string cfg_match_weights;
+int cfg_match_games;
+float cfg_match_elo0;
+float cfg_match_elo1;
+unsigned int cfg_parallel_games;
+std::string cfg_evaluate_input;
+std::string cfg_evaluate_output;
+std::vector<int> cfg_scaling_threads;
+std::vector<int> cfg_scaling_batch_sizes;
+std::string cfg_eval_server;
+std::string cfg_remote_eval;
 std::uint64_t cfg_rng_seed;
 bool cfg_dumbpass;
 #ifdef USE_OPENCL
 std::vector<int> cfg_gpus;
 bool cfg_sgemm_exhaustive;
 bool cfg_tune_only;
+int cfg_batch_latency;
 #ifdef USE_HALF
 precision_t cfg_precision;
 #endif
@@ -91,6 +113,7 @@ float cfg_fpu_reduction;
 float cfg_fpu_root_reduction;
 float cfg_ci_alpha;
 float cfg_lcb_min_visit_ratio;
+float cfg_lcb_stop_alpha;
 std::string cfg_weightsfile;
 std::string cfg_logfile;
 FILE* cfg_logfile_handle;
@@ -98,7 +121,7 @@ bool cfg_quiet;
 std::string cfg_options_str;
 bool cfg_benchmark;
 bool cfg_cpu_only;
-AnalyzeTags cfg_analyze_tags;
+thread_local AnalyzeTags cfg_analyze_tags;
 
 /* Parses tags for the lz-analyze GTP command and friends */
 AnalyzeTags::AnalyzeTags(std::istringstream& cmdstream, const GameState& game) {
@@ -295,6 +318,7 @@ bool AnalyzeTags::has_move_restrictions() const {
 }
 
 std::unique_ptr<Network> GTP::s_network;
+std::unique_ptr<SessionManager> GTP::s_sessions;
 
 void GTP::initialize(std::unique_ptr<Network>&& net) {
     s_network = std::move(net);
@@ -313,9 +337,14 @@ void GTP::initialize(std::unique_ptr<Network>&& net) {
     myprintf("%s\n", message.c_str());
 }
 
+void GTP::shutdown() {
+    s_sessions.reset();
+}
+
 void GTP::setup_default_parameters() {
     cfg_gtp_mode = false;
     cfg_allow_pondering = true;
+    cfg_ponder_replies = 0;
 
     // we will re-calculate this on Leela.cpp
     cfg_num_threads = 1;
@@ -328,6 +357,8 @@ void GTP::setup_default_parameters() {
     // This will be overwriiten in initialize() after network size is known.
     cfg_max_tree_size = UCTSearch::DEFAULT_MAX_MEMORY;
     cfg_max_cache_ratio_percent = 10;
+    cfg_tree_gc = true;
+    cfg_deterministic = false;
     cfg_timemanage = TimeManagement::AUTO;
     cfg_lagbuffer_cs = 100;
     cfg_weightsfile = leelaz_file("best-network");
@@ -335,6 +366,7 @@ void GTP::setup_default_parameters() {
     cfg_gpus = { };
     cfg_sgemm_exhaustive = false;
     cfg_tune_only = false;
+    cfg_batch_latency = 10;
 
 #ifdef USE_HALF
     cfg_precision = precision_t::AUTO;
@@ -351,9 +383,22 @@ void GTP::setup_default_parameters() {
     cfg_fpu_root_reduction = cfg_fpu_reduction;
     cfg_ci_alpha = 1e-5f;
     cfg_lcb_min_visit_ratio = 0.10f;
+    cfg_lcb_stop_alpha = 0.0f;
     cfg_random_cnt = 0;
     cfg_random_min_visits = 1;
     cfg_random_temp = 1.0f;
+    cfg_binary_training = false;
+    cfg_training_compression = 9;
+    cfg_sgf_index = false;
+    cfg_selfplay_games = 0;
+    cfg_selfplay_output = "selfplay";
+    cfg_match_games = 400;
+    cfg_match_elo0 = 0.0f;
+    cfg_match_elo1 = 35.0f;
+    cfg_parallel_games = 0;
+    cfg_evaluate_output = "evaluation.lzev";
+    cfg_scaling_threads.clear();
+    cfg_scaling_batch_sizes.clear();
     cfg_dumbpass = false;
     cfg_logfile_handle = nullptr;
     cfg_quiet = false;
@@ -411,7 +456,9 @@ const std::string GTP::s_commands[] = {
     "lz-analyze",
     "lz-genmove_analyze",
     "lz-memory_report",
+    "lz-perf",
     "lz-setoption",
+    "lz-session",
     "gomill-explain_last_move",
     ""
 };
@@ -459,9 +506,11 @@ std::string GTP::get_life_list(const GameState & game, bool live) {
     return result;
 }
 
-void GTP::execute(GameState & game, const std::string& xinput) {
+void GTP::execute(GameState & maingame, const std::string& xinput) {
     std::string input;
-    static auto search = std::make_unique<UCTSearch>(game, *s_network);
+    if (!s_sessions) {
+        s_sessions = std::make_unique<SessionManager>(*s_network, maingame);
+    }
 
     bool transform_lowercase = true;
 
@@ -501,6 +550,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
     if (input == "") {
         return;
     } else if (input == "exit") {
+        shutdown();
         exit(EXIT_SUCCESS);
     } else if (input.find("#") == 0) {
         return;
@@ -514,6 +564,18 @@ void GTP::execute(GameState & game, const std::string& xinput) {
         command = input;
     }
 
+    if (command.find("lz-session") == 0) {
+        execute_session(id, command);
+        return;
+    }
+
+    // Everything else goes to the selected session, and interrupts
+    // its background analysis.
+    auto& session = s_sessions->current();
+    s_sessions->stop_analysis(session);
+    auto& game = session.id == 0 ? maingame : *session.game;
+    auto& search = session.search;
+
     /* process commands */
     if (command == "protocol_version") {
         gtp_printf(id, "%d", GTP_VERSION);
@@ -526,6 +588,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
         return;
     } else if (command == "quit") {
         gtp_printf(id, "");
+        shutdown();
         exit(EXIT_SUCCESS);
     } else if (command.find("known_command") == 0) {
         std::istringstream cmdstream(command);
@@ -654,6 +717,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
             if (id != -1) gtp_printf_raw("=%d\n", id);
             else gtp_printf_raw("=\n");
         }
+        SessionManager::Foreground foreground(*s_sessions);
         // start thinking
         {
             game.set_to_move(who);
@@ -673,7 +737,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
             // now start pondering
             if (!game.has_resigned()) {
                 // Outputs winrate and pvs through gtp for lz-genmove_analyze
-                search->ponder();
+                search->ponder(true);
             }
         }
         if (analysis_output) {
@@ -697,6 +761,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
         else gtp_printf_raw("=\n");
         // Now start pondering.
         if (!game.has_resigned()) {
+            SessionManager::Foreground foreground(*s_sessions);
             cfg_analyze_tags = tags;
             // Outputs winrate and pvs through gtp
             game.set_to_move(tags.who());
@@ -724,6 +789,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
                 return;
             }
             game.set_passes(0);
+            SessionManager::Foreground foreground(*s_sessions);
             {
                 game.set_to_move(who);
                 int move = search->think(who, UCTSearch::NOPASS);
@@ -735,7 +801,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
             if (cfg_allow_pondering) {
                 // now start pondering
                 if (!game.has_resigned()) {
-                    search->ponder();
+                    search->ponder(true);
                 }
             }
         } else {
@@ -818,7 +884,8 @@ void GTP::execute(GameState & game, const std::string& xinput) {
                 // KGS sends this after our move
                 // now start pondering
                 if (!game.has_resigned()) {
-                    search->ponder();
+                    SessionManager::Foreground foreground(*s_sessions);
+                    search->ponder(true);
                 }
             }
         } else {
@@ -826,6 +893,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
         }
         return;
     } else if (command.find("auto") == 0) {
+        SessionManager::Foreground foreground(*s_sessions);
         do {
             int move = search->think(game.get_to_move(), UCTSearch::NORMAL);
             game.play_move(move);
@@ -835,6 +903,7 @@ void GTP::execute(GameState & game, const std::string& xinput) {
 
         return;
     } else if (command.find("go") == 0 && command.size() < 6) {
+        SessionManager::Foreground foreground(*s_sessions);
         int move = search->think(game.get_to_move());
         game.play_move(move);
 
@@ -1158,21 +1227,44 @@ void GTP::execute(GameState & game, const std::string& xinput) {
     } else if (command.find("dump_supervised") == 0) {
         std::istringstream cmdstream(command);
         std::string tmp, sgfname, outname;
+        auto shards = size_t{1};
+        auto ordered = false;
 
         // tmp will eat dump_supervised
         cmdstream >> tmp >> sgfname >> outname;
+        auto syntax_ok = !cmdstream.fail();
+
+        // Optional number of output shards and "ordered".
+        constexpr auto MAX_SHARDS = size_t{1024};
+        while (syntax_ok && cmdstream >> tmp) {
+            if (tmp == "ordered") {
+                ordered = true;
+            } else if (tmp.size() <= 4
+                       && std::all_of(begin(tmp), end(tmp),
+                                      [](unsigned char c) {
+                                          return std::isdigit(c);
+                                      })) {
+                shards = std::strtoul(tmp.c_str(), nullptr, 10);
+                syntax_ok = shards >= 1 && shards <= MAX_SHARDS;
+            } else {
+                syntax_ok = false;
+            }
+        }
 
-        Training::dump_supervised(sgfname, outname);
-
-        if (!cmdstream.fail()) {
-            gtp_printf(id, "");
-        } else {
+        if (!syntax_ok) {
             gtp_fail_printf(id, "syntax not understood");
+            return;
+        }
+        try {
+            Training::dump_supervised(sgfname, outname, shards, ordered);
+            gtp_printf(id, "");
+        } catch (const std::exception& e) {
+            gtp_fail_printf(id, "%s", e.what());
         }
         return;
     } else if (command.find("lz-memory_report") == 0) {
         auto base_memory = get_base_memory();
-        auto tree_size = add_overhead(UCTNodePointer::get_tree_size());
+        auto tree_size = add_overhead(s_sessions->tree_size());
         auto cache_size = add_overhead(s_network->get_estimated_cache_size());
 
         auto total = base_memory + tree_size + cache_size;
@@ -1181,6 +1273,24 @@ void GTP::execute(GameState & game, const std::string& xinput) {
             "Network with overhead: %d MiB / Search tree: %d MiB / Network cache: %d\n",
             total / MiB, base_memory / MiB, tree_size / MiB, cache_size / MiB);
         return;
+    } else if (command.find("lz-perf") == 0) {
+        std::istringstream cmdstream(command);
+        std::string tmp;
+
+        cmdstream >> tmp;  // eat lz-perf
+        cmdstream >> tmp;
+        if (cmdstream.fail()) {
+            gtp_printf(id, "%s", Perf::report().c_str());
+        } else if (tmp == "reset") {
+            Perf::reset();
+            gtp_printf(id, "");
+        } else if (tmp == "on" || tmp == "off") {
+            Perf::timing_enabled = tmp == "on";
+            gtp_printf(id, "");
+        } else {
+            gtp_fail_printf(id, "syntax not understood");
+        }
+        return;
     } else if (command.find("lz-setoption") == 0) {
         return execute_setoption(*search.get(), id, command);
     } else if (command.find("gomill-explain_last_move") == 0) {
@@ -1404,3 +1514,54 @@ void GTP::execute_setoption(UCTSearch & search,
     }
     return;
 }
+
+void GTP::execute_session(int id, const std::string& command) {
+    std::istringstream cmdstream(command);
+    std::string tmp, action;
+
+    cmdstream >> tmp >> action;  // eat lz-session
+
+    if (action == "new") {
+        gtp_printf(id, "%d", s_sessions->create());
+        return;
+    } else if (action == "list") {
+        gtp_printf(id, "%s", s_sessions->list().c_str());
+        return;
+    }
+
+    int session_id;
+    cmdstream >> session_id;
+    auto session = s_sessions->find(session_id);
+    if (cmdstream.fail() || !session) {
+        gtp_fail_printf(id, "unknown session");
+        return;
+    }
+
+    if (action == "select") {
+        s_sessions->select(session_id);
+        gtp_printf(id, "");
+    } else if (action == "close") {
+        if (!s_sessions->close(session_id)) {
+            gtp_fail_printf(id, "cannot close session");
+            return;
+        }
+        gtp_printf(id, "");
+    } else if (action == "analyze") {
+        AnalyzeTags tags{cmdstream, *session->game};
+        if (tags.invalid()) {
+            gtp_fail_printf(id, "cannot parse analyze tags");
+            return;
+        }
+        if (session->game->has_resigned()) {
+            gtp_fail_printf(id, "game is over");
+            return;
+        }
+        s_sessions->start_analysis(*session, tags);
+        gtp_printf(id, "");
+    } else if (action == "stop") {
+        s_sessions->stop_analysis(*session);
+        gtp_printf(id, "");
+    } else {
+        gtp_fail_printf(id, "syntax not understood");
+    }
+}
@@ -81,12 +81,15 @@ private:
 
 extern bool cfg_gtp_mode;
 extern bool cfg_allow_pondering;
+extern int cfg_ponder_replies;
 extern unsigned int cfg_num_threads;
 extern unsigned int cfg_batch_size;
 extern int cfg_max_playouts;
 extern int cfg_max_visits;
 extern size_t cfg_max_memory;
 extern size_t cfg_max_tree_size;
+extern bool cfg_tree_gc;
+extern bool cfg_deterministic;
 extern int cfg_max_cache_ratio_percent;
 extern TimeManagement::enabled_t cfg_timemanage;
 extern int cfg_lagbuffer_cs;
@@ -95,12 +98,29 @@ extern int cfg_noise;
 extern int cfg_random_cnt;
 extern int cfg_random_min_visits;
 extern float cfg_random_temp;
+extern bool cfg_binary_training;
+extern int cfg_training_compression;
+extern bool cfg_sgf_index;
+extern int cfg_selfplay_games;
+extern std::string cfg_selfplay_output;
+extern std::string cfg_match_weights;
+extern int cfg_match_games;
+extern float cfg_match_elo0;
+extern float cfg_match_elo1;
+extern unsigned int cfg_parallel_games;
+extern std::string cfg_evaluate_input;
+extern std::string cfg_evaluate_output;
+extern std::vector<int> cfg_scaling_threads;
+extern std::vector<int> cfg_scaling_batch_sizes;
+extern std::string cfg_eval_server;
+extern std::string cfg_remote_eval;
 extern std::uint64_t cfg_rng_seed;
 extern bool cfg_dumbpass;
 #ifdef USE_OPENCL
 extern std::vector<int> cfg_gpus;
 extern bool cfg_sgemm_exhaustive;
 extern bool cfg_tune_only;
+extern int cfg_batch_latency;
 #ifdef USE_HALF
 enum class precision_t {
     AUTO, SINGLE, HALF
@@ -116,6 +136,7 @@ extern float cfg_fpu_reduction;
 extern float cfg_fpu_root_reduction;
 extern float cfg_ci_alpha;
 extern float cfg_lcb_min_visit_ratio;
+extern float cfg_lcb_stop_alpha;
 extern std::string cfg_logfile;
 extern std::string cfg_weightsfile;
 extern FILE* cfg_logfile_handle;
@@ -123,7 +144,7 @@ extern bool cfg_quiet;
 extern std::string cfg_options_str;
 extern bool cfg_benchmark;
 extern bool cfg_cpu_only;
-extern AnalyzeTags cfg_analyze_tags;
+extern thread_local AnalyzeTags cfg_analyze_tags;
 
 static constexpr size_t MiB = 1024LL * 1024LL;
 
@@ -132,14 +153,19 @@ static constexpr size_t MiB = 1024LL * 1024LL;
     https://www.lysator.liu.se/~gunnar/gtp/gtp2-spec-draft2/gtp2-spec.html
     GTP is meant to be used between programs. It's not a human interface.
 */
+class SessionManager;
+
 class GTP {
 public:
     static std::unique_ptr<Network> s_network;
     static void initialize(std::unique_ptr<Network>&& network);
     static void execute(GameState & game, const std::string& xinput);
     static void setup_default_parameters();
+    // Stop background analyses before the engine exits.
+    static void shutdown();
 private:
     static constexpr int GTP_VERSION = 2;
+    static std::unique_ptr<SessionManager> s_sessions;
 
     static std::string get_life_list(const GameState & game, bool live);
     static const std::string s_commands[];
@@ -150,6 +176,7 @@ private:
         size_t max_memory, int cache_size_ratio_percent);
     static void execute_setoption(UCTSearch& search,
                                   int id, const std::string& command);
+    static void execute_session(int id, const std::string& command);
 
     // Memory estimation helpers
     static size_t get_base_memory();
@@ -155,6 +155,20 @@ bool GameState::has_resigned() const {
     return m_resigned != FastBoard::EMPTY;
 }
 
+int GameState::get_winner() const {
+    if (has_resigned()) {
+        return m_resigned == FastBoard::BLACK ? FastBoard::WHITE
+                                              : FastBoard::BLACK;
+    }
+    const auto score = final_score();
+    if (score > 0.0f) {
+        return FastBoard::BLACK;
+    } else if (score < 0.0f) {
+        return FastBoard::WHITE;
+    }
+    return FastBoard::EMPTY;
+}
+
 const TimeControl& GameState::get_timecontrol() const {
     return m_timecontrol;
 }
@@ -175,6 +189,11 @@ void GameState::adjust_time(int color, int time, int stones) {
     m_timecontrol.adjust_time(color, time, stones);
 }
 
+void GameState::record_search(int playouts, int centis,
+                              int reused_visits, int total_visits) {
+    m_timecontrol.record_search(playouts, centis, reused_visits, total_visits);
+}
+
 void GameState::anchor_game_history() {
     // handicap moves don't count in game history
     m_movenum = 0;
@@ -73,10 +73,15 @@ public:
     void set_timecontrol(int maintime, int byotime, int byostones,
                          int byoperiods);
     void adjust_time(int color, int time, int stones);
+    void record_search(int playouts, int centis,
+                       int reused_visits, int total_visits);
 
     void display_state();
     bool has_resigned() const;
     int who_resigned() const;
+    // Winner of a finished game, by resignation or else by score.
+    // FastBoard::EMPTY for a draw.
+    int get_winner() const;
 
 private:
     bool valid_handicap(int stones);
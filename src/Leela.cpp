@@ -38,14 +38,21 @@
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include "BulkEvaluator.h"
+#include "EvalServer.h"
 #include "GTP.h"
 #include "GameState.h"
+#include "Match.h"
 #include "Network.h"
 #include "NNCache.h"
 #include "Random.h"
+#include "ScalingBenchmark.h"
+#include "SelfPlay.h"
+#include "Training.h"
 #include "ThreadPool.h"
 #include "Utils.h"
 #include "Zobrist.h"
@@ -61,6 +68,29 @@ static void license_blurb() {
         PROGRAM_VERSION);
 }
 
+// Parses a comma separated list of positive numbers, exits if that fails.
+static std::vector<int> parse_count_list(const std::string& option,
+                                         const std::string& text) {
+    auto counts = std::vector<int>{};
+    auto in = std::istringstream{text};
+    for (auto item = std::string{}; std::getline(in, item, ','); ) {
+        auto count = 0;
+        auto rest = std::string{};
+        auto item_in = std::istringstream{item};
+        if (!(item_in >> count) || count <= 0 || item_in >> rest) {
+            printf("%s must be a comma separated list of positive numbers.\n",
+                   option.c_str());
+            exit(EXIT_FAILURE);
+        }
+        counts.emplace_back(count);
+    }
+    if (counts.empty()) {
+        printf("%s must not be empty.\n", option.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return counts;
+}
+
 static void calculate_thread_count_cpu(boost::program_options::variables_map & vm) {
     // If we are CPU-based, there is no point using more than the number of CPUs/
     auto cfg_max_threads = std::min(SMP::get_num_cpus(), size_t{MAX_CPUS});
@@ -158,9 +188,47 @@ static void parse_commandline(int argc, char *argv[]) {
                        ", but use full time if moving faster doesn't save time.\n"
                        "fast = Same as on but always plays faster.\n"
                        "no_pruning = For self play training use.\n")
+        ("lcb-stop", po::value<float>(),
+                     "Stop searching once the best move's lower confidence "
+                     "bound is above the upper bound of every other "
+                     "contender, at significance level x (e.g. 0.01).")
         ("noponder", "Disable thinking on opponent's time.")
+        ("ponder-replies", po::value<int>()->default_value(cfg_ponder_replies),
+                           "Ponder only on the x most likely opponent replies, "
+                           "in proportion to their probability.\n"
+                           "0 = ponder on the whole tree.")
+        ("no-tree-gc", "Stop searching when the tree memory budget is "
+                       "exhausted, instead of collapsing rarely visited "
+                       "subtrees to make room.")
+        ("deterministic", "Search in rounds of one leaf per thread, so that "
+                          "with --seed and a playout or visit limit the "
+                          "same position always gives the same tree, "
+                          "whatever the thread timing.")
+        ("sgf-index", "Keep the game index of SGF collections opened with "
+                      "loadsgf in a .lzidx file next to them.")
         ("benchmark", "Test network and exit. Default args:\n-v3200 --noponder "
                       "-m0 -t1 -s1.")
+        ("scaling-benchmark", po::value<std::string>(),
+                              "Search a fixed suite of positions with each "
+                              "of the comma separated thread counts x, "
+                              "print playouts/s, NN evals/s and agreement "
+                              "with a longer search as JSON and exit. "
+                              "Default args: -v1600 --noponder -m0.")
+        ("evaluate", po::value<std::string>(),
+                     "Evaluate the positions listed in file x and exit. "
+                     "Each line is an SGF file and optionally move numbers. "
+                     "With --visits or --playouts each position is also "
+                     "searched.")
+        ("evaluate-output",
+            po::value<std::string>()->default_value(cfg_evaluate_output),
+            "File for the --evaluate results.")
+        ("eval-server", po::value<std::string>(),
+                        "Serve network evaluations to the engines on this "
+                        "host through shared memory object x, until stdin "
+                        "is closed.")
+        ("remote-eval", po::value<std::string>(),
+                        "Get network evaluations from the --eval-server x "
+                        "instead of loading --weights.")
 #ifndef USE_CPU_ONLY
         ("cpu-only", "Use CPU-only implementation and do not use OpenCL device(s).")
 #endif
@@ -173,6 +241,12 @@ static void parse_commandline(int argc, char *argv[]) {
         ("full-tuner", "Try harder to find an optimal OpenCL tuning.")
         ("tune-only", "Tune OpenCL only and then exit.")
         ("batchsize", po::value<unsigned int>()->default_value(0), "Max batch size.  Select 0 to let leela-zero pick a reasonable default.")
+        ("batch-latency", po::value<int>()->default_value(cfg_batch_latency),
+                "Latency in milliseconds a batched evaluation may take, "
+                "waiting for its batch to fill up included.\n"
+                "Batch sizes are picked for throughput within this bound.")
+        ("scaling-batchsizes", po::value<std::string>(),
+                "Comma separated batch sizes for --scaling-benchmark.")
 #ifdef USE_HALF
         ("precision", po::value<std::string>(),
             "Floating-point precision (single/half/auto).\n"
@@ -194,6 +268,33 @@ static void parse_commandline(int argc, char *argv[]) {
         ("randomtemp",
             po::value<float>()->default_value(cfg_random_temp),
             "Temperature to use for random move selection.")
+        ("binary-training", "Write training data as packed binary records "
+                            "instead of text.")
+        ("training-compression",
+            po::value<int>()->default_value(cfg_training_compression),
+            "gzip level (0-9) for training data chunks.")
+        ("selfplay", po::value<int>(),
+                     "Play x self-play games in this process, writing "
+                     "their training data and SGF, then exit. "
+                     "Requires --visits or --playouts.")
+        ("selfplay-output",
+            po::value<std::string>()->default_value(cfg_selfplay_output),
+            "Basename for self-play training chunks and SGF.")
+        ("match", po::value<std::string>(),
+                  "Play the network from --weights against the network "
+                  "in file x until the SPRT decides, then exit. "
+                  "Requires --visits or --playouts.")
+        ("match-games",
+            po::value<int>()->default_value(cfg_match_games),
+            "Stop the match after x games even if the SPRT is undecided.")
+        ("match-elo0", po::value<float>()->default_value(cfg_match_elo0),
+                       "SPRT H0: Elo gain of the --weights network.")
+        ("match-elo1", po::value<float>()->default_value(cfg_match_elo1),
+                       "SPRT H1: Elo gain of the --weights network.")
+        ("parallel-games",
+            po::value<unsigned int>()->default_value(cfg_parallel_games),
+            "Games to run at the same time with --selfplay or --match.\n"
+            "0 = one per thread.")
         ;
 #ifdef USE_TUNER
     po::options_description tuner_desc("Tuning options");
@@ -296,7 +397,8 @@ static void parse_commandline(int argc, char *argv[]) {
     }
 
     cfg_weightsfile = vm["weights"].as<std::string>();
-    if (vm["weights"].defaulted() && !boost::filesystem::exists(cfg_weightsfile)) {
+    if (vm["weights"].defaulted() && !vm.count("remote-eval")
+        && !boost::filesystem::exists(cfg_weightsfile)) {
         printf("A network weights file is required to use the program.\n");
         printf("By default, Leela Zero looks for it in %s.\n", cfg_weightsfile.c_str());
         exit(EXIT_FAILURE);
@@ -323,6 +425,14 @@ static void parse_commandline(int argc, char *argv[]) {
     if (vm.count("tune-only")) {
         cfg_tune_only = true;
     }
+
+    if (vm.count("batch-latency")) {
+        cfg_batch_latency = vm["batch-latency"].as<int>();
+        if (cfg_batch_latency < 0) {
+            printf("Batch latency must not be negative.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 #ifdef USE_HALF
     if (vm.count("precision")) {
         auto precision = vm["precision"].as<std::string>();
@@ -365,17 +475,41 @@ static void parse_commandline(int argc, char *argv[]) {
 
     if (vm.count("seed")) {
         cfg_rng_seed = vm["seed"].as<std::uint64_t>();
-        if (cfg_num_threads > 1) {
+        if (cfg_num_threads > 1 && !vm.count("deterministic")) {
             myprintf("Seed specified but multiple threads enabled.\n");
             myprintf("Games will likely not be reproducible.\n");
         }
     }
     myprintf("RNG seed: %llu\n", cfg_rng_seed);
 
+    if (vm.count("lcb-stop")) {
+        cfg_lcb_stop_alpha = vm["lcb-stop"].as<float>();
+        if (cfg_lcb_stop_alpha <= 0.0f || cfg_lcb_stop_alpha >= 0.5f) {
+            printf("lcb-stop must be between 0 and 0.5.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (vm.count("noponder")) {
         cfg_allow_pondering = false;
     }
 
+    if (vm.count("ponder-replies")) {
+        cfg_ponder_replies = vm["ponder-replies"].as<int>();
+    }
+
+    if (vm.count("no-tree-gc")) {
+        cfg_tree_gc = false;
+    }
+
+    if (vm.count("deterministic")) {
+        cfg_deterministic = true;
+    }
+
+    if (vm.count("sgf-index")) {
+        cfg_sgf_index = true;
+    }
+
     if (vm.count("noise")) {
         cfg_noise = true;
     }
@@ -424,6 +558,81 @@ static void parse_commandline(int argc, char *argv[]) {
         cfg_random_temp = vm["randomtemp"].as<float>();
     }
 
+    if (vm.count("binary-training")) {
+        cfg_binary_training = true;
+    }
+
+    if (vm.count("training-compression")) {
+        cfg_training_compression = vm["training-compression"].as<int>();
+        if (cfg_training_compression < 0 || cfg_training_compression > 9) {
+            printf("training-compression must be between 0 and 9.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (vm.count("selfplay")) {
+        cfg_selfplay_games = vm["selfplay"].as<int>();
+        if (cfg_selfplay_games <= 0) {
+            printf("selfplay needs a positive number of games.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!vm.count("playouts") && !vm.count("visits")) {
+            printf("selfplay requires --visits or --playouts.\n");
+            exit(EXIT_FAILURE);
+        }
+        // The games would only print over each other.
+        cfg_quiet = true;
+        cfg_allow_pondering = false;
+    }
+
+    if (vm.count("match")) {
+        cfg_match_weights = vm["match"].as<std::string>();
+        if (!vm.count("playouts") && !vm.count("visits")) {
+            printf("match requires --visits or --playouts.\n");
+            exit(EXIT_FAILURE);
+        }
+        cfg_match_games = vm["match-games"].as<int>();
+        if (cfg_match_games <= 0) {
+            printf("match-games must be positive.\n");
+            exit(EXIT_FAILURE);
+        }
+        cfg_match_elo0 = vm["match-elo0"].as<float>();
+        cfg_match_elo1 = vm["match-elo1"].as<float>();
+        if (cfg_match_elo1 <= cfg_match_elo0) {
+            printf("match-elo1 must be larger than match-elo0.\n");
+            exit(EXIT_FAILURE);
+        }
+        cfg_quiet = true;
+        cfg_allow_pondering = false;
+    }
+
+    if (vm.count("evaluate")) {
+        cfg_evaluate_input = vm["evaluate"].as<std::string>();
+        cfg_evaluate_output = vm["evaluate-output"].as<std::string>();
+        cfg_quiet = true;
+        cfg_allow_pondering = false;
+    }
+
+    if (vm.count("eval-server")) {
+        if (vm.count("remote-eval")) {
+            printf("eval-server and remote-eval can't be combined.\n");
+            exit(EXIT_FAILURE);
+        }
+        cfg_eval_server = vm["eval-server"].as<std::string>();
+    }
+
+    if (vm.count("remote-eval")) {
+        cfg_remote_eval = vm["remote-eval"].as<std::string>();
+    }
+
+    if (vm.count("parallel-games")) {
+        cfg_parallel_games = vm["parallel-games"].as<unsigned int>();
+    }
+
+    if (vm.count("selfplay-output")) {
+        cfg_selfplay_output = vm["selfplay-output"].as<std::string>();
+    }
+
     if (vm.count("timemanage")) {
         auto tm = vm["timemanage"].as<std::string>();
         if (tm == "auto") {
@@ -468,6 +677,31 @@ static void parse_commandline(int argc, char *argv[]) {
         }
     }
 
+    if (vm.count("scaling-benchmark")) {
+        cfg_scaling_threads = parse_count_list(
+            "scaling-benchmark", vm["scaling-benchmark"].as<std::string>());
+        cfg_scaling_batch_sizes = {static_cast<int>(cfg_batch_size)};
+#ifdef USE_OPENCL
+        if (vm.count("scaling-batchsizes")) {
+            cfg_scaling_batch_sizes = parse_count_list(
+                "scaling-batchsizes",
+                vm["scaling-batchsizes"].as<std::string>());
+        }
+#endif
+        cfg_quiet = true;
+        cfg_allow_pondering = false;
+        cfg_noise = false;
+        cfg_random_cnt = 0;
+        cfg_timemanage = TimeManagement::OFF;
+        if (!vm.count("playouts") && !vm.count("visits")) {
+            cfg_max_visits = 1600;
+        }
+        // The thread pool must fit the largest search.
+        cfg_num_threads = std::max(cfg_num_threads, static_cast<unsigned int>(
+            *std::max_element(begin(cfg_scaling_threads),
+                              end(cfg_scaling_threads))));
+    }
+
     // Do not lower the expected eval for root moves that are likely not
     // the best if we have introduced noise there exactly to explore more.
     cfg_fpu_root_reduction = cfg_noise ? 0.0f : cfg_fpu_reduction;
@@ -484,8 +718,12 @@ static void parse_commandline(int argc, char *argv[]) {
 
 static void initialize_network() {
     auto network = std::make_unique<Network>();
-    auto playouts = std::min(cfg_max_playouts, cfg_max_visits);
-    network->initialize(playouts, cfg_weightsfile);
+    if (!cfg_remote_eval.empty()) {
+        network->connect(cfg_remote_eval);
+    } else {
+        auto playouts = std::min(cfg_max_playouts, cfg_max_visits);
+        network->initialize(playouts, cfg_weightsfile);
+    }
 
     GTP::initialize(std::move(network));
 }
@@ -535,7 +773,7 @@ int main(int argc, char *argv[]) {
     setbuf(stdin, nullptr);
 #endif
 
-    if (!cfg_gtp_mode && !cfg_benchmark) {
+    if (!cfg_gtp_mode && !cfg_benchmark && cfg_scaling_threads.empty()) {
         license_blurb();
     }
 
@@ -552,6 +790,47 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (!cfg_scaling_threads.empty()) {
+        const auto json = ScalingBenchmark(*GTP::s_network)
+            .run(cfg_scaling_threads, cfg_scaling_batch_sizes);
+        printf("%s", json.c_str());
+        return 0;
+    }
+
+    if (!cfg_eval_server.empty()) {
+        EvalServer(*GTP::s_network, cfg_eval_server).run();
+        return 0;
+    }
+
+    if (cfg_selfplay_games > 0) {
+        auto parallel = cfg_parallel_games ? cfg_parallel_games
+                                              : cfg_num_threads;
+        SelfPlay(*GTP::s_network, cfg_selfplay_output)
+            .run(cfg_selfplay_games, parallel);
+        return 0;
+    }
+
+    if (!cfg_evaluate_input.empty()) {
+        // Only search when a search size was asked for.
+        auto search = cfg_max_visits != UCTSearch::UNLIMITED_PLAYOUTS
+                      || cfg_max_playouts != UCTSearch::UNLIMITED_PLAYOUTS;
+        auto ok = BulkEvaluator(*GTP::s_network, search)
+            .run(cfg_evaluate_input, cfg_evaluate_output);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (!cfg_match_weights.empty()) {
+        auto opponent = std::make_unique<Network>();
+        opponent->initialize(std::min(cfg_max_playouts, cfg_max_visits),
+                             cfg_match_weights);
+        auto parallel = cfg_parallel_games ? cfg_parallel_games
+                                           : cfg_num_threads;
+        auto status = Match(*GTP::s_network, *opponent,
+                            cfg_match_elo0, cfg_match_elo1)
+            .run(cfg_match_games, parallel);
+        return status.result == Sprt::ACCEPT_H1 ? 0 : 1;
+    }
+
     for (;;) {
         if (!cfg_gtp_mode) {
             maingame->display_state();
@@ -575,5 +854,6 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    GTP::shutdown();
     return 0;
 }
@@ -0,0 +1,242 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#include "config.h"
+#include "Match.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+    struct Probabilities {
+        double win;
+        double loss;
+        double draw;
+    };
+
+    // BayesElo model: a Bayes Elo difference and a draw Elo give the
+    // win, loss and draw probabilities, scale converts from normal Elo.
+    Probabilities bayes_probabilities(double bayes_elo, double draw_elo) {
+        auto p = Probabilities{};
+        p.win = 1.0 / (1.0 + std::pow(10.0, (draw_elo - bayes_elo) / 400.0));
+        p.loss = 1.0 / (1.0 + std::pow(10.0, (draw_elo + bayes_elo) / 400.0));
+        p.draw = 1.0 - p.win - p.loss;
+        return p;
+    }
+
+    double bayes_scale(double draw_elo) {
+        const auto x = std::pow(10.0, -draw_elo / 400.0);
+        return 4.0 * x / ((1.0 + x) * (1.0 + x));
+    }
+}
+
+Sprt::Sprt(double elo0, double elo1, double alpha, double beta)
+    : m_elo0(elo0), m_elo1(elo1), m_alpha(alpha), m_beta(beta) {
+}
+
+void Sprt::add_win() {
+    m_wins++;
+}
+
+void Sprt::add_loss() {
+    m_losses++;
+}
+
+void Sprt::add_draw() {
+    m_draws++;
+}
+
+Sprt::Status Sprt::status() const {
+    auto status = Status{CONTINUE, 0.0, 0.0, 0.0};
+    status.lower_bound = std::log(m_beta / (1.0 - m_alpha));
+    status.upper_bound = std::log((1.0 - m_beta) / m_alpha);
+
+    // Without all three outcomes the draw Elo can't be estimated,
+    // only a one sided score can decide.
+    if (m_wins <= 0 || m_losses <= 0 || m_draws <= 0) {
+        if (m_wins <= 0
+            && m_losses >= std::exp(std::fabs(status.lower_bound))) {
+            status.result = ACCEPT_H0;
+        }
+        if (m_losses <= 0
+            && m_wins >= std::exp(std::fabs(status.upper_bound))) {
+            status.result = ACCEPT_H1;
+        }
+        return status;
+    }
+
+    const auto games = double(m_wins + m_losses + m_draws);
+    const auto p_win = m_wins / games;
+    const auto p_loss = m_losses / games;
+    const auto draw_elo =
+        200.0 * std::log10((1.0 - p_loss) / p_loss * (1.0 - p_win) / p_win);
+
+    const auto scale = bayes_scale(draw_elo);
+    const auto p0 = bayes_probabilities(m_elo0 / scale, draw_elo);
+    const auto p1 = bayes_probabilities(m_elo1 / scale, draw_elo);
+
+    status.llr = m_wins * std::log(p1.win / p0.win)
+               + m_losses * std::log(p1.loss / p0.loss)
+               + m_draws * std::log(p1.draw / p0.draw);
+    if (status.llr > status.upper_bound) {
+        status.result = ACCEPT_H1;
+    } else if (status.llr < status.lower_bound) {
+        status.result = ACCEPT_H0;
+    }
+    return status;
+}
+
+Match::Match(Network& first, Network& second, double elo0, double elo1)
+    : m_first(first), m_second(second),
+      m_sprt(elo0, elo1, SPRT_ALPHA, SPRT_BETA) {
+    // Go games are practically never drawn. Like the validation tool,
+    // start with one draw so the draw Elo is defined.
+    m_sprt.add_draw();
+}
+
+Sprt::Status Match::run(int max_games, size_t parallel) {
+    parallel = std::max(std::min(parallel, size_t(max_games)), size_t{1});
+    // Both players of a game search in turn, so they share its threads.
+    const auto search_threads =
+        std::max(size_t{cfg_num_threads} / parallel, size_t{1});
+    myprintf_error("Playing up to %d games, %zu at a time with %zu "
+                   "thread(s) each.\n", max_games, parallel, search_threads);
+    // Both players of every game keep a tree.
+    m_max_tree_size = cfg_max_tree_size / (2 * parallel);
+
+    UCTSearch::reserve_pool_threads(parallel);
+
+    m_start = Time();
+    auto threads = std::vector<std::thread>{};
+    for (auto i = size_t{0}; i < parallel; i++) {
+        threads.emplace_back(&Match::game_thread, this,
+                             max_games, search_threads);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const auto status = m_sprt.status();
+    const auto seconds = Time::timediff_seconds(m_start, Time());
+    myprintf_error("%d games in %.1fs: %d wins, %d losses, "
+                   "%d wins as black.\n",
+                   m_played, seconds, m_wins, m_losses, m_first_black_wins);
+    if (status.result == Sprt::ACCEPT_H1) {
+        myprintf_error("The first network is better.\n");
+    } else if (status.result == Sprt::ACCEPT_H0) {
+        myprintf_error("The first network is not better.\n");
+    } else {
+        myprintf_error("No decision after %d games.\n", m_played);
+    }
+    return status;
+}
+
+void Match::game_thread(int max_games, size_t search_threads) {
+    for (;;) {
+        const auto index = m_started++;
+        if (index >= max_games || m_decided) {
+            return;
+        }
+        play_game(index, search_threads);
+    }
+}
+
+void Match::play_game(int index, size_t search_threads) {
+    auto game = GameState{};
+    game.init_game(BOARD_SIZE, KOMI);
+    game.set_timecontrol(0, 1, 0, 0);  // Search is limited by visits.
+
+    // Alternate colors, so the first network is black in even games.
+    const auto first_color = index % 2 ? FastBoard::WHITE : FastBoard::BLACK;
+    auto first = std::make_unique<UCTSearch>(game, m_first);
+    auto second = std::make_unique<UCTSearch>(game, m_second);
+    first->set_thread_count(search_threads);
+    second->set_thread_count(search_threads);
+    first->set_max_tree_size(m_max_tree_size);
+    second->set_max_tree_size(m_max_tree_size);
+    // Match games are never dumped as training data.
+    first->set_training_output(false);
+    second->set_training_output(false);
+
+    while (!game.has_resigned() && game.get_passes() < 2) {
+        // The result of an unfinished game can't change the decision.
+        if (m_decided) {
+            return;
+        }
+        const auto color = game.get_to_move();
+        auto& search = color == first_color ? *first : *second;
+        game.play_move(color, search.think(color));
+    }
+    first.reset();
+    second.reset();
+
+    const auto winner = game.get_winner();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_decided) {
+        return;
+    }
+    m_played++;
+    if (winner == first_color) {
+        m_sprt.add_win();
+        m_wins++;
+        m_first_black_wins += first_color == FastBoard::BLACK;
+    } else if (winner == FastBoard::EMPTY) {
+        m_sprt.add_draw();
+    } else {
+        m_sprt.add_loss();
+        m_losses++;
+    }
+
+    const auto status = m_sprt.status();
+    const auto seconds = Time::timediff_seconds(m_start, Time());
+    myprintf_error("Game %d: first network %s as %s, %zu moves. "
+                   "%d-%d, LLR %.2f (%.2f, %.2f), %.1f games/hour\n",
+                   m_played,
+                   winner == first_color ? "won"
+                       : winner == FastBoard::EMPTY ? "drew" : "lost",
+                   first_color == FastBoard::BLACK ? "black" : "white",
+                   game.get_movenum(), m_wins, m_losses, status.llr,
+                   status.lower_bound, status.upper_bound,
+                   m_played * 3600.0 / seconds);
+    if (status.result != Sprt::CONTINUE) {
+        m_decided = true;
+    }
+}
@@ -0,0 +1,111 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#ifndef MATCH_H_INCLUDED
+#define MATCH_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+#include "Network.h"
+#include "Timing.h"
+
+// Sequential probability ratio test on the Elo difference of two
+// players, the same test the validation tool uses. Draws are modeled
+// with a BayesElo draw Elo estimated from the results so far.
+class Sprt {
+public:
+    enum Result {
+        CONTINUE, ACCEPT_H0, ACCEPT_H1
+    };
+    struct Status {
+        Result result;
+        double llr;
+        double lower_bound;
+        double upper_bound;
+    };
+
+    // H0: the first player is elo0 stronger, H1: elo1 stronger.
+    // alpha and beta are the type I and type II error rates.
+    Sprt(double elo0, double elo1, double alpha, double beta);
+
+    void add_win();
+    void add_loss();
+    void add_draw();
+    Status status() const;
+
+private:
+    double m_elo0;
+    double m_elo1;
+    double m_alpha;
+    double m_beta;
+    int m_wins{0};
+    int m_losses{0};
+    int m_draws{0};
+};
+
+// Plays the first network against the second in one process, several
+// games at a time, and stops as soon as the SPRT accepts either
+// hypothesis. Each network batches the positions of all running games.
+class Match {
+public:
+    Match(Network& first, Network& second, double elo0, double elo1);
+
+    // Play at most max_games games, parallel of them at the same time,
+    // and spread cfg_num_threads search threads over them.
+    // Returns the SPRT status at the end.
+    Sprt::Status run(int max_games, size_t parallel);
+
+    static constexpr auto SPRT_ALPHA = 0.05;
+    static constexpr auto SPRT_BETA = 0.05;
+
+private:
+    void game_thread(int max_games, size_t search_threads);
+    void play_game(int index, size_t search_threads);
+
+    Network& m_first;
+    Network& m_second;
+    std::mutex m_mutex;
+    Sprt m_sprt;
+    Time m_start;
+    std::atomic<int> m_started{0};
+    std::atomic<bool> m_decided{false};
+    // Each player's share of cfg_max_tree_size.
+    size_t m_max_tree_size{0};
+    int m_played{0};
+    int m_wins{0};
+    int m_losses{0};
+    int m_first_black_wins{0};
+};
+
+#endif
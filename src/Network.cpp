@@ -61,12 +61,14 @@
 #include "OpenCLScheduler.h"
 #include "UCTNode.h"
 #endif
+#include "EvalServer.h"
 #include "FastBoard.h"
 #include "FastState.h"
 #include "FullBoard.h"
 #include "GameState.h"
 #include "GTP.h"
 #include "NNCache.h"
+#include "PerfCounters.h"
 #include "Random.h"
 #include "ThreadPool.h"
 #include "Timing.h"
@@ -78,19 +80,28 @@ using namespace Utils;
 #ifndef USE_BLAS
 // Eigen helpers
 template <typename T>
-using EigenVectorMap =
-    Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, 1>>;
-template <typename T>
-using ConstEigenVectorMap =
-    Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, 1>>;
+using EigenMatrixMap =
+    Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>>;
 template <typename T>
 using ConstEigenMatrixMap =
     Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>>;
 #endif
 
-// Symmetry helper
-static std::array<std::array<int, NUM_INTERSECTIONS>,
-                  Network::NUM_SYMMETRIES> symmetry_nn_idx_table;
+// Symmetry helper. Filled at startup, so that the static feature
+// functions also work without an initialized network.
+static const auto symmetry_nn_idx_table = []() {
+    auto table = std::array<std::array<int, NUM_INTERSECTIONS>,
+                            Network::NUM_SYMMETRIES>{};
+    for (auto s = 0; s < Network::NUM_SYMMETRIES; ++s) {
+        for (auto v = 0; v < NUM_INTERSECTIONS; ++v) {
+            const auto newvtx = Network::get_symmetry(
+                {v % BOARD_SIZE, v / BOARD_SIZE}, s);
+            table[s][v] = (newvtx.second * BOARD_SIZE) + newvtx.first;
+            assert(table[s][v] >= 0 && table[s][v] < NUM_INTERSECTIONS);
+        }
+    }
+    return table;
+}();
 
 float Network::benchmark_time(int centiseconds) {
     const auto cpus = cfg_num_threads;
@@ -386,11 +397,26 @@ std::pair<int, int> Network::load_network_file(const std::string& filename) {
     return {0, 0};
 }
 
+// The fully connected layers after the head convolutions, see
+// ForwardPipe::OutputHeads.
+class Network::Heads : public ForwardPipe::OutputHeads {
+public:
+    explicit Heads(const Network& network) : m_network(network) {}
+    void compute(size_t batch,
+                 std::vector<float>& pol,
+                 std::vector<float>& val,
+                 std::vector<float>& policy_out,
+                 std::vector<float>& value_out) const override;
+private:
+    const Network& m_network;
+};
+
 std::unique_ptr<ForwardPipe>&& Network::init_net(int channels,
     std::unique_ptr<ForwardPipe>&& pipe) {
 
     pipe->initialize(channels);
     pipe->push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, m_fwd_weights);
+    pipe->set_output_heads(std::make_shared<Heads>(*this));
 
     return std::move(pipe);
 }
@@ -499,18 +525,6 @@ void Network::initialize(int playouts, const std::string & weightsfile) {
     // explicitly set a maximum memory usage.
     m_nncache.set_size_from_playouts(playouts);
 
-    // Prepare symmetry table
-    for (auto s = 0; s < NUM_SYMMETRIES; ++s) {
-        for (auto v = 0; v < NUM_INTERSECTIONS; ++v) {
-            const auto newvtx =
-                get_symmetry({v % BOARD_SIZE, v / BOARD_SIZE}, s);
-            symmetry_nn_idx_table[s][v] =
-                (newvtx.second * BOARD_SIZE) + newvtx.first;
-            assert(symmetry_nn_idx_table[s][v] >= 0
-                   && symmetry_nn_idx_table[s][v] < NUM_INTERSECTIONS);
-        }
-    }
-
     // Load network from file
     size_t channels, residual_blocks;
     std::tie(channels, residual_blocks) = load_network_file(weightsfile);
@@ -588,46 +602,55 @@ void Network::initialize(int playouts, const std::string & weightsfile) {
     m_fwd_weights.reset();
 }
 
+void Network::connect(const std::string & server) {
+    m_remote = std::make_shared<EvalClient>(server);
+}
+
+// Fully connected layer over a batch of inputs, one after the other
+// in input. A single matrix product, so that the weights are read once
+// per batch instead of once per position.
 template<unsigned int inputs,
          unsigned int outputs,
          bool ReLU,
          size_t W>
-std::vector<float> innerproduct(const std::vector<float>& input,
-                                const std::array<float, W>& weights,
-                                const std::array<float, outputs>& biases) {
-    std::vector<float> output(outputs);
+void innerproduct(const size_t batch,
+                  const std::vector<float>& input,
+                  const std::array<float, W>& weights,
+                  const std::array<float, outputs>& biases,
+                  std::vector<float>& output) {
+    output.resize(batch * outputs);
 
 #ifdef USE_BLAS
-    cblas_sgemv(CblasRowMajor, CblasNoTrans,
-                // M     K
-                outputs, inputs,
-                1.0f, &weights[0], inputs,
-                &input[0], 1,
-                0.0f, &output[0], 1);
+    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                // M     N        K
+                batch, outputs, inputs,
+                1.0f, &input[0], inputs,
+                &weights[0], inputs,
+                0.0f, &output[0], outputs);
 #else
-    EigenVectorMap<float> y(output.data(), outputs);
+    EigenMatrixMap<float> y(output.data(), outputs, batch);
     y.noalias() =
         ConstEigenMatrixMap<float>(weights.data(),
                                    inputs,
                                    outputs).transpose()
-        * ConstEigenVectorMap<float>(input.data(), inputs);
+        * ConstEigenMatrixMap<float>(input.data(), inputs, batch);
 #endif
     const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
                                                           val : 0.0f; };
-    for (unsigned int o = 0; o < outputs; o++) {
-        auto val = biases[o] + output[o];
-        if (ReLU) {
-            val = lambda_ReLU(val);
+    for (auto b = size_t{0}; b < batch; b++) {
+        for (unsigned int o = 0; o < outputs; o++) {
+            auto val = biases[o] + output[b * outputs + o];
+            if (ReLU) {
+                val = lambda_ReLU(val);
+            }
+            output[b * outputs + o] = val;
         }
-        output[o] = val;
     }
-
-    return output;
 }
 
 template <size_t spatial_size>
 void batchnorm(const size_t channels,
-               std::vector<float>& data,
+               float* const data,
                const float* const means,
                const float* const stddivs,
                const float* const eltwise = nullptr) {
@@ -653,6 +676,32 @@ void batchnorm(const size_t channels,
     }
 }
 
+void Network::Heads::compute(size_t batch,
+                             std::vector<float>& pol,
+                             std::vector<float>& val,
+                             std::vector<float>& policy_out,
+                             std::vector<float>& value_out) const {
+    constexpr auto pol_size = OUTPUTS_POLICY * NUM_INTERSECTIONS;
+    constexpr auto val_size = OUTPUTS_VALUE * NUM_INTERSECTIONS;
+    const auto& net = m_network;
+
+    for (auto b = size_t{0}; b < batch; b++) {
+        batchnorm<NUM_INTERSECTIONS>(OUTPUTS_POLICY, &pol[b * pol_size],
+            net.m_bn_pol_w1.data(), net.m_bn_pol_w2.data());
+        batchnorm<NUM_INTERSECTIONS>(OUTPUTS_VALUE, &val[b * val_size],
+            net.m_bn_val_w1.data(), net.m_bn_val_w2.data());
+    }
+
+    innerproduct<pol_size, POTENTIAL_MOVES, false>(
+        batch, pol, net.m_ip_pol_w, net.m_ip_pol_b, policy_out);
+
+    auto winrate_data = std::vector<float>{};
+    innerproduct<val_size, VALUE_LAYER, true>(
+        batch, val, net.m_ip1_val_w, net.m_ip1_val_b, winrate_data);
+    innerproduct<VALUE_LAYER, 1, false>(
+        batch, winrate_data, net.m_ip2_val_w, net.m_ip2_val_b, value_out);
+}
+
 #ifdef USE_OPENCL_SELFCHECK
 void Network::compare_net_outputs(const Netresult& data,
                                   const Netresult& ref) {
@@ -739,8 +788,14 @@ Network::Netresult Network::get_output(
         return result;
     }
 
+    if (m_remote) {
+        return get_output_remote(state, ensemble, symmetry,
+                                 read_cache, write_cache);
+    }
+
     if (read_cache) {
         // See if we already have this in the cache.
+        Perf::ScopedTimer timer(Perf::CACHE_PROBE);
         if (probe_cache(state, result)) {
             return result;
         }
@@ -799,45 +854,179 @@ Network::Netresult Network::get_output(
     return result;
 }
 
+std::vector<Network::Netresult> Network::get_output_batch(
+    const std::vector<const GameState*>& states, const int symmetry,
+    const bool read_cache, const bool write_cache) {
+    assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
+    auto results = std::vector<Netresult>(states.size());
+    if (m_remote) {
+        // The server batches whatever its clients send.
+        for (auto i = size_t{0}; i < states.size(); i++) {
+            results[i] = get_output(states[i], DIRECT, symmetry,
+                                    read_cache, write_cache);
+        }
+        return results;
+    }
+
+    auto pending = std::vector<size_t>{};
+    auto input_data = std::vector<float>{};
+    for (auto i = size_t{0}; i < states.size(); i++) {
+        if (states[i]->board.get_boardsize() != BOARD_SIZE) {
+            continue;
+        }
+        if (read_cache) {
+            Perf::ScopedTimer timer(Perf::CACHE_PROBE);
+            if (probe_cache(states[i], results[i])) {
+                continue;
+            }
+        }
+        Perf::ScopedTimer timer(Perf::FEATURES);
+        const auto features = gather_features(states[i], symmetry);
+        input_data.insert(end(input_data), begin(features), end(features));
+        pending.push_back(i);
+    }
+    if (pending.empty()) {
+        return results;
+    }
+    assert(input_data.size()
+           == pending.size() * INPUT_CHANNELS * NUM_INTERSECTIONS);
+
+    auto policy_data = std::vector<float>{};
+    auto value_data = std::vector<float>{};
+    {
+        Perf::ScopedTimer timer(Perf::FORWARD);
+        m_forward->forward_batch(pending.size(), input_data,
+                                 policy_data, value_data);
+    }
+
+    auto policy = std::vector<float>(POTENTIAL_MOVES);
+    for (auto b = size_t{0}; b < pending.size(); b++) {
+        const auto state = states[pending[b]];
+        auto& result = results[pending[b]];
+        std::copy(begin(policy_data) + b * POTENTIAL_MOVES,
+                  begin(policy_data) + (b + 1) * POTENTIAL_MOVES,
+                  begin(policy));
+        result = make_result(policy, value_data[b], symmetry);
+
+        // v2 format (ELF Open Go) returns black value, not stm
+        if (m_value_head_not_stm
+            && state->board.get_to_move() == FastBoard::WHITE) {
+            result.winrate = 1.0f - result.winrate;
+        }
+        if (write_cache) {
+            m_nncache.insert(state->board.get_hash(), result);
+        }
+    }
+    return results;
+}
+
+Network::Netresult Network::get_output_remote(
+    const GameState* const state, const Ensemble ensemble, const int symmetry,
+    const bool read_cache, const bool write_cache) {
+    const auto hash = state->board.get_hash();
+    auto evaluate = [&](const int sym, const bool read, const bool write) {
+        const auto input_data = [&]() {
+            Perf::ScopedTimer timer(Perf::FEATURES);
+            return gather_features(state, sym);
+        }();
+        Perf::ScopedTimer timer(Perf::FORWARD);
+        return m_remote->evaluate(input_data, sym, hash, read, write);
+    };
+
+    if (ensemble == AVERAGE) {
+        assert(symmetry == -1);
+        Netresult result;
+        for (auto sym = 0; sym < NUM_SYMMETRIES; ++sym) {
+            auto tmpresult = evaluate(sym, false, false);
+            result.winrate +=
+                tmpresult.winrate / static_cast<float>(NUM_SYMMETRIES);
+            result.policy_pass +=
+                tmpresult.policy_pass / static_cast<float>(NUM_SYMMETRIES);
+
+            for (auto idx = size_t{0}; idx < NUM_INTERSECTIONS; idx++) {
+                result.policy[idx] +=
+                    tmpresult.policy[idx] / static_cast<float>(NUM_SYMMETRIES);
+            }
+        }
+        return result;
+    }
+    if (ensemble == DIRECT) {
+        assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
+        return evaluate(symmetry, read_cache, write_cache);
+    }
+    assert(ensemble == RANDOM_SYMMETRY);
+    assert(symmetry == -1);
+    const auto rand_sym = Random::get_Rng().randfix<NUM_SYMMETRIES>();
+    return evaluate(rand_sym, read_cache, write_cache);
+}
+
+Network::Netresult Network::get_output_for_features(
+    const std::vector<float>& input_data, const int symmetry,
+    const std::uint64_t hash, const bool read_cache, const bool write_cache) {
+    Netresult result;
+    if (read_cache) {
+        Perf::ScopedTimer timer(Perf::CACHE_PROBE);
+        if (m_nncache.lookup(hash, result)) {
+            return result;
+        }
+    }
+
+    result = get_output_internal(input_data, symmetry);
+
+    // v2 format (ELF Open Go) returns black value, not stm
+    if (m_value_head_not_stm) {
+        const auto blacks_move =
+            input_data[2 * INPUT_MOVES * NUM_INTERSECTIONS] != 0.0f;
+        if (!blacks_move) {
+            result.winrate = 1.0f - result.winrate;
+        }
+    }
+
+    if (write_cache) {
+        m_nncache.insert(hash, result);
+    }
+    return result;
+}
+
 Network::Netresult Network::get_output_internal(
     const GameState* const state, const int symmetry, bool selfcheck) {
-    assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
-    constexpr auto width = BOARD_SIZE;
-    constexpr auto height = BOARD_SIZE;
+    const auto input_data = [&]() {
+        Perf::ScopedTimer timer(Perf::FEATURES);
+        return gather_features(state, symmetry);
+    }();
+    return get_output_internal(input_data, symmetry, selfcheck);
+}
 
-    const auto input_data = gather_features(state, symmetry);
-    std::vector<float> policy_data(OUTPUTS_POLICY * width * height);
-    std::vector<float> value_data(OUTPUTS_VALUE * width * height);
+Network::Netresult Network::get_output_internal(
+    const std::vector<float>& input_data, const int symmetry, bool selfcheck) {
+    assert(symmetry >= 0 && symmetry < NUM_SYMMETRIES);
+    std::vector<float> policy_data(POTENTIAL_MOVES);
+    std::vector<float> value_data(1);
+    {
+        Perf::ScopedTimer timer(Perf::FORWARD);
 #ifdef USE_OPENCL_SELFCHECK
-    if (selfcheck) {
-        m_forward_cpu->forward(input_data, policy_data, value_data);
-    } else {
-        m_forward->forward(input_data, policy_data, value_data);
-    }
+        if (selfcheck) {
+            m_forward_cpu->forward(input_data, policy_data, value_data);
+        } else {
+            m_forward->forward(input_data, policy_data, value_data);
+        }
 #else
-    m_forward->forward(input_data, policy_data, value_data);
-    (void) selfcheck;
+        m_forward->forward(input_data, policy_data, value_data);
+        (void) selfcheck;
 #endif
+    }
 
-    // Get the moves
-    batchnorm<NUM_INTERSECTIONS>(OUTPUTS_POLICY, policy_data,
-        m_bn_pol_w1.data(), m_bn_pol_w2.data());
-    const auto policy_out =
-        innerproduct<OUTPUTS_POLICY * NUM_INTERSECTIONS, POTENTIAL_MOVES, false>(
-            policy_data, m_ip_pol_w, m_ip_pol_b);
-    const auto outputs = softmax(policy_out, cfg_softmax_temp);
-
-    // Now get the value
-    batchnorm<NUM_INTERSECTIONS>(OUTPUTS_VALUE, value_data,
-        m_bn_val_w1.data(), m_bn_val_w2.data());
-    const auto winrate_data =
-        innerproduct<OUTPUTS_VALUE * NUM_INTERSECTIONS, VALUE_LAYER, true>(
-            value_data, m_ip1_val_w, m_ip1_val_b);
-    const auto winrate_out =
-        innerproduct<VALUE_LAYER, 1, false>(winrate_data, m_ip2_val_w, m_ip2_val_b);
+    return make_result(policy_data, value_data[0], symmetry);
+}
+
+Network::Netresult Network::make_result(const std::vector<float>& policy_data,
+                                        const float value,
+                                        const int symmetry) {
+    // The pipe already ran the heads, get the moves
+    const auto outputs = softmax(policy_data, cfg_softmax_temp);
 
     // Map TanH output range [-1..1] to [0..1] range
-    const auto winrate = (1.0f + std::tanh(winrate_out[0])) / 2.0f;
+    const auto winrate = (1.0f + std::tanh(value)) / 2.0f;
 
     Netresult result;
 
@@ -983,7 +1172,7 @@ std::pair<int, int> Network::get_symmetry(const std::pair<int, int>& vertex,
 }
 
 size_t Network::get_estimated_size() {
-    if (estimated_size != 0) {
+    if (estimated_size != 0 || m_remote) {
         return estimated_size;
     }
     auto result = size_t{0};
@@ -1037,3 +1226,12 @@ void Network::nncache_resize(int max_count) {
 void Network::nncache_clear() {
     m_nncache.clear();
 }
+
+void Network::nncache_insert(const std::uint64_t hash,
+                             const Netresult& result) {
+    m_nncache.insert(hash, result);
+}
+
+std::pair<int, int> Network::nncache_hit_rate() const {
+    return m_nncache.hit_rate();
+}
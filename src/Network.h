@@ -63,6 +63,8 @@ constexpr auto WINOGRAD_TILE = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
 constexpr auto WINOGRAD_P = WINOGRAD_WTILES * WINOGRAD_WTILES;
 constexpr auto SQ2 = 1.4142135623730951f; // Square root of 2
 
+class EvalClient;
+
 class Network {
     using ForwardPipeWeights = ForwardPipe::ForwardPipeWeights;
 public:
@@ -81,6 +83,14 @@ public:
                          const bool write_cache = true,
                          const bool force_selfcheck = false);
 
+    // get_output() with Ensemble::DIRECT for many positions, which go
+    // through the network as one batch.
+    std::vector<Netresult> get_output_batch(
+        const std::vector<const GameState*>& states,
+        const int symmetry,
+        const bool read_cache = true,
+        const bool write_cache = true);
+
     static constexpr auto INPUT_MOVES = 8;
     static constexpr auto INPUT_CHANNELS = 2 * INPUT_MOVES + 2;
     static constexpr auto OUTPUTS_POLICY = 2;
@@ -88,6 +98,18 @@ public:
     static constexpr auto VALUE_LAYER = 256;
 
     void initialize(int playouts, const std::string & weightsfile);
+    // Get all evaluations from the EvalServer server instead of
+    // loading a network.
+    void connect(const std::string & server);
+
+    // Evaluate the planes gather_features() made for symmetry, with the
+    // cache keyed on hash, like get_output() evaluates the position the
+    // planes came from. The EvalServer uses this.
+    Netresult get_output_for_features(const std::vector<float>& input_data,
+                                      const int symmetry,
+                                      const std::uint64_t hash,
+                                      const bool read_cache,
+                                      const bool write_cache);
 
     float benchmark_time(int centiseconds);
     void benchmark(const GameState * const state,
@@ -105,6 +127,10 @@ public:
     size_t get_estimated_cache_size();
     void nncache_resize(int max_count);
     void nncache_clear();
+    // Cache an evaluation made with write_cache off.
+    void nncache_insert(std::uint64_t hash, const Netresult& result);
+    // Cache hits and lookups so far.
+    std::pair<int, int> nncache_hit_rate() const;
 
 private:
     std::pair<int, int> load_v1_network(std::istream& wtfile);
@@ -132,11 +158,20 @@ private:
                                std::vector<float>& M, const int C, const int K);
     Netresult get_output_internal(const GameState* const state,
                                   const int symmetry, bool selfcheck = false);
+    Netresult get_output_internal(const std::vector<float>& input_data,
+                                  const int symmetry, bool selfcheck = false);
+    // Softmax and tanh on the outputs of a pipe.
+    static Netresult make_result(const std::vector<float>& policy_data,
+                                 const float value, const int symmetry);
+    Netresult get_output_remote(const GameState* const state,
+                                const Ensemble ensemble, const int symmetry,
+                                const bool read_cache, const bool write_cache);
     static void fill_input_plane_pair(const FullBoard& board,
                                       std::vector<float>::iterator black,
                                       std::vector<float>::iterator white,
                                       const int symmetry);
     bool probe_cache(const GameState* const state, Network::Netresult& result);
+    class Heads;
     std::unique_ptr<ForwardPipe>&& init_net(int channels,
                                             std::unique_ptr<ForwardPipe>&& pipe);
 #ifdef USE_HALF
@@ -149,6 +184,7 @@ private:
 #endif
 
     NNCache m_nncache;
+    std::shared_ptr<EvalClient> m_remote;
 
     size_t estimated_size{0};
 
@@ -47,6 +47,7 @@
 #include "OpenCL.h"
 #include "Network.h"
 #include "GTP.h"
+#include "PerfCounters.h"
 #include "Utils.h"
 #include "Tuner.h"
 
@@ -149,6 +150,14 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
                              std::vector<float>& output_val,
                              OpenCLContext & opencl_context,
                              const int batch_size) {
+    enqueue(input, opencl_context, batch_size);
+    retrieve(output_pol, output_val, opencl_context);
+}
+
+template <typename net_t>
+void OpenCL_Network<net_t>::enqueue(const std::vector<float>& input,
+                                    OpenCLContext & opencl_context,
+                                    const int batch_size) {
     constexpr auto tiles = WINOGRAD_P;
     constexpr auto one_plane = NUM_INTERSECTIONS * sizeof(net_t);
     const auto finalSize_pol = m_layers[m_layers.size()-2].outputs * one_plane;
@@ -192,6 +201,10 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
             m_opencl.m_context,
             CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, alloc_vm_size);
 
+        opencl_context.m_pinnedInBuffer = cl::Buffer(
+            m_opencl.m_context,
+            CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+            getOpenCL().m_batch_size * Network::INPUT_CHANNELS * one_plane);
         opencl_context.m_pinnedOutBuffer_pol = cl::Buffer(
             m_opencl.m_context,
             CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, getOpenCL().m_batch_size * finalSize_pol);
@@ -208,11 +221,17 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
     cl::Buffer & MBuffer = opencl_context.m_MBuffer;
     cl::CommandQueue & queue = opencl_context.m_commandqueue;
 
-    std::vector<net_t> net_t_input(input.size());
-    std::copy(begin(input), end(input), begin(net_t_input));
-
+    // Convert straight into pinned memory, the previous batch on this
+    // context is done so the map doesn't have to wait for the device.
     const auto inSize = sizeof(net_t) * input.size();
-    queue.enqueueWriteBuffer(inBuffer, CL_FALSE, 0, inSize, net_t_input.data());
+    auto pinnedInBufferHost = queue.enqueueMapBuffer(
+        opencl_context.m_pinnedInBuffer, CL_TRUE, CL_MAP_WRITE, 0, inSize);
+    std::copy(begin(input), end(input),
+              static_cast<net_t*>(pinnedInBufferHost));
+    queue.enqueueUnmapMemObject(opencl_context.m_pinnedInBuffer,
+                                pinnedInBufferHost);
+    queue.enqueueCopyBuffer(opencl_context.m_pinnedInBuffer, inBuffer,
+                            0, 0, inSize);
 
     // Fused in_out transformation kernel is slower with big batch_sizes than
     // calling out and in transformations separately.
@@ -304,30 +323,42 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
         }
     }
 
-    auto pinnedOutBufferHost_pol = queue.enqueueMapBuffer(
+    opencl_context.m_pinnedOutBufferHost_pol = queue.enqueueMapBuffer(
         opencl_context.m_pinnedOutBuffer_pol, CL_FALSE,
         CL_MAP_READ, 0, batch_size * finalSize_pol);
-    auto pinnedOutBufferHost_val = queue.enqueueMapBuffer(
+    opencl_context.m_pinnedOutBufferHost_val = queue.enqueueMapBuffer(
         opencl_context.m_pinnedOutBuffer_val, CL_FALSE,
         CL_MAP_READ, 0, batch_size * finalSize_val);
 
+    // Get the device started while the caller prepares the next batch.
+    queue.flush();
+}
+
+template <typename net_t>
+void OpenCL_Network<net_t>::retrieve(std::vector<float>& output_pol,
+                                     std::vector<float>& output_val,
+                                     OpenCLContext & opencl_context) {
+    cl::CommandQueue & queue = opencl_context.m_commandqueue;
     {
+        Perf::ScopedTimer timer(Perf::NN_WAIT);
         // Finish call is usually a busy wait. When using multiple threads
         // use the lock to avoid busy waiting with all threads.
         std::lock_guard<std::mutex> lock(m_queue_finish_mutex);
         queue.finish();
     }
 
-    auto polptr = static_cast<net_t*>(pinnedOutBufferHost_pol);
-    auto valptr = static_cast<net_t*>(pinnedOutBufferHost_val);
+    Perf::ScopedTimer timer(Perf::NN_READBACK);
+    auto polptr = static_cast<net_t*>(opencl_context.m_pinnedOutBufferHost_pol);
+    auto valptr = static_cast<net_t*>(opencl_context.m_pinnedOutBufferHost_val);
     std::copy(polptr, polptr + output_pol.size(), begin(output_pol));
     std::copy(valptr, valptr + output_val.size(), begin(output_val));
 
     queue.enqueueUnmapMemObject(opencl_context.m_pinnedOutBuffer_pol,
-            pinnedOutBufferHost_pol);
+            opencl_context.m_pinnedOutBufferHost_pol);
     queue.enqueueUnmapMemObject(opencl_context.m_pinnedOutBuffer_val,
-            pinnedOutBufferHost_val);
-
+            opencl_context.m_pinnedOutBufferHost_val);
+    opencl_context.m_pinnedOutBufferHost_pol = nullptr;
+    opencl_context.m_pinnedOutBufferHost_val = nullptr;
 }
 
 template <typename net_t>
@@ -948,6 +979,11 @@ std::string OpenCL<net_t>::get_device_name() {
     return ss.str();
 }
 
+template <typename net_t>
+std::string OpenCL<net_t>::get_driver_version() {
+    return m_device.getInfo<CL_DRIVER_VERSION>();
+}
+
 template class OpenCL<float>;
 template class OpenCL_Network<float>;
 #ifdef USE_HALF
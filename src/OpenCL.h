@@ -76,9 +76,13 @@ private:
     cl::Buffer m_inBuffer2;
     cl::Buffer m_VBuffer;
     cl::Buffer m_MBuffer;
+    cl::Buffer m_pinnedInBuffer;
     cl::Buffer m_pinnedOutBuffer_pol;
     cl::Buffer m_pinnedOutBuffer_val;
     bool m_buffers_allocated{false};
+    // Host mappings of the output buffers while a batch is in flight.
+    void* m_pinnedOutBufferHost_pol{nullptr};
+    void* m_pinnedOutBufferHost_val{nullptr};
 };
 
 template <typename net_t>
@@ -151,6 +155,17 @@ public:
             OpenCLContext & opencl_context,
             const int batch_size = 1);
 
+    // forward() in two halves. enqueue() uploads the input and queues
+    // the whole network without waiting for it, retrieve() waits for
+    // the results. With two contexts, the next batch can be submitted
+    // while the previous one is still computing.
+    void enqueue(const std::vector<float>& input,
+                 OpenCLContext & opencl_context,
+                 const int batch_size = 1);
+    void retrieve(std::vector<float>& output_pol,
+                  std::vector<float>& output_val,
+                  OpenCLContext & opencl_context);
+
 private:
     using weight_slice_t = std::vector<cl::Buffer>::const_iterator;
 
@@ -199,6 +214,7 @@ public:
     void initialize(const int channels, size_t batch_size = 1);
     void ensure_context_initialized(OpenCLContext & opencl_context);
     std::string get_device_name();
+    std::string get_driver_version();
     bool has_fp16_compute();
     bool has_tensor_cores();
 
@@ -30,9 +30,14 @@
 
 #ifdef USE_OPENCL
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+
 #include "GTP.h"
 #include "Random.h"
 #include "Network.h"
+#include "PerfCounters.h"
 #include "Utils.h"
 #include "OpenCLScheduler.h"
 
@@ -86,7 +91,9 @@ static std::vector<T> zeropad_U(const std::vector<float>& U,
 }
 
 template <typename net_t>
-OpenCLScheduler<net_t>::OpenCLScheduler() {
+OpenCLScheduler<net_t>::OpenCLScheduler()
+    : m_batch_scheduler(cfg_batch_size,
+                        std::chrono::milliseconds(cfg_batch_latency)) {
     // multi-gpu?
     auto gpus = cfg_gpus;
 
@@ -271,13 +278,52 @@ void OpenCLScheduler<net_t>::forward(const std::vector<float>& input,
     {
         std::unique_lock<std::mutex> lk(m_mutex);
         m_forward_queue.push_back(entry);
+        m_batch_scheduler.add_arrival(entry->queued);
+    }
+    m_cv.notify_one();
+    entry->cv.wait(lk, [&entry]() { return entry->done; });
+}
 
-        if (m_single_eval_in_progress.load()) {
-            m_waittime += 2;
+template <typename net_t>
+void OpenCLScheduler<net_t>::forward_batch(const size_t batch,
+                                           const std::vector<float>& input,
+                                           std::vector<float>& output_pol,
+                                           std::vector<float>& output_val) {
+    constexpr auto in_size = Network::INPUT_CHANNELS * NUM_INTERSECTIONS;
+    assert(input.size() == batch * in_size);
+
+    // Queue all positions at once, so the batch workers can take them
+    // as whole batches without waiting for other threads.
+    auto inputs = std::vector<std::vector<float>>(batch);
+    auto policies = std::vector<std::vector<float>>(
+        batch, std::vector<float>(POTENTIAL_MOVES));
+    auto values = std::vector<std::vector<float>>(
+        batch, std::vector<float>(1));
+    auto entries = std::vector<std::shared_ptr<ForwardQueueEntry>>{};
+    for (auto b = size_t{0}; b < batch; b++) {
+        inputs[b].assign(begin(input) + b * in_size,
+                         begin(input) + (b + 1) * in_size);
+        entries.emplace_back(std::make_shared<ForwardQueueEntry>(
+            inputs[b], policies[b], values[b]));
+    }
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        for (const auto& entry : entries) {
+            m_forward_queue.push_back(entry);
+            m_batch_scheduler.add_arrival(entry->queued);
         }
     }
-    m_cv.notify_one();
-    entry->cv.wait(lk);
+    m_cv.notify_all();
+
+    output_pol.resize(batch * POTENTIAL_MOVES);
+    output_val.resize(batch);
+    for (auto b = size_t{0}; b < batch; b++) {
+        std::unique_lock<std::mutex> lk(entries[b]->mutex);
+        entries[b]->cv.wait(lk, [&]() { return entries[b]->done; });
+        std::copy(begin(policies[b]), end(policies[b]),
+                  begin(output_pol) + b * POTENTIAL_MOVES);
+        output_val[b] = values[b][0];
+    }
 }
 
 #ifndef NDEBUG
@@ -290,59 +336,53 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
     constexpr auto out_pol_size = Network::OUTPUTS_POLICY * BOARD_SIZE * BOARD_SIZE;
     constexpr auto out_val_size = Network::OUTPUTS_VALUE * BOARD_SIZE * BOARD_SIZE;
 
-    OpenCLContext context;
-
-    // batch scheduling heuristic.
-    // Returns the batch picked up from the queue (m_forward_queue)
-    // 1) Wait for m_waittime milliseconds for full batch
-    // 2) if we don't have a full batch then just do a single eval
-    //
-    // The purpose of m_waittime is to prevent the system from deadlocking
-    // because we were waiting for a job too long, while the job is never
-    // going to come due to a control dependency (e.g., evals stuck on a
-    // critical path).  To do so:
+    // Returns the batch picked up from the queue (m_forward_queue).
+    // The batch scheduler picks the batch size and how long the oldest
+    // queued eval may wait for it to fill up.  When that time is up,
+    // whatever is queued goes as a smaller batch, so that evals on the
+    // critical path of the search don't wait for a batch that never fills.
     //
-    // 1) if we couldn't form a batch after waiting m_waittime ms, it means
-    // that we hit the critical path and should do scalar evals.
-    // Wait 1ms shorter next time.
-    //
-    // 2) if we picked up a single eval, but were getting additional evals
-    // while that single eval was being processed, it means that we made
-    // the wrong decision.  Wait 2ms longer next time.
+    // With wait == false a batch is still in flight.  Only pick up a full
+    // batch that is already queued, so its results are never delayed.
 
-    auto pickup_task = [this] () {
+    auto pickup_task = [this] (const bool wait, bool& timed_out) {
         std::list<std::shared_ptr<ForwardQueueEntry>> inputs;
         size_t count = 0;
+        timed_out = false;
 
         std::unique_lock<std::mutex> lk(m_mutex);
         while (true) {
             if (!m_running) return inputs;
 
+            const auto batch_size = m_batch_scheduler.batch_size();
             count = m_forward_queue.size();
-            if (count >= cfg_batch_size) {
-                count = cfg_batch_size;
+            if (count >= batch_size) {
+                count = batch_size;
                 break;
             }
+            if (!wait) {
+                return inputs;
+            }
+            if (count == 0) {
+                m_cv.wait(lk, [this] () {
+                    return !m_running || !m_forward_queue.empty();
+                });
+                continue;
+            }
 
-            bool timeout = !m_cv.wait_for(
-                lk,
-                std::chrono::milliseconds(m_waittime),
-                [this] () {
-                    return !m_running || m_forward_queue.size() >= cfg_batch_size;
+            const auto deadline =
+                m_forward_queue.front()->queued + m_batch_scheduler.timeout();
+            const auto filled = m_cv.wait_until(lk, deadline,
+                [this, batch_size] () {
+                    return !m_running
+                        || m_forward_queue.size() >= batch_size;
                 }
             );
-
-            if (!m_forward_queue.empty()) {
-                if (timeout && m_single_eval_in_progress.exchange(true) == false) {
-                    // Waited long enough but couldn't form a batch.
-                    // Check if there is any other single eval in progress, and if not,
-                    // do one from this thread.
-                    if (m_waittime > 1) {
-                        m_waittime--;
-                    }
-                    count = 1;
-                    break;
-                }
+            if (!filled && !m_forward_queue.empty()) {
+                // Waited long enough but couldn't form a batch.
+                count = std::min(m_forward_queue.size(), batch_size);
+                timed_out = count < batch_size;
+                break;
             }
         }
         // Move 'count' evals from shared queue to local list.
@@ -354,58 +394,113 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
         return inputs;
     };
 
-    auto batch_input = std::vector<float>();
-    auto batch_output_pol = std::vector<float>();
-    auto batch_output_val = std::vector<float>();
-
-    while (true) {
-        auto inputs = pickup_task();
-        auto count = inputs.size();
-
-        if (!m_running) {
-            return;
-        }
+    // Each worker double buffers: the next batch is packed and queued on
+    // one context while the device still works on the other one.
+    struct Batch {
+        OpenCLContext context;
+        std::list<std::shared_ptr<ForwardQueueEntry>> inputs;
+        BatchScheduler::clock::time_point submitted;
+        bool timed_out{false};
+        std::vector<float> input;
+        std::vector<float> output_pol;
+        std::vector<float> output_val;
+        std::vector<float> policy;
+        std::vector<float> value;
+    };
+    std::array<Batch, 2> batches;
 
-#ifndef NDEBUG
-        if (count == 1) {
-            batch_stats.single_evals++;
-        } else {
-            batch_stats.batch_evals++;
-        }
-#endif
+    auto submit = [&](Batch& batch) {
+        Perf::ScopedTimer timer(Perf::NN_SUBMIT);
+        const auto count = batch.inputs.size();
+        batch.submitted = BatchScheduler::clock::now();
 
         // prepare input for forward() call
-        batch_input.resize(in_size * count);
-        batch_output_pol.resize(out_pol_size * count);
-        batch_output_val.resize(out_val_size * count);
+        batch.input.resize(in_size * count);
+        batch.output_pol.resize(out_pol_size * count);
+        batch.output_val.resize(out_val_size * count);
 
         auto index = size_t{0};
-        for (auto & x : inputs) {
+        for (auto & x : batch.inputs) {
             std::unique_lock<std::mutex> lk(x->mutex);
-            std::copy(begin(x->in), end(x->in), begin(batch_input) + in_size * index);
+            std::copy(begin(x->in), end(x->in),
+                      begin(batch.input) + in_size * index);
             index++;
         }
 
-        // run the NN evaluation
-        m_networks[gnum]->forward(
-            batch_input, batch_output_pol, batch_output_val, context, count);
+        // queue the NN evaluation
+        m_networks[gnum]->enqueue(batch.input, batch.context, count);
+    };
+
+    auto complete = [&](Batch& batch) {
+        const auto count = batch.inputs.size();
+        m_networks[gnum]->retrieve(batch.output_pol, batch.output_val,
+                                   batch.context);
+        // The fully connected heads too, as matrix products over
+        // the whole batch.
+        m_heads->compute(count, batch.output_pol, batch.output_val,
+                         batch.policy, batch.value);
 
         // Get output and copy back
-        index = 0;
-        for (auto & x : inputs) {
-            std::copy(begin(batch_output_pol) + out_pol_size * index,
-                      begin(batch_output_pol) + out_pol_size * (index + 1),
+        auto index = size_t{0};
+        for (auto & x : batch.inputs) {
+            std::copy(begin(batch.policy) + POTENTIAL_MOVES * index,
+                      begin(batch.policy) + POTENTIAL_MOVES * (index + 1),
                       begin(x->out_p));
-            std::copy(begin(batch_output_val) + out_val_size * index,
-                      begin(batch_output_val) + out_val_size * (index + 1),
+            std::copy(begin(batch.value) + index,
+                      begin(batch.value) + index + 1,
                       begin(x->out_v));
+            {
+                std::lock_guard<std::mutex> lk(x->mutex);
+                x->done = true;
+            }
             x->cv.notify_all();
             index++;
         }
+        batch.inputs.clear();
+
+        const auto latency = std::chrono::duration_cast<BatchScheduler::duration>(
+            BatchScheduler::clock::now() - batch.submitted);
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_batch_scheduler.add_batch(count, latency, batch.timed_out);
+    };
+
+    auto in_flight = static_cast<Batch*>(nullptr);
+    auto next = size_t{0};
+    while (true) {
+        auto timed_out = false;
+        auto inputs = pickup_task(in_flight == nullptr, timed_out);
+        auto count = inputs.size();
+
+        if (!m_running) {
+            if (in_flight) {
+                complete(*in_flight);
+            }
+            return;
+        }
+
+        auto submitted = static_cast<Batch*>(nullptr);
+        if (count > 0) {
+#ifndef NDEBUG
+            if (count == 1) {
+                batch_stats.single_evals++;
+            } else {
+                batch_stats.batch_evals++;
+            }
+#endif
+
+            Perf::record_batch(count);
+
+            submitted = &batches[next];
+            next ^= 1;
+            submitted->inputs = std::move(inputs);
+            submitted->timed_out = timed_out;
+            submit(*submitted);
+        }
 
-        if (count == 1) {
-            m_single_eval_in_progress = false;
+        if (in_flight) {
+            complete(*in_flight);
         }
+        in_flight = submitted;
     }
 }
 
@@ -35,6 +35,7 @@
 #include <vector>
 #include <thread>
 
+#include "BatchScheduler.h"
 #include "SMP.h"
 #include "ForwardPipe.h"
 #include "OpenCL.h"
@@ -57,10 +58,14 @@ class OpenCLScheduler : public ForwardPipe {
         const std::vector<float>& in;
         std::vector<float>& out_p;
         std::vector<float>& out_v;
+        BatchScheduler::clock::time_point queued;
+        // Set with mutex held once the outputs are written.
+        bool done{false};
         ForwardQueueEntry(const std::vector<float>& input,
                           std::vector<float>& output_pol,
                           std::vector<float>& output_val)
-        : in(input), out_p(output_pol), out_v(output_val)
+        : in(input), out_p(output_pol), out_v(output_val),
+          queued(BatchScheduler::clock::now())
           {}
     };
 public:
@@ -71,6 +76,10 @@ public:
     virtual void forward(const std::vector<float>& input,
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val);
+    virtual void forward_batch(size_t batch,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val);
     virtual bool needs_autodetect();
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
@@ -84,11 +93,8 @@ private:
     std::mutex m_mutex;
     std::condition_variable m_cv;
 
-    // start with 10 milliseconds : lock protected
-    int m_waittime{10};
-
-    // set to true when single (non-batch) eval is in progress
-    std::atomic<bool> m_single_eval_in_progress{false};
+    // Batch size and timeout : lock protected
+    BatchScheduler m_batch_scheduler;
 
     std::list<std::shared_ptr<ForwardQueueEntry>> m_forward_queue;
     std::list<std::thread> m_worker_threads;
@@ -0,0 +1,235 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#include "config.h"
+#include "PerfCounters.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/format.hpp>
+
+using namespace Perf;
+
+std::atomic<bool> Perf::timing_enabled{false};
+
+namespace {
+    struct Totals {
+        std::array<std::uint64_t, NUM_STAGES> calls{};
+        std::array<std::uint64_t, NUM_STAGES> nanos{};
+        std::array<std::uint64_t, MAX_BATCH_BUCKET + 1> batches{};
+
+        Totals& operator+=(const Totals& other) {
+            for (auto i = 0; i < NUM_STAGES; i++) {
+                calls[i] += other.calls[i];
+                nanos[i] += other.nanos[i];
+            }
+            for (auto i = size_t{0}; i < batches.size(); i++) {
+                batches[i] += other.batches[i];
+            }
+            return *this;
+        }
+    };
+
+    // Only the owning thread writes these, other threads only read.
+    struct ThreadCounters {
+        std::array<std::atomic<std::uint64_t>, NUM_STAGES> calls{};
+        std::array<std::atomic<std::uint64_t>, NUM_STAGES> nanos{};
+        std::array<std::atomic<std::uint64_t>, MAX_BATCH_BUCKET + 1> batches{};
+
+        Totals snapshot() const {
+            Totals totals;
+            for (auto i = 0; i < NUM_STAGES; i++) {
+                totals.calls[i] = calls[i].load(std::memory_order_relaxed);
+                totals.nanos[i] = nanos[i].load(std::memory_order_relaxed);
+            }
+            for (auto i = size_t{0}; i < batches.size(); i++) {
+                totals.batches[i] =
+                    batches[i].load(std::memory_order_relaxed);
+            }
+            return totals;
+        }
+    };
+
+    void add(std::atomic<std::uint64_t>& counter, std::uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount,
+                      std::memory_order_relaxed);
+    }
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<ThreadCounters*> threads;
+        // Counters of threads that have exited, and the reset baseline.
+        Totals retired;
+        Totals baseline;
+    };
+
+    // Never destroyed: pool threads can still exit, and retire their
+    // counters, after the static destructors ran.
+    Registry& registry() {
+        static auto& s_registry = *new Registry{};
+        return s_registry;
+    }
+
+    Totals collect() {
+        auto& reg = registry();
+        auto totals = reg.retired;
+        for (const auto counters : reg.threads) {
+            totals += counters->snapshot();
+        }
+        return totals;
+    }
+
+    // Call with the registry mutex held.
+    Totals since_reset() {
+        const auto& baseline = registry().baseline;
+        auto totals = collect();
+        for (auto i = 0; i < NUM_STAGES; i++) {
+            totals.calls[i] -= baseline.calls[i];
+            totals.nanos[i] -= baseline.nanos[i];
+        }
+        for (auto i = size_t{0}; i < totals.batches.size(); i++) {
+            totals.batches[i] -= baseline.batches[i];
+        }
+        return totals;
+    }
+
+    class ThreadSlot {
+    public:
+        ThreadSlot() {
+            auto& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            reg.threads.emplace_back(&m_counters);
+        }
+        ~ThreadSlot() {
+            auto& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            reg.retired += m_counters.snapshot();
+            reg.threads.erase(
+                std::find(begin(reg.threads), end(reg.threads), &m_counters));
+        }
+        ThreadCounters& counters() { return m_counters; }
+    private:
+        ThreadCounters m_counters;
+    };
+
+    ThreadCounters& local_counters() {
+        thread_local ThreadSlot slot;
+        return slot.counters();
+    }
+}
+
+void Perf::record(Stage stage, std::chrono::steady_clock::duration elapsed) {
+    auto& counters = local_counters();
+    add(counters.calls[stage], 1);
+    add(counters.nanos[stage],
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+void Perf::record_batch(size_t count) {
+    auto bucket = std::min(count, size_t{MAX_BATCH_BUCKET});
+    add(local_counters().batches[bucket], 1);
+}
+
+void Perf::reset() {
+    auto& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.baseline = collect();
+}
+
+Perf::BatchTotals Perf::batch_totals() {
+    auto totals = Totals{};
+    {
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        totals = since_reset();
+    }
+    auto result = BatchTotals{};
+    for (auto i = size_t{1}; i < totals.batches.size(); i++) {
+        result.batches += totals.batches[i];
+        result.evals += i * totals.batches[i];
+    }
+    return result;
+}
+
+std::string Perf::report() {
+    static constexpr std::array<const char*, NUM_STAGES> names = {
+        "select", "state copy", "features", "cache probe",
+        "forward", "expand", "backup",
+        "nn submit", "nn wait", "nn readback"
+    };
+
+    auto totals = Totals{};
+    auto threads = size_t{0};
+    {
+        auto& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        totals = since_reset();
+        threads = reg.threads.size();
+    }
+
+    auto out = boost::format("%-12s %12s %12s %10s\n")
+        % "stage" % "calls" % "total ms" % "avg us";
+    auto result = out.str();
+    if (!timing_enabled) {
+        result += "stage timing is off, see lz-perf on\n";
+    }
+    for (auto i = 0; i < NUM_STAGES; i++) {
+        const auto calls = totals.calls[i];
+        const auto ms = totals.nanos[i] / 1e6;
+        const auto avg = calls ? totals.nanos[i] / 1e3 / calls : 0.0;
+        result += str(boost::format("%-12s %12d %12.1f %10.2f\n")
+                      % names[i] % calls % ms % avg);
+    }
+
+    auto batches = std::uint64_t{0};
+    auto evals = std::uint64_t{0};
+    auto histogram = std::string{};
+    for (auto i = size_t{1}; i < totals.batches.size(); i++) {
+        if (!totals.batches[i]) {
+            continue;
+        }
+        batches += totals.batches[i];
+        evals += i * totals.batches[i];
+        histogram += str(boost::format(" %d%s:%d")
+                         % i % (i == MAX_BATCH_BUCKET ? "+" : "")
+                         % totals.batches[i]);
+    }
+    result += str(boost::format("batches %d, average size %.2f\n")
+                  % batches % (batches ? double(evals) / batches : 0.0));
+    if (!histogram.empty()) {
+        result += "batch sizes" + histogram + "\n";
+    }
+    result += str(boost::format("threads %d") % threads);
+    return result;
+}
@@ -0,0 +1,108 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#ifndef PERFCOUNTERS_H_INCLUDED
+#define PERFCOUNTERS_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Low overhead counters for the search hot path. Every thread owns its
+// own set of counters, so recording is a plain relaxed store and never
+// contends. They are only summed up when a report is requested.
+// Timing the stages reads the clock several times per playout, so it is
+// off unless timing_enabled is set, see lz-perf on. Batches are always
+// counted.
+namespace Perf {
+    enum Stage : int {
+        SELECT = 0,
+        STATE_COPY,
+        FEATURES,
+        CACHE_PROBE,
+        FORWARD,
+        EXPAND,
+        BACKUP,
+        // OpenCL batches: packing and queueing, waiting for the device,
+        // and copying the results out.
+        NN_SUBMIT,
+        NN_WAIT,
+        NN_READBACK,
+        NUM_STAGES
+    };
+
+    // Batch sizes above this all land in the last histogram bucket.
+    constexpr auto MAX_BATCH_BUCKET = 64;
+
+    extern std::atomic<bool> timing_enabled;
+
+    void record(Stage stage, std::chrono::steady_clock::duration elapsed);
+    void record_batch(size_t count);
+
+    // Start counting from zero again. Counters of running threads
+    // are not touched, the current totals become the new baseline.
+    void reset();
+    std::string report();
+
+    // Batches and the positions they held since the last reset().
+    struct BatchTotals {
+        std::uint64_t batches{0};
+        std::uint64_t evals{0};
+    };
+    BatchTotals batch_totals();
+
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(Stage stage)
+            : m_stage(stage),
+              m_timing(timing_enabled.load(std::memory_order_relaxed)) {
+            if (m_timing) {
+                m_start = std::chrono::steady_clock::now();
+            }
+        }
+        ~ScopedTimer() {
+            if (m_timing) {
+                record(m_stage, std::chrono::steady_clock::now() - m_start);
+            }
+        }
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+    private:
+        Stage m_stage;
+        bool m_timing;
+        std::chrono::steady_clock::time_point m_start;
+    };
+}
+
+#endif
@@ -32,26 +32,185 @@
 #include <cassert>
 #include <cctype>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <boost/filesystem.hpp>
 
+#include "GTP.h"
 #include "SGFTree.h"
 #include "Utils.h"
 
-std::vector<std::string> SGFParser::chop_stream(std::istream& ins,
-                                                size_t stopat) {
-    std::vector<std::string> result;
-    std::string gamebuff;
+namespace bip = boost::interprocess;
+
+SGFCollection::SGFCollection(const std::string& filename,
+                             const std::string& index_file)
+    : m_filename(filename) {
+    try {
+        m_file_size = boost::filesystem::file_size(filename);
+        m_file_time = boost::filesystem::last_write_time(filename);
+        // Empty files cannot be mapped.
+        if (m_file_size > 0) {
+            m_mapping = bip::file_mapping(filename.c_str(), bip::read_only);
+            m_region = bip::mapped_region(m_mapping, bip::read_only);
+            m_data = static_cast<const char*>(m_region.get_address());
+        }
+    } catch (const std::exception&) {
+        throw std::runtime_error("Error opening file");
+    }
+
+    if (!index_file.empty()) {
+        if (load_index(index_file)) {
+            m_scan.done = true;
+        } else {
+            scan(SIZE_MAX);
+            save_index(index_file);
+        }
+    }
+}
+
+// Same state machine as chop_next, working on offsets into the mapping.
+void SGFCollection::scan(size_t stopat) {
+    const auto size = size_t(m_file_size);
+    auto& s = m_scan;
+
+    while (!s.done && m_index.size() <= stopat) {
+        if (s.pos >= size) {
+            // No game found? Assume closing tag was missing (OGS)
+            if (m_index.empty()) {
+                m_index.emplace_back(s.start, size);
+            }
+            s.done = true;
+            break;
+        }
+
+        auto c = m_data[s.pos++];
+        if (c == '\n') s.line++;
+
+        if (c == '\\') {
+            // skip literal char
+            s.pos = std::min(s.pos + 1, size);
+            continue;
+        }
+
+        if (c == '(' && !s.intag) {
+            if (s.nesting == 0) {
+                // eat ; too
+                while (s.pos < size) {
+                    c = m_data[s.pos++];
+                    if (!std::isspace(c) || c == ';') {
+                        break;
+                    }
+                }
+                s.start = s.pos;
+            }
+            s.nesting++;
+        } else if (c == ')' && !s.intag) {
+            s.nesting--;
+
+            if (s.nesting == 0) {
+                m_index.emplace_back(s.start, s.pos);
+            }
+        } else if (c == '[' && !s.intag) {
+            s.intag = true;
+        } else if (c == ']') {
+            if (s.intag == false) {
+                Utils::myprintf("Tag error on line %d", s.line);
+            }
+            s.intag = false;
+        }
+    }
+}
+
+size_t SGFCollection::size() {
+    scan(SIZE_MAX);
+    return m_index.size();
+}
+
+bool SGFCollection::has_game(size_t index) {
+    scan(index);
+    return index < m_index.size();
+}
 
+std::string SGFCollection::get_game(size_t index) {
+    if (!has_game(index)) {
+        throw std::runtime_error("Game index out of range");
+    }
+    const auto& game = m_index[index];
+    return std::string(m_data + game.first, m_data + game.second);
+}
+
+// Index file layout: "LZSI", the size and modification time of the SGF
+// file, the number of games, then a begin and end offset per game. All
+// values are 64 bit in host byte order.
+bool SGFCollection::load_index(const std::string& index_file) {
+    std::ifstream in(index_file, std::ifstream::binary);
+    auto magic = std::string(4, ' ');
+    auto file_size = std::uint64_t{0};
+    auto file_time = std::int64_t{0};
+    auto count = std::uint64_t{0};
+    in.read(&magic[0], 4);
+    in.read(reinterpret_cast<char*>(&file_size), sizeof(file_size));
+    in.read(reinterpret_cast<char*>(&file_time), sizeof(file_time));
+    in.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if (!in || magic != "LZSI" || file_size != m_file_size
+        || file_time != std::int64_t(m_file_time) || count == 0
+        || count > m_file_size + 1) {
+        return false;
+    }
+
+    auto index = decltype(m_index)(count);
+    in.read(reinterpret_cast<char*>(index.data()),
+            count * sizeof(index[0]));
+    if (!in) {
+        return false;
+    }
+    for (const auto& game : index) {
+        if (game.first > game.second || game.second > m_file_size) {
+            return false;
+        }
+    }
+    m_index = std::move(index);
+    return true;
+}
+
+void SGFCollection::save_index(const std::string& index_file) const {
+    std::ofstream out(index_file, std::ofstream::binary);
+    const auto file_time = std::int64_t(m_file_time);
+    const auto count = std::uint64_t(m_index.size());
+    out.write("LZSI", 4);
+    out.write(reinterpret_cast<const char*>(&m_file_size),
+              sizeof(m_file_size));
+    out.write(reinterpret_cast<const char*>(&file_time), sizeof(file_time));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(m_index.data()),
+              count * sizeof(m_index[0]));
+    if (!out) {
+        Utils::myprintf("Could not write SGF index %s\n", index_file.c_str());
+    }
+}
+
+bool SGFCollection::is_current(const std::string& filename) const {
+    try {
+        return filename == m_filename
+            && boost::filesystem::file_size(filename) == m_file_size
+            && boost::filesystem::last_write_time(filename) == m_file_time;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool SGFParser::chop_next(std::istream& ins, std::string& gamebuff,
+                          int& line) {
     ins >> std::noskipws;
 
     int nesting = 0;      // parentheses
     bool intag = false;   // brackets
-    int line = 0;
     gamebuff.clear();
 
     char c;
-    while (ins >> c && result.size() <= stopat) {
+    while (ins >> c) {
         if (c == '\n') line++;
 
         gamebuff.push_back(c);
@@ -76,7 +235,7 @@ std::vector<std::string> SGFParser::chop_stream(std::istream& ins,
             nesting--;
 
             if (nesting == 0) {
-                result.push_back(gamebuff);
+                return true;
             }
         } else if (c == '[' && !intag) {
             intag = true;
@@ -88,6 +247,19 @@ std::vector<std::string> SGFParser::chop_stream(std::istream& ins,
         }
     }
 
+    return false;
+}
+
+std::vector<std::string> SGFParser::chop_stream(std::istream& ins,
+                                                size_t stopat) {
+    std::vector<std::string> result;
+    std::string gamebuff;
+    int line = 0;
+
+    while (result.size() <= stopat && chop_next(ins, gamebuff, line)) {
+        result.push_back(gamebuff);
+    }
+
     // No game found? Assume closing tag was missing (OGS)
     if (result.size() == 0) {
         result.push_back(gamebuff);
@@ -98,22 +270,29 @@ std::vector<std::string> SGFParser::chop_stream(std::istream& ins,
 
 std::vector<std::string> SGFParser::chop_all(std::string filename,
                                              size_t stopat) {
-    std::ifstream ins(filename.c_str(), std::ifstream::binary | std::ifstream::in);
+    auto collection = SGFCollection{filename};
 
-    if (ins.fail()) {
-        throw std::runtime_error("Error opening file");
+    std::vector<std::string> result;
+    for (auto i = size_t{0}; i <= stopat && collection.has_game(i); i++) {
+        result.emplace_back(collection.get_game(i));
     }
-
-    auto result = chop_stream(ins, stopat);
-    ins.close();
-
     return result;
 }
 
-// scan the file and extract the game with number index
+// extract the game with number index
 std::string SGFParser::chop_from_file(std::string filename, size_t index) {
-    auto vec = chop_all(filename, index);
-    return vec[index];
+    // Keep the last file mapped, so that fetching several games of a
+    // big collection only scans it once.
+    static std::mutex mutex;
+    static std::unique_ptr<SGFCollection> collection;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!collection || !collection->is_current(filename)) {
+        collection.reset();
+        collection = std::make_unique<SGFCollection>(
+            filename, cfg_sgf_index ? filename + ".lzidx" : "");
+    }
+    return collection->get_game(index);
 }
 
 std::string SGFParser::parse_property_name(std::istringstream & strm) {
@@ -33,12 +33,60 @@
 #include <cstddef>
 #include <cstdint>
 #include <climits>
+#include <ctime>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include "SGFTree.h"
 
+// An SGF file mapped into memory together with the offsets of the games
+// in it. The games are cut exactly like chop_stream does, but without
+// copying. The index is extended only as far as the games asked for,
+// and fetching an already indexed game is O(1).
+class SGFCollection {
+public:
+    // If index_file is given, a saved index matching the file is used
+    // instead of scanning, or else the whole file is indexed and the
+    // index is saved there.
+    explicit SGFCollection(const std::string& filename,
+                           const std::string& index_file = "");
+
+    size_t size();
+    bool has_game(size_t index);
+    std::string get_game(size_t index);
+    // True if this still describes filename as it is on disk.
+    bool is_current(const std::string& filename) const;
+
+private:
+    // Index games until there are more than stopat of them.
+    void scan(size_t stopat);
+    bool load_index(const std::string& index_file);
+    void save_index(const std::string& index_file) const;
+
+    // Where scan() stopped.
+    struct ScanState {
+        size_t pos{0};
+        size_t start{0};
+        int nesting{0};      // parentheses
+        bool intag{false};   // brackets
+        int line{0};
+        bool done{false};
+    };
+
+    std::string m_filename;
+    std::uint64_t m_file_size{0};
+    std::time_t m_file_time{0};
+    boost::interprocess::file_mapping m_mapping;
+    boost::interprocess::mapped_region m_region;
+    const char* m_data{nullptr};
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> m_index;
+    ScanState m_scan;
+};
+
 class SGFParser {
 private:
     static std::string parse_property_name(std::istringstream & strm);
@@ -49,6 +97,10 @@ public:
                                              size_t stopat = SIZE_MAX);
     static std::vector<std::string> chop_stream(std::istream& ins,
                                                 size_t stopat = SIZE_MAX);
+    // Read the next game from the stream into gamebuff. Returns false
+    // at the end of the stream, leaving any unterminated game in gamebuff.
+    static bool chop_next(std::istream& ins, std::string& gamebuff,
+                          int& line);
     static void parse(std::istringstream & strm, SGFTree * node);
 };
 
@@ -49,18 +49,32 @@
 using namespace Utils;
 
 const int SGFTree::EOT;
+const int SGFTree::CHECKPOINT_INTERVAL;
 
 void SGFTree::init_state() {
     m_initialized = true;
     // Initialize with defaults.
     // The SGF might be missing boardsize or komi
     // which means we'll never initialize properly.
-    m_state.init_game(std::min(BOARD_SIZE, 19), KOMI);
+    m_checkpoint = std::make_unique<KoState>();
+    m_checkpoint->init_game(std::min(BOARD_SIZE, 19), KOMI);
+    m_boardsize = m_checkpoint->board.get_boardsize();
 }
 
-const KoState * SGFTree::get_state(void) const {
+KoState SGFTree::get_state() const {
     assert(m_initialized);
-    return &m_state;
+    auto path = std::vector<const SGFTree*>{};
+    auto node = this;
+    while (!node->m_checkpoint) {
+        path.push_back(node);
+        node = node->m_parent;
+        assert(node != nullptr);
+    }
+    auto state = *node->m_checkpoint;
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        (*it)->apply_node(state);
+    }
+    return state;
 }
 
 const SGFTree * SGFTree::get_child(size_t count) const {
@@ -79,7 +93,8 @@ GameState SGFTree::follow_mainline_state(unsigned int movenum) const {
     const auto* link = this;
     // This initializes a starting state from a KoState and
     // sets up the game history.
-    GameState result(get_state());
+    const auto start_state = get_state();
+    GameState result(&start_state);
 
     if (m_timecontrol_ptr) {
         result.set_timecontrol(*m_timecontrol_ptr);
@@ -130,6 +145,7 @@ void SGFTree::load_from_file(const std::string& filename, int index) {
 }
 
 void SGFTree::populate_states() {
+    auto& state = *m_checkpoint;
     PropertyMap::iterator it;
     auto valid_size = false;
     auto has_handicap = false;
@@ -157,7 +173,7 @@ void SGFTree::populate_states() {
         strm >> bsize;
         if (bsize == BOARD_SIZE) {
             // Assume default komi in config.h if not specified
-            m_state.init_game(bsize, KOMI);
+            state.init_game(bsize, KOMI);
             valid_size = true;
         } else {
             throw std::runtime_error("Board size not supported.");
@@ -171,19 +187,20 @@ void SGFTree::populate_states() {
         std::istringstream strm(foo);
         float komi;
         strm >> komi;
-        const auto handicap = m_state.get_handicap();
+        const auto handicap = state.get_handicap();
         // last ditch effort: if no GM or SZ, assume 19x19 Go here
         auto bsize = 19;
         if (valid_size) {
-            bsize = m_state.board.get_boardsize();
+            bsize = state.board.get_boardsize();
         }
         if (bsize == BOARD_SIZE) {
-            m_state.init_game(bsize, komi);
-            m_state.set_handicap(handicap);
+            state.init_game(bsize, komi);
+            state.set_handicap(handicap);
         } else {
             throw std::runtime_error("Board size not supported.");
         }
     }
+    m_boardsize = state.board.get_boardsize();
 
     // time
     it = m_properties.find("TM");
@@ -214,7 +231,7 @@ void SGFTree::populate_states() {
         float handicap;
         strm >> handicap;
         has_handicap = (handicap > 0.0f);
-        m_state.set_handicap(int(handicap));
+        state.set_handicap(int(handicap));
     }
 
     // result
@@ -253,7 +270,7 @@ void SGFTree::populate_states() {
     for (auto pit = prop_pair_ab.first; pit != prop_pair_ab.second; ++pit) {
         const auto move = pit->second;
         const auto vtx = string_to_vertex(move);
-        apply_move(FastBoard::BLACK, vtx);
+        apply_move(state, FastBoard::BLACK, vtx);
     }
 
     // XXX: count handicap stones
@@ -261,44 +278,82 @@ void SGFTree::populate_states() {
     for (auto pit = prop_pair_aw.first; pit != prop_pair_aw.second; ++pit) {
         const auto move = pit->second;
         const auto vtx = string_to_vertex(move);
-        apply_move(FastBoard::WHITE, vtx);
+        apply_move(state, FastBoard::WHITE, vtx);
     }
 
     it = m_properties.find("PL");
     if (it != end(m_properties)) {
         const auto who = it->second;
         if (who == "W") {
-            m_state.set_to_move(FastBoard::WHITE);
+            state.set_to_move(FastBoard::WHITE);
         } else if (who == "B") {
-            m_state.set_to_move(FastBoard::BLACK);
+            state.set_to_move(FastBoard::BLACK);
         }
     }
 
-    // now for all children play out the moves
-    for (auto& child_state : m_children) {
-        // propagate state
-        child_state.copy_state(*this);
+    // The root keeps its position as a checkpoint, walk on a copy.
+    auto line_state = std::make_unique<KoState>(state);
+    populate_line(*line_state, 0);
+}
 
-        // XXX: maybe move this to the recursive call
-        // get move for side to move
-        const auto colored_move = child_state.get_colored_move();
-        if (colored_move.first != FastBoard::INVAL) {
-            child_state.apply_move(colored_move.first, colored_move.second);
+// Walks the tree below this node, starting from the position after it.
+// The first child is followed in a loop so only variations recurse, and
+// every node gets the same treatment a fresh replay would give it.
+void SGFTree::populate_line(KoState& state, size_t depth) {
+    auto node = this;
+    while (!node->m_children.empty()) {
+        for (auto i = size_t{1}; i < node->m_children.size(); i++) {
+            auto variation_state = std::make_unique<KoState>(state);
+            node->populate_child(node->m_children[i], *variation_state,
+                                 depth + 1);
+            node->m_children[i].populate_line(*variation_state, depth + 1);
         }
+        node->populate_child(node->m_children[0], state, depth + 1);
+        node = &node->m_children[0];
+        depth++;
+    }
+}
 
-        child_state.populate_states();
+void SGFTree::populate_child(SGFTree& child, KoState& state,
+                             size_t depth) const {
+    child.m_initialized = true;
+    child.m_boardsize = m_boardsize;
+    child.m_parent = this;
+    child.m_timecontrol_ptr = m_timecontrol_ptr;
+    child.apply_node(state);
+    if (depth % CHECKPOINT_INTERVAL == 0) {
+        child.m_checkpoint = std::make_unique<KoState>(state);
     }
 }
 
-void SGFTree::copy_state(const SGFTree& tree) {
-    m_initialized = tree.m_initialized;
-    m_state = tree.m_state;
-    m_timecontrol_ptr = tree.m_timecontrol_ptr;
+// Plays the move of this node and its setup stones.
+void SGFTree::apply_node(KoState& state) const {
+    const auto colored_move = get_colored_move();
+    if (colored_move.first != FastBoard::INVAL) {
+        apply_move(state, colored_move.first, colored_move.second);
+    }
+
+    for (const auto color : {FastBoard::BLACK, FastBoard::WHITE}) {
+        const auto prop = color == FastBoard::BLACK ? "AB" : "AW";
+        const auto& prop_pair = m_properties.equal_range(prop);
+        for (auto pit = prop_pair.first; pit != prop_pair.second; ++pit) {
+            apply_move(state, color, string_to_vertex(pit->second));
+        }
+    }
+
+    const auto it = m_properties.find("PL");
+    if (it != end(m_properties)) {
+        if (it->second == "W") {
+            state.set_to_move(FastBoard::WHITE);
+        } else if (it->second == "B") {
+            state.set_to_move(FastBoard::BLACK);
+        }
+    }
 }
 
-void SGFTree::apply_move(int color, int move) {
+void SGFTree::apply_move(KoState& state, int color, int move) {
     if (move != FastBoard::PASS && move != FastBoard::RESIGN) {
-        auto vtx_state = m_state.board.get_state(move);
+        auto vtx_state = state.board.get_state(move);
         if (vtx_state == !color || vtx_state == FastBoard::INVAL) {
             throw std::runtime_error("Illegal move");
         }
@@ -309,12 +364,7 @@ void SGFTree::apply_move(int color, int move) {
         }
         assert(vtx_state == FastBoard::EMPTY);
     }
-    m_state.play_move(color, move);
-}
-
-void SGFTree::apply_move(int move) {
-    auto color = m_state.get_to_move();
-    apply_move(color, move);
+    state.play_move(color, move);
 }
 
 void SGFTree::add_property(std::string property, std::string value) {
@@ -335,13 +385,13 @@ int SGFTree::string_to_vertex(const std::string& movestring) const {
         return FastBoard::PASS;
     }
 
-    if (m_state.board.get_boardsize() <= 19) {
+    if (m_boardsize <= 19) {
         if (movestring == "tt") {
             return FastBoard::PASS;
         }
     }
 
-    int bsize = m_state.board.get_boardsize();
+    int bsize = m_boardsize;
     if (bsize == 0) {
         throw std::runtime_error("Node has 0 sized board");
     }
@@ -369,7 +419,8 @@ int SGFTree::string_to_vertex(const std::string& movestring) const {
         throw std::runtime_error("Illegal SGF move");
     }
 
-    int vtx = m_state.board.get_vertex(cc1, cc2);
+    // Same as FastBoard::get_vertex, nodes have no board to ask.
+    int vtx = (cc2 + 1) * (bsize + 2) + (cc1 + 1);
 
     return vtx;
 }
@@ -413,7 +464,7 @@ std::vector<int> SGFTree::get_mainline() const {
     std::vector<int> moves;
 
     const auto* link = this;
-    auto tomove = link->m_state.get_to_move();
+    auto tomove = link->get_state().get_to_move();
     link = link->get_child(0);
 
     while (link != nullptr && link->is_initialized()) {
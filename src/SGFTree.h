@@ -32,6 +32,7 @@
 
 #include <cstddef>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -41,14 +42,19 @@
 #include "KoState.h"
 #include "TimeControl.h"
 
+// Nodes only keep their properties. The position at a node is rebuilt
+// on demand by replaying the moves from the nearest checkpoint above
+// it, and checkpoints are only stored every CHECKPOINT_INTERVAL moves.
+// Nodes point to their parent, so a loaded tree must not be moved.
 class SGFTree {
 public:
     static constexpr auto EOT = 0;               // End-Of-Tree marker
+    static constexpr auto CHECKPOINT_INTERVAL = 32;
 
     SGFTree() = default;
     void init_state();
 
-    const KoState * get_state() const;
+    KoState get_state() const;
     GameState follow_mainline_state(unsigned int movenum = 999) const;
     std::vector<int> get_mainline() const;
 
@@ -69,15 +75,19 @@ public:
 
 private:
     void populate_states();
-    void apply_move(int color, int move);
-    void apply_move(int move);
-    void copy_state(const SGFTree& state);
+    void populate_line(KoState& state, size_t depth);
+    void populate_child(SGFTree& child, KoState& state, size_t depth) const;
+    void apply_node(KoState& state) const;
+    static void apply_move(KoState& state, int color, int move);
     int string_to_vertex(const std::string& move) const;
 
     using PropertyMap = std::multimap<std::string, std::string>;
 
     bool m_initialized{false};
-    KoState m_state;
+    int m_boardsize{0};
+    const SGFTree* m_parent{nullptr};
+    // Position after this node, only kept on checkpoint nodes.
+    std::unique_ptr<KoState> m_checkpoint;
     std::shared_ptr<TimeControl> m_timecontrol_ptr;
     FastBoard::vertex_t m_winner{FastBoard::INVAL};
     std::vector<SGFTree> m_children;
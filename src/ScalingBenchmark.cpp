@@ -0,0 +1,219 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+#include "ScalingBenchmark.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <sstream>
+#include <thread>
+#include <boost/format.hpp>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "PerfCounters.h"
+#include "Timing.h"
+#include "Training.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+namespace {
+    // Moves from the empty board, alternating from black. The suite
+    // covers an empty board, openings and a fighting middle game.
+    const std::array<const char*, 6> SUITE = {{
+        "",
+        "r16 d4 c3",
+        "q16 d4 q3 d16 r5 c14 o3 f17",
+        "q16 d4 c16 q4 e17 o3 r6 r3 q6 c6 e4 d5 e5",
+        "d16 q16 d4 q4 f17 c14 r6 o3 q10 l17 c10 e3 f3 e4 f4",
+        "q16 d4 q4 d16 c14 f17 d13 c16 r14 o17 c6 f3 c3 d3 c4 d5 "
+        "b5 e7 p3 k3 r6 q10 o16 p17 r17 q17 r18 j17 l16 k16"
+    }};
+
+    std::string json_string(const std::string& text) {
+        auto out = std::string{"\""};
+        for (const auto c : text) {
+            if (c == '"' || c == '\\') {
+                out.push_back('\\');
+            }
+            out.push_back(c);
+        }
+        return out + "\"";
+    }
+
+    int scaled(int limit, int factor) {
+        return std::min(limit, UCTSearch::UNLIMITED_PLAYOUTS / factor)
+               * factor;
+    }
+}
+
+constexpr int ScalingBenchmark::REFERENCE_FACTOR;
+
+ScalingBenchmark::ScalingBenchmark(Network& network)
+    : m_network(network), m_positions(positions()) {
+}
+
+std::vector<GameState> ScalingBenchmark::positions() {
+    auto result = std::vector<GameState>{};
+    for (const auto moves : SUITE) {
+        auto state = GameState{};
+        state.init_game(BOARD_SIZE, KOMI);
+        state.set_timecontrol(0, 1, 0, 0);  // Set infinite time.
+        auto in = std::istringstream{moves};
+        auto color = std::string{"b"};
+        for (auto move = std::string{}; in >> move; ) {
+            const auto legal = state.play_textmove(color, move);
+            assert(legal);
+            (void)legal;
+            color = color == "b" ? "w" : "b";
+        }
+        result.emplace_back(state);
+    }
+    return result;
+}
+
+int ScalingBenchmark::search(Network& network, const GameState& position,
+                             int threads, int factor, Run* run) {
+    auto state = std::make_unique<GameState>(position);
+    auto search = std::make_unique<UCTSearch>(*state, network);
+    search->set_thread_count(threads);
+    search->set_visit_limit(scaled(cfg_max_visits, factor));
+    search->set_playout_limit(scaled(cfg_max_playouts, factor));
+
+    // Every search starts from an empty cache, so the hit rate shows
+    // transpositions within the search and not earlier searches.
+    network.nncache_clear();
+    const auto cache_before = network.nncache_hit_rate();
+    const auto batches_before = Perf::batch_totals();
+    const auto start = Time{};
+    const auto move = search->think(state->get_to_move(),
+                                    UCTSearch::NORESIGN);
+    const auto end = Time{};
+    // Only the search result is wanted, not the training data.
+    Training::clear_training();
+
+    if (run) {
+        const auto cache_after = network.nncache_hit_rate();
+        const auto batches_after = Perf::batch_totals();
+        run->seconds += Time::timediff_seconds(start, end);
+        run->playouts += search->get_playouts();
+        run->evals += batches_after.evals - batches_before.evals;
+        run->batches += batches_after.batches - batches_before.batches;
+        run->cache_hits += cache_after.first - cache_before.first;
+        run->cache_lookups += cache_after.second - cache_before.second;
+    }
+    return move;
+}
+
+std::string ScalingBenchmark::run(const std::vector<int>& thread_counts,
+                                  const std::vector<int>& batch_sizes) {
+    const auto max_threads =
+        *std::max_element(begin(thread_counts), end(thread_counts));
+
+    myprintf_error("Reference searches with %dx the visits...\n",
+                   REFERENCE_FACTOR);
+    m_reference_moves.clear();
+    for (const auto& position : m_positions) {
+        m_reference_moves.emplace_back(
+            search(m_network, position, max_threads, REFERENCE_FACTOR));
+    }
+
+    auto runs = std::vector<Run>{};
+    const auto default_batch_size = cfg_batch_size;
+    for (const auto batch_size : batch_sizes) {
+        auto network = &m_network;
+        auto reloaded = std::unique_ptr<Network>{};
+        if (static_cast<unsigned int>(batch_size) != default_batch_size) {
+            cfg_batch_size = batch_size;
+            reloaded = std::make_unique<Network>();
+            reloaded->initialize(std::min(cfg_max_playouts, cfg_max_visits),
+                                 cfg_weightsfile);
+            network = reloaded.get();
+        }
+        for (const auto threads : thread_counts) {
+            myprintf_error("%d threads, batch size %d...\n",
+                           threads, batch_size);
+            auto run = Run{threads, batch_size};
+            for (auto i = size_t{0}; i < m_positions.size(); i++) {
+                const auto move =
+                    search(*network, m_positions[i], threads, 1, &run);
+                if (move == m_reference_moves[i]) {
+                    run.agreements++;
+                }
+            }
+            runs.emplace_back(run);
+        }
+        cfg_batch_size = default_batch_size;
+    }
+    return to_json(runs);
+}
+
+std::string ScalingBenchmark::to_json(const std::vector<Run>& runs) const {
+    auto out = std::string{"{\n"};
+    out += str(boost::format("  \"weights\": %s,\n")
+               % json_string(cfg_weightsfile));
+#ifdef USE_OPENCL
+    out += str(boost::format("  \"backend\": \"%s\",\n")
+               % (cfg_cpu_only ? "cpu" : "opencl"));
+#else
+    out += "  \"backend\": \"cpu\",\n";
+#endif
+    out += str(boost::format("  \"hardware_threads\": %d,\n")
+               % std::thread::hardware_concurrency());
+    out += str(boost::format("  \"positions\": %d,\n") % m_positions.size());
+    out += str(boost::format("  \"visits\": %d,\n") % cfg_max_visits);
+    out += str(boost::format("  \"playouts\": %d,\n") % cfg_max_playouts);
+    out += str(boost::format("  \"reference_factor\": %d,\n")
+               % REFERENCE_FACTOR);
+    out += "  \"runs\": [";
+    for (auto i = size_t{0}; i < runs.size(); i++) {
+        const auto& run = runs[i];
+        const auto seconds = std::max(run.seconds, 1e-9);
+        const auto average_batch =
+            run.batches ? double(run.evals) / run.batches : 0.0;
+        out += i ? ",\n" : "\n";
+        out += str(boost::format(
+            "    {\"threads\": %d, \"batch_size\": %d, \"seconds\": %.3f, "
+            "\"playouts_per_second\": %.1f, \"nn_evals_per_second\": %.1f, "
+            "\"cache_hit_rate\": %.4f, \"average_batch\": %.2f, "
+            "\"batch_fill\": %.4f, \"policy_agreement\": %.4f}")
+            % run.threads % run.batch_size % run.seconds
+            % (run.playouts / seconds) % (run.evals / seconds)
+            % (run.cache_lookups
+               ? double(run.cache_hits) / run.cache_lookups : 0.0)
+            % average_batch % (average_batch / run.batch_size)
+            % (double(run.agreements) / m_positions.size()));
+    }
+    out += "\n  ]\n}\n";
+    return out;
+}
@@ -0,0 +1,84 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef SCALINGBENCHMARK_H_INCLUDED
+#define SCALINGBENCHMARK_H_INCLUDED
+
+#include "config.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "GameState.h"
+#include "Network.h"
+
+// Measures how the search scales with the number of threads and, on
+// OpenCL, the batch size. Every setting searches the same fixed suite of
+// positions with the same number of visits. The moves it picks are
+// compared with those of a search with REFERENCE_FACTOR times the visits,
+// so that a faster but less effective setting stands out. Prints the
+// results as JSON.
+class ScalingBenchmark {
+public:
+    static constexpr auto REFERENCE_FACTOR = 8;
+
+    explicit ScalingBenchmark(Network& network);
+
+    // Batch sizes other than the current cfg_batch_size load the network
+    // again.
+    std::string run(const std::vector<int>& thread_counts,
+                    const std::vector<int>& batch_sizes);
+
+private:
+    struct Run {
+        int threads;
+        int batch_size;
+        double seconds{0.0};
+        std::uint64_t playouts{0};
+        std::uint64_t evals{0};
+        std::uint64_t batches{0};
+        int cache_hits{0};
+        int cache_lookups{0};
+        int agreements{0};
+    };
+    static std::vector<GameState> positions();
+    // Searches with the cfg_max_visits and cfg_max_playouts limits times
+    // factor, returns the move and adds the statistics to run.
+    int search(Network& network, const GameState& position, int threads,
+               int factor, Run* run = nullptr);
+    std::string to_json(const std::vector<Run>& runs) const;
+
+    Network& m_network;
+    std::vector<GameState> m_positions;
+    std::vector<int> m_reference_moves;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#include "config.h"
+#include "SelfPlay.h"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "SGFTree.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+
+using namespace Utils;
+
+SelfPlay::SelfPlay(Network& network, const std::string& basename)
+    : m_network(network),
+      m_chunker(basename, true,
+                cfg_binary_training ? Training::binary_header() : ""),
+      m_sgf(basename + ".sgf", std::ios::app) {
+}
+
+void SelfPlay::run(int games, size_t parallel) {
+    parallel = std::max(std::min(parallel, size_t(games)), size_t{1});
+    const auto search_threads =
+        std::max(size_t{cfg_num_threads} / parallel, size_t{1});
+    myprintf_error("Playing %d games, %zu at a time with %zu thread(s) "
+                   "each.\n", games, parallel, search_threads);
+    m_max_tree_size = cfg_max_tree_size / parallel;
+
+    UCTSearch::reserve_pool_threads(parallel);
+
+    m_start = Time();
+    auto threads = std::vector<std::thread>{};
+    for (auto i = size_t{0}; i < parallel; i++) {
+        threads.emplace_back(&SelfPlay::game_thread, this,
+                             games, search_threads);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    m_sgf.flush();
+    m_chunker.close();
+
+    const auto seconds = Time::timediff_seconds(m_start, Time());
+    myprintf_error("%d games, %zu moves in %.1fs: %.1f games/hour, "
+                   "%.1f moves/s, black won %d, %d by resignation.\n",
+                   m_finished, m_moves, seconds,
+                   m_finished * 3600.0 / seconds, m_moves / seconds,
+                   m_black_wins, m_resigned);
+}
+
+void SelfPlay::game_thread(int games, size_t search_threads) {
+    while (m_started++ < games) {
+        play_game(search_threads);
+    }
+}
+
+void SelfPlay::play_game(size_t search_threads) {
+    auto game = GameState{};
+    game.init_game(BOARD_SIZE, KOMI);
+    game.set_timecontrol(0, 1, 0, 0);  // Search is limited by visits.
+    Training::clear_training();
+
+    auto search = std::make_unique<UCTSearch>(game, m_network);
+    search->set_thread_count(search_threads);
+    search->set_max_tree_size(m_max_tree_size);
+    while (!game.has_resigned() && game.get_passes() < 2) {
+        const auto color = game.get_to_move();
+        game.play_move(color, search->think(color));
+    }
+    search.reset();
+
+    const auto winner = game.get_winner();
+    const auto moves = game.get_movenum();
+    auto sgf = SGFTree::state_to_string(game, FastBoard::BLACK);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Training::dump_training(winner, m_chunker);
+    m_sgf << sgf << std::endl;
+
+    m_finished++;
+    m_moves += moves;
+    m_black_wins += winner == FastBoard::BLACK;
+    m_resigned += game.has_resigned();
+    const auto seconds = Time::timediff_seconds(m_start, Time());
+    myprintf_error("Game %d: %s won, %zu moves%s, %.1f games/hour\n",
+                   m_finished, winner == FastBoard::BLACK ? "B" : "W",
+                   moves, game.has_resigned() ? " (resigned)" : "",
+                   m_finished * 3600.0 / seconds);
+}
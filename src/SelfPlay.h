@@ -0,0 +1,77 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+#ifndef SELFPLAY_H_INCLUDED
+#define SELFPLAY_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include "Network.h"
+#include "Timing.h"
+#include "Training.h"
+
+// Plays self-play games on several threads of one process. All games
+// share the network, its cache and its batching, instead of every game
+// loading the weights into a leelaz process of its own.
+class SelfPlay {
+public:
+    // Training chunks go to <basename>.<n>.gz, the games to <basename>.sgf.
+    SelfPlay(Network& network, const std::string& basename);
+
+    // Play games, at most parallel of them at the same time, and
+    // spread cfg_num_threads search threads over them. Returns once
+    // all training chunks are written.
+    void run(int games, size_t parallel);
+
+private:
+    void game_thread(int games, size_t search_threads);
+    void play_game(size_t search_threads);
+
+    Network& m_network;
+    std::mutex m_mutex;
+    OutputChunker m_chunker;
+    std::ofstream m_sgf;
+    Time m_start;
+    std::atomic<int> m_started{0};
+    // Each game's share of cfg_max_tree_size.
+    size_t m_max_tree_size{0};
+    int m_finished{0};
+    size_t m_moves{0};
+    int m_black_wins{0};
+    int m_resigned{0};
+};
+
+#endif
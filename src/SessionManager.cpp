@@ -0,0 +1,221 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+
+#include "config.h"
+#include "SessionManager.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "Utils.h"
+
+using namespace Utils;
+
+SessionManager::Foreground::Foreground(SessionManager& sessions)
+    : m_sessions(sessions) {
+    m_sessions.m_foreground = true;
+    m_sessions.rebalance();
+}
+
+SessionManager::Foreground::~Foreground() {
+    m_sessions.m_foreground = false;
+    m_sessions.rebalance();
+}
+
+SessionManager::SessionManager(Network& network, GameState& maingame)
+    : m_network(network) {
+    auto session = std::make_unique<Session>();
+    session->id = 0;
+    session->game = &maingame;
+    session->search = std::make_unique<UCTSearch>(maingame, m_network);
+    m_sessions.emplace(0, std::move(session));
+}
+
+SessionManager::~SessionManager() {
+    for (auto& entry : m_sessions) {
+        if (entry.second->analysis.joinable()) {
+            halt(*entry.second);
+        }
+    }
+}
+
+int SessionManager::create() {
+    auto session = std::make_unique<Session>();
+    session->id = m_next_id++;
+    session->owned_game = std::make_unique<GameState>();
+    session->owned_game->init_game(BOARD_SIZE, KOMI);
+    session->game = session->owned_game.get();
+    session->search = std::make_unique<UCTSearch>(*session->game, m_network);
+    const auto id = session->id;
+    m_sessions.emplace(id, std::move(session));
+    return id;
+}
+
+bool SessionManager::close(int id) {
+    auto session = find(id);
+    if (id == 0 || !session) {
+        return false;
+    }
+    stop_analysis(*session);
+    m_sessions.erase(id);
+    if (m_current == id) {
+        m_current = 0;
+    }
+    return true;
+}
+
+bool SessionManager::select(int id) {
+    if (!find(id)) {
+        return false;
+    }
+    m_current = id;
+    return true;
+}
+
+SessionManager::Session& SessionManager::current() {
+    return *m_sessions.at(m_current);
+}
+
+SessionManager::Session* SessionManager::find(int id) {
+    auto it = m_sessions.find(id);
+    return it == end(m_sessions) ? nullptr : it->second.get();
+}
+
+size_t SessionManager::tree_size() const {
+    auto total = size_t{0};
+    for (const auto& entry : m_sessions) {
+        total += entry.second->search->get_tree_size();
+    }
+    return total;
+}
+
+std::string SessionManager::list() const {
+    auto result = std::string{};
+    for (const auto& entry : m_sessions) {
+        const auto& session = *entry.second;
+        if (!result.empty()) {
+            result += "\n";
+        }
+        result += std::to_string(session.id)
+            + " moves " + std::to_string(session.game->get_movenum());
+        if (session.analyzing) {
+            result += " analyzing";
+        }
+        if (session.id == m_current) {
+            result += " selected";
+        }
+    }
+    return result;
+}
+
+void SessionManager::start_analysis(Session& session,
+                                    const AnalyzeTags& tags) {
+    stop_analysis(session);
+    session.tags = tags;
+    session.game->set_to_move(tags.who());
+    session.analyzing = true;
+    rebalance();
+}
+
+void SessionManager::stop_analysis(Session& session) {
+    if (!session.analyzing) {
+        return;
+    }
+    if (session.analysis.joinable()) {
+        halt(session);
+    }
+    session.analyzing = false;
+    rebalance();
+}
+
+void SessionManager::rebalance() {
+    auto active = std::vector<Session*>{};
+    for (auto& entry : m_sessions) {
+        auto& session = *entry.second;
+        if (session.analyzing || (m_foreground && session.id == m_current)) {
+            active.emplace_back(&session);
+        } else {
+            session.threads = 0;
+        }
+    }
+    if (active.empty()) {
+        return;
+    }
+
+    UCTSearch::reserve_pool_threads(active.size());
+
+    const auto threads = size_t{cfg_num_threads};
+    auto shares = std::vector<size_t>(active.size());
+    for (auto i = size_t{0}; i < active.size(); i++) {
+        shares[i] = threads / active.size()
+            + (i < threads % active.size() ? 1 : 0);
+        shares[i] = std::max(shares[i], size_t{1});
+    }
+
+    // Shrink the searches that lose threads before growing the others,
+    // so that the helper tasks never outnumber the pool threads.
+    for (auto growing : {false, true}) {
+        for (auto i = size_t{0}; i < active.size(); i++) {
+            auto& session = *active[i];
+            if (shares[i] == session.threads
+                || (shares[i] > session.threads) != growing) {
+                continue;
+            }
+            // A running analysis only picks up its new share
+            // when restarted. It keeps its tree.
+            if (session.analysis.joinable()) {
+                halt(session);
+            }
+            session.threads = shares[i];
+            session.search->set_thread_count(shares[i]);
+            if (session.analyzing) {
+                launch(session);
+            }
+        }
+    }
+}
+
+void SessionManager::launch(Session& session) {
+    session.stop = false;
+    session.search->set_output_prefix(
+        "session " + std::to_string(session.id) + " ");
+    session.analysis = std::thread([&session]() {
+        cfg_analyze_tags = session.tags;
+        session.search->analyze(session.stop);
+        cfg_analyze_tags = {};
+    });
+}
+
+void SessionManager::halt(Session& session) {
+    session.stop = true;
+    session.analysis.join();
+    session.search->set_output_prefix("");
+}
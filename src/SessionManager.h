@@ -0,0 +1,112 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+
+#ifndef SESSIONMANAGER_H_INCLUDED
+#define SESSIONMANAGER_H_INCLUDED
+
+#include "config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "GTP.h"
+#include "GameState.h"
+#include "Network.h"
+#include "UCTSearch.h"
+
+// Independent search sessions hosted by one engine. Every session has
+// its own game and search tree, all of them share the network and its
+// cache. GTP commands go to the selected session, and any number of
+// sessions can analyze in the background at the same time. The search
+// threads are split evenly over the sessions that are searching.
+class SessionManager {
+public:
+    struct Session {
+        int id;
+        GameState* game;
+        std::unique_ptr<GameState> owned_game;
+        std::unique_ptr<UCTSearch> search;
+        // Background analysis, see start_analysis().
+        bool analyzing{false};
+        AnalyzeTags tags;
+        std::thread analysis;
+        std::atomic<bool> stop{false};
+        // Current share of the search threads, 0 when not searching.
+        size_t threads{0};
+    };
+
+    // A search run by the GTP thread on the selected session, such as
+    // genmove or lz-analyze. It gets its fair share of the threads for
+    // as long as this object lives.
+    class Foreground {
+    public:
+        explicit Foreground(SessionManager& sessions);
+        ~Foreground();
+        Foreground(const Foreground&) = delete;
+        Foreground& operator=(const Foreground&) = delete;
+    private:
+        SessionManager& m_sessions;
+    };
+
+    // Session 0 plays on the engine's main game and can't be closed.
+    SessionManager(Network& network, GameState& maingame);
+    ~SessionManager();
+
+    int create();
+    bool close(int id);
+    bool select(int id);
+    Session& current();
+    Session* find(int id);
+    // Memory used by the search trees of all sessions.
+    size_t tree_size() const;
+    std::string list() const;
+
+    // Analysis lines are prefixed with "session <id>".
+    void start_analysis(Session& session, const AnalyzeTags& tags);
+    void stop_analysis(Session& session);
+
+private:
+    void rebalance();
+    void launch(Session& session);
+    void halt(Session& session);
+
+    Network& m_network;
+    std::map<int, std::unique_ptr<Session>> m_sessions;
+    int m_current{0};
+    int m_next_id{1};
+    bool m_foreground{false};
+};
+
+#endif
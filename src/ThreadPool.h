@@ -45,6 +45,8 @@ public:
 
     // create worker threads.  This version has no initializers.
     void initialize(std::size_t);
+    // Add threads until there are at least this many. Never removes any.
+    void ensure_threads(std::size_t threads);
 
     // add an extra thread.  The thread calls initializer() before doing anything,
     // so that the user can initialize per-thread data structures before doing work.
@@ -86,6 +88,13 @@ inline void ThreadPool::initialize(size_t threads) {
     }
 }
 
+inline void ThreadPool::ensure_threads(size_t threads) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (m_threads.size() < threads) {
+        add_thread([](){} /* null function */);
+    }
+}
+
 template<class F, class... Args>
 auto ThreadPool::add_task(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type> {
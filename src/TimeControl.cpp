@@ -271,6 +271,72 @@ int TimeControl::max_time_for_move(int boardsize,
     return base_time + inc_time;
 }
 
+void TimeControl::record_search(int playouts, int centis,
+                                int reused_visits, int total_visits) {
+    // Very short searches give meaningless rates.
+    if (centis < 10 || playouts <= 0 || total_visits <= 0) {
+        return;
+    }
+    const auto rate = static_cast<float>(playouts) / centis;
+    const auto reuse = static_cast<float>(reused_visits) / total_visits;
+    if (m_searches == 0) {
+        m_playout_rate = rate;
+        m_reuse_fraction = reuse;
+    } else {
+        // Exponential moving average, the machine and network don't
+        // change but the positions do.
+        constexpr auto alpha = 0.25f;
+        m_playout_rate += alpha * (rate - m_playout_rate);
+        m_reuse_fraction += alpha * (reuse - m_reuse_fraction);
+    }
+    m_searches++;
+}
+
+float TimeControl::get_playout_rate() const {
+    return m_playout_rate;
+}
+
+int TimeControl::scale_time_for_move(int color, int time_for_move,
+                                     int tree_visits,
+                                     float leader_share) const {
+    // Nothing to gain if we cannot bank the time or have no model yet.
+    if (m_searches == 0 || !can_accumulate_time(color)) {
+        return time_for_move;
+    }
+    // Infinite time.
+    if (m_byotime != 0 && m_byostones == 0 && m_byoperiods == 0) {
+        return time_for_move;
+    }
+    const auto expected_playouts = m_playout_rate * time_for_move;
+    if (expected_playouts < 1.0f) {
+        return time_for_move;
+    }
+    // Without visits in the tree, leader_share says nothing about how
+    // open the position is.
+    if (tree_visits == 0) {
+        return time_for_move;
+    }
+
+    // If the tree we start from is big compared to what we can add,
+    // and it clearly prefers one move, searching won't change much.
+    const auto reused = tree_visits / (tree_visits + expected_playouts);
+    const auto decided = reused * leader_share;
+    // When searches typically pass a large part of their tree on to
+    // the next move, visits spent now are cheap, so spend more time
+    // where the decision is still open.
+    const auto contested = 1.0f - leader_share;
+    const auto factor = 1.0f - 0.5f * decided
+                      + 0.5f * m_reuse_fraction * contested;
+
+    auto scaled = static_cast<int>(time_for_move * factor);
+    if (scaled > time_for_move) {
+        // Never eat into more than half of what is left on the clock.
+        const auto cap = (m_remaining_time[color] - cfg_lagbuffer_cs) / 2;
+        scaled = std::max(time_for_move, std::min(scaled, cap));
+    }
+    return scaled;
+}
+
 void TimeControl::adjust_time(int color, int time, int stones) {
     m_remaining_time[color] = time;
     // From pachi: some GTP things send 0 0 at the end of main time
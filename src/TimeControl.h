@@ -52,6 +52,11 @@ public:
     void display_times();
     void reset_clocks();
     bool can_accumulate_time(int color) const;
+    void record_search(int playouts, int centis,
+                       int reused_visits, int total_visits);
+    float get_playout_rate() const;
+    int scale_time_for_move(int color, int time_for_move,
+                            int tree_visits, float leader_share) const;
     size_t opening_moves(int boardsize) const;
     std::string to_text_sgf() const;
     static std::shared_ptr<TimeControl> make_from_text_sgf(
@@ -74,6 +79,14 @@ private:
     std::array<bool, 2> m_inbyo;             /* player is in byo yomi */
 
     std::array<Time, 2> m_times;             /* storage for player times */
+
+    /*
+        Running model of the search, kept across moves.
+    */
+    int m_searches{0};
+    float m_playout_rate{0.0f};     /* playouts per centisecond */
+    float m_reuse_fraction{0.0f};   /* share of visits inherited from
+                                       previous searches */
 };
 
 #endif
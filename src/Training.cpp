@@ -30,14 +30,22 @@
 #include "Training.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <bitset>
 #include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <utility>
 
 #include "FastBoard.h"
@@ -52,8 +60,9 @@
 #include "Utils.h"
 #include "string.h"
 #include "zlib.h"
+#include "half/half.hpp"
 
-std::vector<TimeStep> Training::m_data{};
+thread_local std::vector<TimeStep> Training::m_data{};
 
 std::ostream& operator <<(std::ostream& stream, const TimeStep& timestep) {
     stream << timestep.planes.size() << ' ';
@@ -95,19 +104,127 @@ std::istream& operator>> (std::istream& stream, TimeStep& timestep) {
     return stream;
 }
 
+namespace {
+    // Single background thread that compresses and writes chunks in
+    // the order they were handed over.
+    class ChunkWriter {
+    public:
+        struct Job {
+            std::string filename;
+            std::string header;
+            std::string data;
+            bool compress;
+            int level;
+            // Called with the error, empty on success, once written.
+            std::function<void(const std::string&)> done;
+        };
+
+        ChunkWriter() : m_thread(&ChunkWriter::worker, this) {}
+        ~ChunkWriter() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_exit = true;
+            }
+            m_cv.notify_all();
+            m_thread.join();
+        }
+
+        void push(Job&& job) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_jobs.emplace_back(std::move(job));
+            }
+            m_cv.notify_all();
+        }
+
+    private:
+        void worker() {
+            for (;;) {
+                auto job = Job{};
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_cv.wait(lock, [this]() {
+                        return m_exit || !m_jobs.empty();
+                    });
+                    if (m_jobs.empty()) {
+                        return;
+                    }
+                    job = std::move(m_jobs.front());
+                    m_jobs.pop_front();
+                }
+                job.done(write(job));
+            }
+        }
+
+        static std::string write(const Job& job) {
+            if (job.compress) {
+                const auto mode = "wb" + std::to_string(job.level);
+                auto out = gzopen(job.filename.c_str(), mode.c_str());
+                if (!out) {
+                    return "Error opening " + job.filename;
+                }
+                auto data = job.header + job.data;
+                auto comp_size = gzwrite(out, data.data(), data.size());
+                gzclose(out);
+                if (!comp_size && !data.empty()) {
+                    return "Error in gzip output";
+                }
+            } else {
+                const auto empty =
+                    std::ifstream{job.filename, std::ifstream::ate}.tellg() <= 0;
+                auto flags = std::ofstream::out | std::ofstream::app;
+                auto out = std::ofstream{job.filename, flags};
+                if (empty) {
+                    out << job.header;
+                }
+                out << job.data;
+                out.close();
+                if (out.fail()) {
+                    return "Error writing " + job.filename;
+                }
+            }
+            return "";
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque<Job> m_jobs;
+        bool m_exit{false};
+        std::thread m_thread;
+    };
+
+    ChunkWriter& chunk_writer() {
+        static ChunkWriter writer;
+        return writer;
+    }
+}
+
 std::string OutputChunker::gen_chunk_name() const {
     auto base = std::string{m_basename};
     base.append("." + std::to_string(m_chunk_count) + ".gz");
     return base;
 }
 
+struct OutputChunker::Pending {
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t jobs{0};
+    std::string error;
+    // Nobody waits on close(), so the last job reports the error.
+    bool in_background{false};
+};
+
 OutputChunker::OutputChunker(const std::string& basename,
-                             bool compress)
-    : m_basename(basename), m_compress(compress) {
+                             bool compress,
+                             const std::string& header)
+    : m_pending(std::make_shared<Pending>()),
+      m_basename(basename), m_header(header), m_compress(compress) {
 }
 
 OutputChunker::~OutputChunker() {
-    flush_chunks();
+    if (!m_closed) {
+        flush_chunks();
+    }
 }
 
 void OutputChunker::append(const std::string& str) {
@@ -118,28 +235,60 @@ void OutputChunker::append(const std::string& str) {
     }
 }
 
-void OutputChunker::flush_chunks() {
-    if (m_compress) {
-        auto chunk_name = gen_chunk_name();
-        auto out = gzopen(chunk_name.c_str(), "wb9");
+void OutputChunker::close() {
+    assert(!m_closed);
+    flush_chunks();
+    m_closed = true;
 
-        auto in_buff_size = m_buffer.size();
-        auto in_buff = std::make_unique<char[]>(in_buff_size);
-        memcpy(in_buff.get(), m_buffer.data(), in_buff_size);
+    std::unique_lock<std::mutex> lock(m_pending->mutex);
+    m_pending->done.wait(lock, [this]() { return m_pending->jobs == 0; });
+    if (!m_pending->error.empty()) {
+        throw std::runtime_error(m_pending->error);
+    }
+}
 
-        auto comp_size = gzwrite(out, in_buff.get(), in_buff_size);
-        if (!comp_size) {
-            throw std::runtime_error("Error in gzip output");
-        }
+void OutputChunker::close_in_background() {
+    assert(!m_closed);
+    {
+        std::lock_guard<std::mutex> lock(m_pending->mutex);
+        m_pending->in_background = true;
+    }
+    flush_chunks();
+    m_closed = true;
+}
+
+void OutputChunker::flush_chunks() {
+    auto job = ChunkWriter::Job{};
+    job.header = m_header;
+    job.data = std::move(m_buffer);
+    job.compress = m_compress;
+    job.level = cfg_training_compression;
+    if (m_compress) {
+        job.filename = gen_chunk_name();
         Utils::myprintf("Writing chunk %d\n",  m_chunk_count);
-        gzclose(out);
     } else {
-        auto chunk_name = m_basename;
-        auto flags = std::ofstream::out | std::ofstream::app;
-        auto out = std::ofstream{chunk_name, flags};
-        out << m_buffer;
-        out.close();
+        job.filename = m_basename;
     }
+    {
+        std::lock_guard<std::mutex> lock(m_pending->mutex);
+        m_pending->jobs++;
+    }
+    // The chunker may be gone by the time the chunk is written.
+    job.done = [pending = m_pending](const std::string& error) {
+        {
+            std::lock_guard<std::mutex> lock(pending->mutex);
+            if (!error.empty() && pending->error.empty()) {
+                pending->error = error;
+            }
+            pending->jobs--;
+            if (pending->in_background && pending->jobs == 0
+                && !pending->error.empty()) {
+                Utils::myprintf("%s\n", pending->error.c_str());
+            }
+        }
+        pending->done.notify_all();
+    };
+    chunk_writer().push(std::move(job));
 
     m_buffer.clear();
     m_chunk_count++;
@@ -210,8 +359,12 @@ void Training::record(Network & network, GameState& state, UCTNode& root) {
 }
 
 void Training::dump_training(int winner_color, const std::string& filename) {
-    auto chunker = OutputChunker{filename, true};
+    auto chunker = OutputChunker{filename, true,
+        cfg_binary_training ? binary_header() : ""};
     dump_training(winner_color, chunker);
+    // Don't hold up the game for the compression. The chunk is on disk
+    // before the process exits, which is when autogtp picks it up.
+    chunker.close_in_background();
 }
 
 void Training::save_training(const std::string& filename) {
@@ -242,9 +395,175 @@ void Training::load_training(std::ifstream& in) {
     }
 }
 
+// Binary layout, all multi-byte values little endian:
+//   header: "LZTD", version, board size, planes per record, 0
+//   record: 16 input planes of BINARY_PLANE_BYTES each, intersection i
+//           in bit (i % 8) of byte (i / 8)
+//           side to move, 0 = black
+//           POTENTIAL_MOVES probabilities as IEEE fp16
+//           game result for the side to move as int8, 1 or -1
+std::string Training::binary_header() {
+    auto header = std::string{"LZTD"};
+    header.push_back(char(BINARY_VERSION));
+    header.push_back(char(BOARD_SIZE));
+    header.push_back(char(16));
+    header.push_back(char(0));
+    assert(header.size() == BINARY_HEADER_SIZE);
+    return header;
+}
+
+bool Training::check_binary_header(const std::string& data) {
+    return data.compare(0, BINARY_HEADER_SIZE, binary_header()) == 0;
+}
+
+void Training::encode_binary(std::string& out, const TimeStep& step,
+                             int winner_color) {
+    const auto start = out.size();
+    out.resize(start + BINARY_RECORD_SIZE, char(0));
+    auto ptr = &out[start];
+    for (auto p = size_t{0}; p < 16; p++) {
+        const auto& plane = step.planes[p];
+        for (auto idx = size_t{0}; idx < plane.size(); idx++) {
+            if (plane[idx]) {
+                ptr[idx / 8] |= char(1 << (idx % 8));
+            }
+        }
+        ptr += BINARY_PLANE_BYTES;
+    }
+    *ptr++ = char(step.to_move == FastBoard::BLACK ? 0 : 1);
+    for (const auto prob : step.probabilities) {
+        const auto bits =
+            half_float::detail::float2half<std::round_to_nearest>(prob);
+        *ptr++ = char(bits & 0xFF);
+        *ptr++ = char(bits >> 8);
+    }
+    *ptr++ = char(step.to_move == winner_color ? 1 : -1);
+    assert(ptr == &out[start] + BINARY_RECORD_SIZE);
+}
+
+bool Training::decode_binary(const std::string& data, size_t& pos,
+                             TimeStep& step, int& result) {
+    if (data.size() < pos + BINARY_RECORD_SIZE) {
+        return false;
+    }
+    auto ptr = reinterpret_cast<const std::uint8_t*>(&data[pos]);
+    step.planes.resize(Network::INPUT_CHANNELS);
+    for (auto p = size_t{0}; p < 16; p++) {
+        auto& plane = step.planes[p];
+        plane.reset();
+        for (auto idx = size_t{0}; idx < plane.size(); idx++) {
+            plane[idx] = (ptr[idx / 8] >> (idx % 8)) & 1;
+        }
+        ptr += BINARY_PLANE_BYTES;
+    }
+    step.to_move = *ptr++ == 0 ? FastBoard::BLACK : FastBoard::WHITE;
+    step.probabilities.resize(POTENTIAL_MOVES);
+    for (auto& prob : step.probabilities) {
+        const auto bits = std::uint16_t(ptr[0] | ptr[1] << 8);
+        prob = half_float::detail::half2float<float>(bits);
+        ptr += 2;
+    }
+    result = static_cast<std::int8_t>(*ptr++);
+    pos += BINARY_RECORD_SIZE;
+    return result == 1 || result == -1;
+}
+
+bool Training::decode_text(const std::string& data, size_t& pos,
+                           TimeStep& step, int& result) {
+    auto line_start = pos;
+    auto line_end = pos;
+    auto next_line = [&]() {
+        if (line_end >= data.size()) {
+            return false;
+        }
+        line_start = line_end;
+        line_end = data.find('\n', line_start);
+        if (line_end == std::string::npos) {
+            return false;
+        }
+        line_end++;
+        return true;
+    };
+    auto hex_value = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    };
+
+    // 16 planes as written by serialize_training: 4 intersections per
+    // hex digit and the odd last one on its own.
+    step.planes.resize(Network::INPUT_CHANNELS);
+    for (auto p = size_t{0}; p < 16; p++) {
+        auto& plane = step.planes[p];
+        if (!next_line()
+            || line_end - line_start != (plane.size() - 1) / 4 + 2) {
+            return false;
+        }
+        plane.reset();
+        auto bit = size_t{0};
+        for (auto i = line_start; bit + 3 < plane.size(); i++, bit += 4) {
+            const auto nibble = hex_value(data[i]);
+            if (nibble < 0) {
+                return false;
+            }
+            plane[bit]     = (nibble >> 3) & 1;
+            plane[bit + 1] = (nibble >> 2) & 1;
+            plane[bit + 2] = (nibble >> 1) & 1;
+            plane[bit + 3] = nibble & 1;
+        }
+        const auto last = data[line_end - 2];
+        if (last != '0' && last != '1') {
+            return false;
+        }
+        plane[bit] = last == '1';
+    }
+
+    if (!next_line() || line_end - line_start != 2) {
+        return false;
+    }
+    step.to_move = data[line_start] == '0' ? FastBoard::BLACK
+                                           : FastBoard::WHITE;
+
+    if (!next_line()) {
+        return false;
+    }
+    step.probabilities.resize(POTENTIAL_MOVES);
+    auto ptr = data.c_str() + line_start;
+    for (auto& prob : step.probabilities) {
+        char* end;
+        prob = std::strtof(ptr, &end);
+        if (end == ptr) {
+            return false;
+        }
+        ptr = end;
+    }
+    if (ptr != data.c_str() + line_end - 1) {
+        return false;
+    }
+
+    if (!next_line()) {
+        return false;
+    }
+    result = std::atoi(data.c_str() + line_start);
+    pos = line_end;
+    return result == 1 || result == -1;
+}
+
 void Training::dump_training(int winner_color, OutputChunker& outchunk) {
+    outchunk.append(serialize_training(m_data, winner_color));
+}
+
+std::string Training::serialize_training(const std::vector<TimeStep>& data,
+                                         int winner_color) {
     auto training_str = std::string{};
-    for (const auto& step : m_data) {
+    if (cfg_binary_training) {
+        training_str.reserve(data.size() * BINARY_RECORD_SIZE);
+        for (const auto& step : data) {
+            encode_binary(training_str, step, winner_color);
+        }
+        return training_str;
+    }
+    for (const auto& step : data) {
         auto out = std::stringstream{};
         // First output 16 times an input feature plane
         for (auto p = size_t{0}; p < 16; p++) {
@@ -284,12 +603,13 @@ void Training::dump_training(int winner_color, OutputChunker& outchunk) {
         out << std::endl;
         training_str.append(out.str());
     }
-    outchunk.append(training_str);
+    return training_str;
 }
 
 void Training::dump_debug(const std::string& filename) {
     auto chunker = OutputChunker{filename, true};
     dump_debug(chunker);
+    chunker.close();
 }
 
 void Training::dump_debug(OutputChunker& outchunk) {
@@ -311,10 +631,9 @@ void Training::dump_debug(OutputChunker& outchunk) {
     outchunk.append(debug_str);
 }
 
-void Training::process_game(GameState& state, size_t& train_pos, int who_won,
+bool Training::process_game(GameState& state,
                             const std::vector<int>& tree_moves,
-                            OutputChunker& outchunker) {
-    clear_training();
+                            std::vector<TimeStep>& steps) {
     auto counter = size_t{0};
     state.rewind();
 
@@ -327,7 +646,7 @@ void Training::process_game(GameState& state, size_t& train_pos, int who_won,
         if (!state.is_move_legal(to_move, move_vertex)) {
             std::cout << "Mainline move not found: " << move_vertex
                       << std::endl;
-            return;
+            return false;
         }
 
         if (move_vertex != FastBoard::PASS) {
@@ -345,67 +664,207 @@ void Training::process_game(GameState& state, size_t& train_pos, int who_won,
         step.probabilities.resize(POTENTIAL_MOVES);
         step.probabilities[move_idx] = 1.0f;
 
-        train_pos++;
-        m_data.emplace_back(step);
+        steps.emplace_back(step);
 
         counter++;
     } while (state.forward_move() && counter < tree_moves.size());
 
-    dump_training(who_won, outchunker);
+    return true;
+}
+
+std::string Training::convert_game(const std::string& sgf,
+                                   size_t& positions) {
+    positions = 0;
+    auto sgftree = std::make_unique<SGFTree>();
+    try {
+        sgftree->load_from_string(sgf);
+    } catch (...) {
+        return "";
+    };
+
+    auto tree_moves = sgftree->get_mainline();
+    // Empty game or couldn't be parsed?
+    if (tree_moves.size() == 0) {
+        return "";
+    }
+
+    auto who_won = sgftree->get_winner();
+    // Accept all komis and handicaps, but reject no usable result
+    if (who_won != FastBoard::BLACK && who_won != FastBoard::WHITE) {
+        return "";
+    }
+
+    auto state =
+        std::make_unique<GameState>(sgftree->follow_mainline_state());
+    // Our board size is hardcoded in several places
+    if (state->board.get_boardsize() != BOARD_SIZE) {
+        return "";
+    }
+
+    auto steps = std::vector<TimeStep>{};
+    if (!process_game(*state, tree_moves, steps)) {
+        return "";
+    }
+    positions = steps.size();
+    return serialize_training(steps, who_won);
 }
 
+// Games are read from the SGF file one at a time and converted by
+// cfg_num_threads workers. The reader stalls when too many games are in
+// flight, so memory use does not depend on the size of the archive.
+// Converted games are either written in file order, or shuffled within
+// a window of SHUFFLE_WINDOW games, and spread round robin over the
+// output shards.
 void Training::dump_supervised(const std::string& sgf_name,
-                               const std::string& out_filename) {
-    auto outchunker = OutputChunker{out_filename, true};
-    auto games = SGFParser::chop_all(sgf_name);
-    auto gametotal = games.size();
-    auto train_pos = size_t{0};
+                               const std::string& out_filename,
+                               size_t shards, bool ordered) {
+    constexpr auto SHUFFLE_WINDOW = size_t{512};
+
+    std::ifstream ins(sgf_name.c_str(),
+                      std::ifstream::binary | std::ifstream::in);
+    if (ins.fail()) {
+        throw std::runtime_error("Error opening file");
+    }
 
-    std::cout << "Total games in file: " << gametotal << std::endl;
-    // Shuffle games around
-    std::cout << "Shuffling...";
-    std::shuffle(begin(games), end(games), Random::get_Rng());
-    std::cout << "done." << std::endl;
+    shards = std::max(shards, size_t{1});
+    auto chunkers = std::vector<std::unique_ptr<OutputChunker>>{};
+    for (auto i = size_t{0}; i < shards; i++) {
+        auto name = out_filename;
+        if (shards > 1) {
+            name += "." + std::to_string(i);
+        }
+        chunkers.emplace_back(std::make_unique<OutputChunker>(name, true,
+            cfg_binary_training ? binary_header() : ""));
+    }
 
-    Time start;
-    for (auto gamecount = size_t{0}; gamecount < gametotal; gamecount++) {
-        auto sgftree = std::make_unique<SGFTree>();
-        try {
-            sgftree->load_from_string(games[gamecount]);
-        } catch (...) {
-            continue;
-        };
+    struct Converted {
+        size_t positions;
+        std::string data;
+    };
+
+    const auto threads = std::max(size_t{cfg_num_threads}, size_t{1});
+    const auto max_in_flight = 16 * threads;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<size_t, std::string>> queue;
+    auto input_done = false;
+    // Ordered output: converted games waiting for their predecessors.
+    auto pending = std::map<size_t, Converted>{};
+    auto shuffle_buffer = std::vector<Converted>{};
+    auto games_read = size_t{0};
+    auto games_done = size_t{0};
+    auto games_written = size_t{0};
+    auto train_pos = size_t{0};
 
-        if (gamecount > 0 && gamecount % 1000 == 0) {
+    Time start;
+    // Called with mutex held.
+    auto write = [&](Converted& game) {
+        if (game.data.empty()) {
+            return;
+        }
+        chunkers[games_written % shards]->append(game.data);
+        games_written++;
+        train_pos += game.positions;
+        if (games_written % 1000 == 0) {
             Time elapsed;
             auto elapsed_s = Time::timediff_seconds(start, elapsed);
             Utils::myprintf(
                 "Game %5d, %5d positions in %5.2f seconds -> %d pos/s\n",
-                gamecount, train_pos, elapsed_s, int(train_pos / elapsed_s));
+                games_written, train_pos, elapsed_s,
+                int(train_pos / elapsed_s));
         }
+    };
+    auto write_random = [&]() {
+        auto idx = Random::get_Rng().randuint64(shuffle_buffer.size());
+        std::swap(shuffle_buffer[idx], shuffle_buffer.back());
+        write(shuffle_buffer.back());
+        shuffle_buffer.pop_back();
+    };
+
+    auto worker = [&]() {
+        for (;;) {
+            auto game = std::pair<size_t, std::string>{};
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return input_done || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                game = std::move(queue.front());
+                queue.pop_front();
+            }
 
-        auto tree_moves = sgftree->get_mainline();
-        // Empty game or couldn't be parsed?
-        if (tree_moves.size() == 0) {
-            continue;
+            auto converted = Converted{};
+            converted.data = convert_game(game.second, converted.positions);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ordered) {
+                pending.emplace(game.first, std::move(converted));
+                while (!pending.empty()
+                       && pending.begin()->first == games_done) {
+                    write(pending.begin()->second);
+                    pending.erase(pending.begin());
+                    games_done++;
+                }
+            } else {
+                if (!converted.data.empty()) {
+                    shuffle_buffer.emplace_back(std::move(converted));
+                    if (shuffle_buffer.size() > SHUFFLE_WINDOW) {
+                        write_random();
+                    }
+                }
+                games_done++;
+            }
+            cv.notify_all();
         }
+    };
 
-        auto who_won = sgftree->get_winner();
-        // Accept all komis and handicaps, but reject no usable result
-        if (who_won != FastBoard::BLACK && who_won != FastBoard::WHITE) {
-            continue;
-        }
+    auto workers = std::vector<std::thread>{};
+    for (auto i = size_t{0}; i < threads; i++) {
+        workers.emplace_back(worker);
+    }
 
-        auto state =
-            std::make_unique<GameState>(sgftree->follow_mainline_state());
-        // Our board size is hardcoded in several places
-        if (state->board.get_boardsize() != BOARD_SIZE) {
-            continue;
+    auto gamebuff = std::string{};
+    auto line = 0;
+    auto more = true;
+    while (more) {
+        more = SGFParser::chop_next(ins, gamebuff, line);
+        // No game found? Assume closing tag was missing (OGS)
+        if (!more && (games_read > 0 || gamebuff.empty())) {
+            break;
         }
-
-        process_game(*state, train_pos, who_won, tree_moves,
-                    outchunker);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() {
+            return games_read - games_done < max_in_flight;
+        });
+        queue.emplace_back(games_read++, std::move(gamebuff));
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        input_done = true;
+    }
+    cv.notify_all();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    while (!shuffle_buffer.empty()) {
+        write_random();
     }
 
+    // Flush the last chunks and wait for the writer to finish.
+    for (auto& chunker : chunkers) {
+        chunker->close();
+    }
+    chunkers.clear();
+
+    Time elapsed;
+    auto elapsed_s = Time::timediff_seconds(start, elapsed);
+    std::cout << "Total games in file: " << games_read << std::endl;
+    Utils::myprintf("Converted %d games, %d positions in %5.2f seconds "
+                    "-> %d pos/s with %d threads\n",
+                    games_written, train_pos, elapsed_s,
+                    int(train_pos / elapsed_s), threads);
     std::cout << "Dumped " << train_pos << " training positions." << std::endl;
 }
@@ -34,6 +34,7 @@
 
 #include <bitset>
 #include <cstddef>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -58,21 +59,40 @@ public:
 std::ostream& operator<< (std::ostream& stream, const TimeStep& timestep);
 std::istream& operator>> (std::istream& stream, TimeStep& timestep);
 
+// Chunks are compressed and written by a background thread, so
+// flushing never blocks the caller on gzip.
 class OutputChunker {
 public:
-    OutputChunker(const std::string& basename, bool compress = false);
+    // header is written at the start of every new output file.
+    OutputChunker(const std::string& basename, bool compress = false,
+                  const std::string& header = "");
     ~OutputChunker();
     void append(const std::string& str);
 
+    // Hand the games appended so far to the writer and block until all
+    // chunks of this chunker are on disk. Throws if any of them could
+    // not be written. Nothing can be appended afterwards.
+    void close();
+    // Like close() but returns at once. The writer finishes the chunks
+    // in the background, before the process exits, and prints any error.
+    void close_in_background();
+
     // Group this many games in a batch.
     static constexpr size_t CHUNK_SIZE = 32;
 private:
+    // Chunks of this chunker the writer didn't finish yet, and the
+    // first error writing them.
+    struct Pending;
+
     std::string gen_chunk_name() const;
     void flush_chunks();
+    std::shared_ptr<Pending> m_pending;
+    bool m_closed{false};
     size_t m_game_count{0};
     size_t m_chunk_count{0};
     std::string m_buffer;
     std::string m_basename;
+    std::string m_header;
     bool m_compress{false};
 };
 
@@ -81,25 +101,51 @@ public:
     static void clear_training();
     static void dump_training(int winner_color,
                               const std::string& out_filename);
+    static void dump_training(int winner_color,
+                              OutputChunker& outchunker);
     static void dump_debug(const std::string& out_filename);
     static void record(Network & network, GameState& state, UCTNode& node);
 
     static void dump_supervised(const std::string& sgf_file,
-                                const std::string& out_filename);
+                                const std::string& out_filename,
+                                size_t shards = 1, bool ordered = false);
     static void save_training(const std::string& filename);
     static void load_training(const std::string& filename);
 
-private:
+    // Packed binary training data, see Training.cpp for the layout.
+    static constexpr auto BINARY_VERSION = 1;
+    static constexpr auto BINARY_HEADER_SIZE = size_t{8};
+    static constexpr auto BINARY_PLANE_BYTES = (NUM_INTERSECTIONS + 7) / 8;
+    static constexpr auto BINARY_RECORD_SIZE =
+        16 * BINARY_PLANE_BYTES + 1 + 2 * POTENTIAL_MOVES + 1;
+    static std::string binary_header();
+    static bool check_binary_header(const std::string& data);
+    static void encode_binary(std::string& out, const TimeStep& step,
+                              int winner_color);
+    // Decodes the record at pos and advances pos past it. result is
+    // +1 or -1 for the side to move.
+    static bool decode_binary(const std::string& data, size_t& pos,
+                              TimeStep& step, int& result);
+    // Same for one record of the text format.
+    static bool decode_text(const std::string& data, size_t& pos,
+                            TimeStep& step, int& result);
+
     static TimeStep::NNPlanes get_planes(const GameState* const state);
-    static void process_game(GameState& state, size_t& train_pos, int who_won,
+    static std::string serialize_training(const std::vector<TimeStep>& data,
+                                          int winner_color);
+
+private:
+    static bool process_game(GameState& state,
                              const std::vector<int>& tree_moves,
-                             OutputChunker& outchunker);
-    static void dump_training(int winner_color,
-                              OutputChunker& outchunker);
+                             std::vector<TimeStep>& steps);
+    static std::string convert_game(const std::string& sgf,
+                                    size_t& positions);
     static void dump_debug(OutputChunker& outchunker);
     static void save_training(std::ofstream& out);
     static void load_training(std::ifstream& in);
-    static std::vector<TimeStep> m_data;
+    // Each thread records its own game, so self-play can run several
+    // games in one process.
+    static thread_local std::vector<TimeStep> m_data;
 };
 
 #endif
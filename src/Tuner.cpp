@@ -30,6 +30,7 @@
 #include "config.h"
 
 #ifdef USE_OPENCL
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <iostream>
@@ -38,7 +39,7 @@
 #include <map>
 #include <random>
 #include <cmath>
-#include <fstream>
+#include <boost/format.hpp>
 #ifndef USE_BLAS
 #include <Eigen/Dense>
 #endif
@@ -46,6 +47,7 @@
 #include "GTP.h"
 #include "OpenCL.h"
 #include "Tuner.h"
+#include "TunerDatabase.h"
 #include "Utils.h"
 #include "Random.h"
 
@@ -301,8 +303,46 @@ static float compare_ref(std::vector<net_t> &x, std::vector<net_t> &ref,
     return sum / (m * n * batch_size);
 }
 
+// Rough relative cost of a configuration, lower is better. It only decides
+// which configurations are worth compiling and timing at all.
 template <typename net_t>
-std::vector<Parameters> Tuner<net_t>::build_valid_params() {
+float Tuner<net_t>::estimate_cost(Parameters p, const int m, const int n,
+                                  const int k) {
+    auto m_ceil = ceilMultiple(ceilMultiple(m, p["MWG"]), p["VWM"]);
+    auto n_ceil = ceilMultiple(ceilMultiple(n, p["NWG"]), p["VWN"]);
+    auto k_ceil = ceilMultiple(ceilMultiple(k, p["KWG"]), p["VWM"]);
+
+    // Work spent on padding.
+    auto cost = float(m_ceil) * n_ceil * k_ceil / (float(m) * n * k);
+
+    // Small work-groups leave the compute units idle, big ones limit how
+    // many groups can be in flight.
+    auto workgroup = p["MDIMC"] * p["NDIMC"];
+    if (p["TCE"]) {
+        workgroup = 32 * p["MDIMC"] / p["MDIMA"] * p["NDIMC"] / p["NDIMB"];
+    } else {
+        // Outputs each work-item keeps in registers.
+        auto tile = (p["MWG"] / p["MDIMC"]) * (p["NWG"] / p["NDIMC"]);
+        if (tile < 4) {
+            cost *= 4.0f / tile;
+        } else if (tile > 64) {
+            cost *= tile / 64.0f;
+        }
+        // Wider loads are cheaper, up to a point.
+        cost *= 1.0f + 0.5f / std::min(p["VWM"] * p["VWN"], size_t{8});
+    }
+    if (workgroup < 64) {
+        cost *= 64.0f / workgroup;
+    } else if (workgroup > 256) {
+        cost *= workgroup / 256.0f;
+    }
+    return cost;
+}
+
+template <typename net_t>
+std::vector<Parameters> Tuner<net_t>::build_valid_params(const int m,
+                                                         const int n,
+                                                         const int k) {
     auto opts = std::vector<Configurations>();
     if (cfg_sgemm_exhaustive) {
         opts = {
@@ -377,8 +417,10 @@ std::vector<Parameters> Tuner<net_t>::build_valid_params() {
         };
     }
 
+    const auto max_workgroup = m_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+
     auto valid_params = std::vector<Parameters>{};
-    auto build_from = [this, &valid_params](std::vector<Configurations> & opts, int tce) {
+    auto build_from = [this, &valid_params, max_workgroup](std::vector<Configurations> & opts, int tce) {
         auto cfgs = 1;
         for (auto c = size_t{0}; c < opts.size(); c++) {
             cfgs *= opts[c].second.size();
@@ -386,9 +428,14 @@ std::vector<Parameters> Tuner<net_t>::build_valid_params() {
         for (auto i = 0; i < cfgs; i++) {
             Parameters param = get_parameters_by_int(opts, i);
             param["TCE"] = tce;
-            if (valid_config_sgemm(param, cfg_sgemm_exhaustive)) {
-                valid_params.push_back(param);
+            if (!valid_config_sgemm(param, cfg_sgemm_exhaustive)) {
+                continue;
+            }
+            // These would fail to enqueue anyway.
+            if (!tce && param["MDIMC"] * param["NDIMC"] > max_workgroup) {
+                continue;
             }
+            valid_params.push_back(param);
         }
     };
     build_from(opts, 0);
@@ -398,12 +445,21 @@ std::vector<Parameters> Tuner<net_t>::build_valid_params() {
     auto rng = Random{0};
     std::shuffle(begin(valid_params), end(valid_params), rng);
 
-    if (cfg_sgemm_exhaustive) {
-        // Likely too many valid params, cut out some of them
-        valid_params.resize(valid_params.size() / 16);
+    // Only compile and time the configurations the cost model likes best.
+    auto costs = std::vector<std::pair<float, size_t>>{};
+    for (auto i = size_t{0}; i < valid_params.size(); i++) {
+        costs.emplace_back(estimate_cost(valid_params[i], m, n, k), i);
     }
-
-    return valid_params;
+    std::stable_sort(begin(costs), end(costs));
+
+    const auto keep = std::min(valid_params.size(),
+        std::max(size_t{MIN_CANDIDATES}, valid_params.size()
+                                 / (cfg_sgemm_exhaustive ? 8 : 4)));
+    auto candidates = std::vector<Parameters>{};
+    for (auto i = size_t{0}; i < keep; i++) {
+        candidates.emplace_back(valid_params[costs[i].second]);
+    }
+    return candidates;
 }
 
 template <typename net_t>
@@ -445,44 +501,38 @@ std::string Tuner<net_t>::tune_sgemm(const int m, const int n, const int k,
 
     myprintf("\nStarted OpenCL SGEMM tuner.\n");
 
-    auto valid_params = build_valid_params();
+    auto valid_params = build_valid_params(m, n, k);
 
     myprintf("Will try %zu valid configurations.\n", valid_params.size());
 
-    std::string best_params;
-    auto best_time = unsigned{0};
-
     auto queue = cl::CommandQueue(m_context,
                                   m_device,
                                   CL_QUEUE_PROFILING_ENABLE);
     auto event = cl::Event();
-    auto program = cl::Program(m_context, sourceCode_common + sourceCode_sgemm);
 
     auto m_ceil_prev = 0;
     auto n_ceil_prev = 0;
     auto k_ceil_prev = 0;
-    auto param_counter = size_t{0};
     auto min_error = 100.0f;
     auto failed_compile = 0;
     auto failed_enqueue = 0;
     auto failed_error = 0;
 
-    for (auto & p : valid_params) {
-        param_counter++;
-
-        auto defines = parameters_to_defines(p);
-
-        try {
-            auto args = m_opencl.m_cl_args + " " + defines;
-            program.build(args.c_str());
-        } catch (const cl::Error&) {
-            // Failed to compile, get next parameter
-            failed_compile++;
-            continue;
-        }
+    struct Candidate {
+        Parameters params;
+        std::string defines;
+        cl::Kernel kernel;
+        // Kernel time summed over all runs, in nanoseconds.
+        double time{0.0};
+        int runs{0};
 
-        auto sgemm_kernel = cl::Kernel(program, "XgemmBatched");
+        double average() const { return time / runs; }
+    };
 
+    // Time count more runs of a candidate. Returns false if the kernel
+    // failed or computed wrong results.
+    auto measure = [&](Candidate& candidate, const int count) {
+        auto& p = candidate.params;
         auto m_ceil = int(ceilMultiple(ceilMultiple(m, p["MWG"]), p["VWM"]));
         auto n_ceil = int(ceilMultiple(ceilMultiple(n, p["NWG"]), p["VWN"]));
         auto k_ceil = int(ceilMultiple(ceilMultiple(k, p["KWG"]), p["VWM"]));
@@ -504,6 +554,7 @@ std::string Tuner<net_t>::tune_sgemm(const int m, const int n, const int k,
             queue.finish();
         }
 
+        auto& sgemm_kernel = candidate.kernel;
         sgemm_kernel.setArg(0, m_ceil);
         sgemm_kernel.setArg(1, n_ceil);
         sgemm_kernel.setArg(2, k_ceil);
@@ -525,10 +576,7 @@ std::string Tuner<net_t>::tune_sgemm(const int m, const int n, const int k,
                           size_t(batch_size)};
         }
 
-        auto sum = 0.0f;
-        auto error = 0.0f;
-
-        for (auto r = 0; r < runs; r++) {
+        for (auto r = 0; r < count; r++) {
             try {
                 queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
                                            size_sgemm, local_sgemm,
@@ -539,46 +587,72 @@ std::string Tuner<net_t>::tune_sgemm(const int m, const int n, const int k,
                 queue.enqueueReadBuffer(cBuffer, CL_FALSE, 0,
                                         c_size * sizeof(net_t), c.data());
                 queue.finish();
-
-                auto this_error = compare_ref(c, c_ref, n, m, batch_size,
-                                              n_ceil, m_ceil);
-                error = std::max(error, this_error);
-
-                auto elapsed =
-                    event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-                    event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-
-                sum += elapsed;
             } catch (const cl::Error&) {
-                // Failed to enqueue kernel. Set error to some big number.
                 failed_enqueue++;
-                error = std::numeric_limits<float>::max();
-                // This failure will be counted to be failed due to error,
-                // so preemptively subtract one from that count.
-                failed_error--;
-                break;
+                return false;
+            }
+
+            auto error = compare_ref(c, c_ref, n, m, batch_size,
+                                     n_ceil, m_ceil);
+            min_error = std::min(min_error, error);
+            if (error >= getTunerMaxError<net_t>()) {
+                failed_error++;
+                return false;
             }
+
+            candidate.time +=
+                event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            candidate.runs++;
         }
+        return true;
+    };
 
-        min_error = std::min(min_error, error);
+    auto report = [&](const char* stage, const Candidate& candidate) {
+        auto kernel_ms = 1e-6 * candidate.average();
+        // Timing is in nanoseconds (10^-9), Giga = 10^9, so this works out
+        auto kernel_gflops = total_flops / candidate.average();
+        myprintf("%s %s %.4f ms (%.1f GFLOPS)\n",
+                 stage, parameters_to_string(candidate.params).c_str(),
+                 kernel_ms, kernel_gflops);
+    };
+    auto faster = [](const Candidate& a, const Candidate& b) {
+        return a.average() < b.average();
+    };
 
-        if (error >= getTunerMaxError<net_t>()) {
-            failed_error++;
+    // Compile every configuration and time it once.
+    auto candidates = std::vector<Candidate>{};
+    auto best_time = 0.0;
+    auto param_counter = size_t{0};
+    for (auto & p : valid_params) {
+        param_counter++;
+
+        auto candidate = Candidate{p, parameters_to_defines(p)};
+        try {
+            auto program = cl::Program(m_context,
+                                       sourceCode_common + sourceCode_sgemm);
+            auto args = m_opencl.m_cl_args + " " + candidate.defines;
+            program.build(args.c_str());
+            candidate.kernel = cl::Kernel(program, "XgemmBatched");
+        } catch (const cl::Error&) {
+            // Failed to compile, get next parameter
+            failed_compile++;
+            continue;
         }
 
-        if (error < getTunerMaxError<net_t>() && (best_time == 0 || sum < best_time)) {
-            auto param_str = parameters_to_string(p);
-            auto kernel_ms = 1e-6f * (sum / runs);
-            // Timing is in nanoseconds (10^-9), Giga = 10^9, so this works out
-            auto kernel_gflops = total_flops / (sum / runs);
-            myprintf("(%u/%u) %s %.4f ms (%.1f GFLOPS)\n",
-               param_counter, valid_params.size(), param_str.c_str(),
-               kernel_ms, kernel_gflops);
-            best_time = sum;
-            best_params = defines;
+        if (!measure(candidate, 1)) {
+            continue;
+        }
+        if (best_time == 0.0 || candidate.average() < best_time) {
+            best_time = candidate.average();
+            auto stage = str(boost::format("(%u/%u)")
+                             % param_counter % valid_params.size());
+            report(stage.c_str(), candidate);
         }
+        candidates.emplace_back(std::move(candidate));
     }
-    if (best_time == 0) {
+
+    if (candidates.empty()) {
         if (failed_compile > 0) {
             myprintf_error("Failed to compile: %d kernels.\n", failed_compile);
         }
@@ -592,107 +666,54 @@ std::string Tuner<net_t>::tune_sgemm(const int m, const int n, const int k,
         myprintf_error("Minimum error: %f. Error bound: %f\n", min_error, getTunerMaxError<net_t>());
         throw std::runtime_error("Tuner failed to find working configuration.");
     }
-    return best_params;
-}
 
-template <typename net_t>
-void Tuner<net_t>::store_sgemm_tuners(const int m, const int n, const int k,
-                               const int batch_size, std::string tuners) {
-    auto tuner_file = leelaz_file(TUNER_FILE_LOCAL);
-    auto file_contents = std::vector<std::string>();
-    {
-        // Read the previous contents to string
-        auto file = std::ifstream{tuner_file};
-        if (file.good()) {
-            auto line = std::string{};
-            while (std::getline(file, line)) {
-                file_contents.emplace_back(line);
+    // Successive halving: keep the faster half and time it again, with
+    // more runs each round, so that single noisy runs don't decide.
+    auto round_runs = 1;
+    while (candidates.size() > 1) {
+        std::stable_sort(begin(candidates), end(candidates), faster);
+        candidates.resize((candidates.size() + 1) / 2);
+        if (candidates.size() == 1) {
+            break;
+        }
+        round_runs = std::min(round_runs * 2, runs);
+        auto survivors = std::vector<Candidate>{};
+        for (auto& candidate : candidates) {
+            if (measure(candidate, round_runs)) {
+                survivors.emplace_back(std::move(candidate));
             }
         }
-    }
-    auto file = std::ofstream{tuner_file};
-
-    auto device_name = m_opencl.get_device_name();
-    auto tuning_params = std::stringstream{};
-    tuning_params << m << ";" << n << ";" << k << ";" << batch_size;
-
-    auto tuning_line_prefix = std::to_string(TUNER_VERSION) + ";"
-        + getTunerKernel<net_t>() + ";" + tuning_params.str() + ";";
-    auto tuning_line = tuning_line_prefix + tuners + ";" + device_name;
-
-    // Write back previous data as long as it's not the device and
-    // tuning we just tuned
-    for (const auto& line : file_contents) {
-        if (line.find(tuning_line_prefix) == std::string::npos
-            || line.find(device_name) == std::string::npos) {
-            file << line << std::endl;
+        candidates = std::move(survivors);
+        if (candidates.empty()) {
+            throw std::runtime_error("Tuner failed to find working configuration.");
         }
     }
+    report("Best:", candidates.front());
+    return candidates.front().defines;
+}
 
-    // Write new tuning
-    file << tuning_line << std::endl;
+template <typename net_t>
+void Tuner<net_t>::store_sgemm_tuners(const int m, const int n, const int k,
+                               const int batch_size, std::string tuners) {
+    auto tuner_file = leelaz_file(TUNER_FILE_LOCAL);
+    auto database = TunerDatabase{tuner_file};
+    auto key = TunerDatabase::Key{
+        TUNER_VERSION, getTunerKernel<net_t>(), m, n, k, batch_size,
+        m_opencl.get_device_name(), m_opencl.get_driver_version()};
 
-    if (file.fail()) {
+    if (!database.store(key, tuners)) {
         myprintf("Could not save the tuning result.\n");
         myprintf("Do I have write permissions on %s?\n",
             tuner_file.c_str());
     }
 }
 
-template <typename net_t>
-std::string Tuner<net_t>::sgemm_tuners_from_line(std::string line,
-                                          const int m, const int n, const int k,
-                                          const int batch_size) {
-    auto s = std::vector<std::string>{};
-    auto ss = std::stringstream{line};
-    auto item = std::string{};
-
-    while (std::getline(ss, item, ';')) {
-        s.emplace_back(item);
-    }
-
-    if (s.size() != 8) {
-        return "";
-    }
-
-    if (s[0] != std::to_string(TUNER_VERSION)) {
-        return "";
-    }
-
-    if (s[1] != getTunerKernel<net_t>()) {
-        return "";
-    }
-
-    if (s[2] != std::to_string(m)) {
-        return "";
-    }
-
-    if (s[3] != std::to_string(n)) {
-        return "";
-    }
-
-    if (s[4] != std::to_string(k)) {
-        return "";
-    }
-
-    if (s[5] != std::to_string(batch_size)) {
-        return "";
-    }
-
-    if (s[7] != m_opencl.get_device_name()) {
-        return "";
-    }
-
-    return s[6];
-}
-
 template <typename net_t>
 std::string Tuner<net_t>::load_sgemm_tuners(const int m, const int n, const int k,
                                      const int batch_size) {
-    auto tuner_file = leelaz_file(TUNER_FILE_LOCAL);
-    auto file = std::ifstream{tuner_file};
+    auto database = TunerDatabase{leelaz_file(TUNER_FILE_LOCAL)};
 
-    auto try_prior_tuning = file.good();
+    auto try_prior_tuning = database.size() > 0;
 
     // If we want full tuning, don't reuse previously tuned results
     // except if the tuning was created from this run from a different
@@ -709,13 +730,13 @@ std::string Tuner<net_t>::load_sgemm_tuners(const int m, const int n, const int
     tuned_devices.emplace_back(m_opencl.get_device_name());
 
     if (try_prior_tuning) {
-        auto line = std::string{};
-        while (std::getline(file, line)) {
-            auto tuners = sgemm_tuners_from_line(line, m, n, k, batch_size);
-            if (tuners.size() != 0) {
-                myprintf("Loaded existing SGEMM tuning.\n");
-                return tuners;
-            }
+        auto key = TunerDatabase::Key{
+            TUNER_VERSION, getTunerKernel<net_t>(), m, n, k, batch_size,
+            m_opencl.get_device_name(), m_opencl.get_driver_version()};
+        auto tuners = database.find(key);
+        if (!tuners.empty()) {
+            myprintf("Loaded existing SGEMM tuning.\n");
+            return tuners;
         }
     }
     auto tuners = tune_sgemm(m, n, k, batch_size);
@@ -60,6 +60,10 @@ public:
     // version 1 : Tuner with additional tensor cores (parameter TCE)
     static constexpr auto TUNER_VERSION = 1;
 
+    // The cost model passes at least this many configurations on to be
+    // timed.
+    static constexpr auto MIN_CANDIDATES = size_t{16};
+
     Tuner(OpenCL<net_t> & opencl, cl::Context context, cl::Device device) :
         m_opencl(opencl), m_context(context), m_device(device) {}
 
@@ -72,10 +76,9 @@ private:
     std::string parameters_to_string(const Parameters& p);
     Parameters get_parameters_by_int(const std::vector<Configurations>& opts,
                                      const int n);
-    std::string sgemm_tuners_from_line(std::string line, const int m,
-                                       const int n, const int k,
-                                       const int batch_size);
-    std::vector<Parameters> build_valid_params();
+    float estimate_cost(Parameters p, const int m, const int n, const int k);
+    std::vector<Parameters> build_valid_params(const int m, const int n,
+                                               const int k);
 };
 
 #endif
@@ -0,0 +1,159 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#include "config.h"
+#include "TunerDatabase.h"
+
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <tuple>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+
+bool TunerDatabase::Key::operator<(const Key& other) const {
+    return std::tie(version, kernel, m, n, k, batch_size, device, driver)
+        < std::tie(other.version, other.kernel, other.m, other.n, other.k,
+                   other.batch_size, other.device, other.driver);
+}
+
+TunerDatabase::TunerDatabase(std::string filename)
+    : m_filename(std::move(filename)) {
+    load();
+}
+
+void TunerDatabase::load() {
+    m_entries.clear();
+    m_other_lines.clear();
+
+    auto file = std::ifstream{m_filename};
+    auto line = std::string{};
+    while (std::getline(file, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        auto fields = std::vector<std::string>{};
+        auto ss = std::stringstream{line};
+        auto item = std::string{};
+        while (std::getline(ss, item, ';')) {
+            fields.emplace_back(item);
+        }
+        if (fields.size() != 8 && fields.size() != 9) {
+            m_other_lines.emplace_back(line);
+            continue;
+        }
+        try {
+            auto key = Key{std::stoi(fields[0]), fields[1],
+                           std::stoi(fields[2]), std::stoi(fields[3]),
+                           std::stoi(fields[4]), std::stoi(fields[5]),
+                           fields[7],
+                           fields.size() == 9 ? fields[8] : std::string{}};
+            m_entries[key] = fields[6];
+        } catch (const std::exception&) {
+            m_other_lines.emplace_back(line);
+        }
+    }
+}
+
+std::string TunerDatabase::find(const Key& key) const {
+    auto it = m_entries.find(key);
+    if (it == end(m_entries)) {
+        auto any_driver = key;
+        any_driver.driver.clear();
+        it = m_entries.find(any_driver);
+    }
+    return it == end(m_entries) ? std::string{} : it->second;
+}
+
+bool TunerDatabase::store(const Key& key, const std::string& tuners) {
+    // Other processes must not store between our load and our rename, or
+    // one of the two would lose its entries. File locks don't exclude
+    // threads of the same process, so those take a mutex as well.
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> guard(mutex);
+    const auto lock_filename = m_filename + ".lock";
+    std::ofstream{lock_filename, std::ios::app};
+    boost::interprocess::file_lock file_lock;
+    try {
+        file_lock = boost::interprocess::file_lock(lock_filename.c_str());
+    } catch (const boost::interprocess::interprocess_exception&) {
+        return false;
+    }
+    boost::interprocess::scoped_lock<boost::interprocess::file_lock>
+        lock(file_lock);
+
+    load();
+    m_entries[key] = tuners;
+    // The entry without a driver is superseded now.
+    if (!key.driver.empty()) {
+        auto any_driver = key;
+        any_driver.driver.clear();
+        m_entries.erase(any_driver);
+    }
+
+    // Write a new file and move it over the old one, so that a crash
+    // or a concurrent reader never sees half a database. The file has a
+    // unique name, so a writer that died with it left behind doesn't
+    // matter.
+    const auto tmp_filename = boost::filesystem::unique_path(
+        m_filename + ".%%%%-%%%%-%%%%-%%%%.tmp").string();
+    {
+        auto file = std::ofstream{tmp_filename};
+        for (const auto& line : m_other_lines) {
+            file << line << std::endl;
+        }
+        for (const auto& entry : m_entries) {
+            const auto& k = entry.first;
+            file << k.version << ";" << k.kernel << ";"
+                 << k.m << ";" << k.n << ";" << k.k << ";"
+                 << k.batch_size << ";" << entry.second << ";" << k.device;
+            if (!k.driver.empty()) {
+                file << ";" << k.driver;
+            }
+            file << std::endl;
+        }
+        if (file.fail()) {
+            std::remove(tmp_filename.c_str());
+            return false;
+        }
+    }
+    auto ec = boost::system::error_code{};
+    boost::filesystem::rename(tmp_filename, m_filename, ec);
+    if (ec) {
+        std::remove(tmp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t TunerDatabase::size() const {
+    return m_entries.size();
+}
@@ -0,0 +1,84 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+#ifndef TUNERDATABASE_H_INCLUDED
+#define TUNERDATABASE_H_INCLUDED
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+    SGEMM tuning results, indexed by tuner version, kernel, problem size
+    and device. One entry per line:
+
+    version;kernel;m;n;k;batch_size;tuners;device;driver
+
+    Lines written before the driver was recorded have no driver field.
+    They match any driver of their device, until a tuning for the current
+    driver replaces them.
+*/
+class TunerDatabase {
+public:
+    struct Key {
+        int version;
+        std::string kernel;
+        int m;
+        int n;
+        int k;
+        int batch_size;
+        std::string device;
+        std::string driver;
+
+        bool operator<(const Key& other) const;
+    };
+
+    explicit TunerDatabase(std::string filename);
+
+    // The stored tuners for key, or an empty string.
+    std::string find(const Key& key) const;
+    // Adds or replaces the entry and writes the database back, merged with
+    // whatever other processes stored meanwhile. Returns false when the
+    // file couldn't be written.
+    bool store(const Key& key, const std::string& tuners);
+
+    size_t size() const;
+
+private:
+    void load();
+
+    std::string m_filename;
+    std::map<Key, std::string> m_entries;
+    // Lines we can't parse are written back unchanged.
+    std::vector<std::string> m_other_lines;
+};
+
+#endif
@@ -47,6 +47,7 @@
 #include "GTP.h"
 #include "GameState.h"
 #include "Network.h"
+#include "PerfCounters.h"
 #include "Utils.h"
 
 using namespace Utils;
@@ -55,7 +56,7 @@ UCTNode::UCTNode(int vertex, float policy) : m_move(vertex), m_policy(policy) {
 }
 
 bool UCTNode::first_visit() const {
-    return m_visits == 0;
+    return get_visits() == 0;
 }
 
 bool UCTNode::create_children(Network & network,
@@ -63,6 +64,30 @@ bool UCTNode::create_children(Network & network,
                               GameState& state,
                               float& eval,
                               float min_psa_ratio) {
+    if (!start_expanding(state, min_psa_ratio)) {
+        return false;
+    }
+
+    const auto raw_netlist = network.get_output(
+        &state, Network::Ensemble::RANDOM_SYMMETRY);
+    expand(raw_netlist, nodecount, state, eval, min_psa_ratio);
+    return true;
+}
+
+bool UCTNode::create_children(const Network::Netresult& raw_netlist,
+                              std::atomic<int>& nodecount,
+                              GameState& state,
+                              float& eval,
+                              float min_psa_ratio) {
+    if (!start_expanding(state, min_psa_ratio)) {
+        return false;
+    }
+
+    expand(raw_netlist, nodecount, state, eval, min_psa_ratio);
+    return true;
+}
+
+bool UCTNode::start_expanding(const GameState& state, float min_psa_ratio) {
     // no successors in final state
     if (state.get_passes() >= 2) {
         return false;
@@ -78,9 +103,15 @@ bool UCTNode::create_children(Network & network,
         expand_done();
         return false;
     }
+    return true;
+}
 
-    const auto raw_netlist = network.get_output(
-        &state, Network::Ensemble::RANDOM_SYMMETRY);
+void UCTNode::expand(const Network::Netresult& raw_netlist,
+                     std::atomic<int>& nodecount,
+                     GameState& state,
+                     float& eval,
+                     float min_psa_ratio) {
+    Perf::ScopedTimer timer(Perf::EXPAND);
 
     // DCNN returns winrate as side to move
     const auto stm_eval = raw_netlist.winrate;
@@ -144,7 +175,6 @@ bool UCTNode::create_children(Network & network,
 
     link_nodelist(nodecount, nodelist, min_psa_ratio);
     expand_done();
-    return true;
 }
 
 void UCTNode::link_nodelist(std::atomic<int>& nodecount,
@@ -194,25 +224,39 @@ int UCTNode::get_move() const {
     return m_move;
 }
 
+int UCTNode::visits_of(std::uint64_t visits_vl) {
+    return static_cast<int>(visits_vl >> 32);
+}
+
+int UCTNode::virtual_loss_of(std::uint64_t visits_vl) {
+    return static_cast<int>(visits_vl & 0xFFFFFFFF);
+}
+
 void UCTNode::virtual_loss() {
-    m_virtual_loss += VIRTUAL_LOSS_COUNT;
+    m_visits_vl += VIRTUAL_LOSS_COUNT;
 }
 
 void UCTNode::virtual_loss_undo() {
-    m_virtual_loss -= VIRTUAL_LOSS_COUNT;
+    m_visits_vl -= VIRTUAL_LOSS_COUNT;
 }
 
 void UCTNode::update(float eval) {
-    // Cache values to avoid race conditions.
-    auto old_eval = static_cast<float>(m_blackevals);
-    auto old_visits = static_cast<int>(m_visits);
-    auto old_delta = old_visits > 0 ? eval - old_eval / old_visits : 0.0f;
-    m_visits++;
-    accumulate_eval(eval);
-    auto new_delta = eval - (old_eval + eval) / (old_visits + 1);
-    // Welford's online algorithm for calculating variance.
-    auto delta = old_delta * new_delta;
-    atomic_add(m_squared_eval_diff, delta);
+    accumulate_eval(eval, std::uint64_t{1} << 32);
+}
+
+void UCTNode::update_and_virtual_loss_undo(float eval) {
+    // The virtual loss is still counted, so the lower half cannot borrow.
+    accumulate_eval(eval, (std::uint64_t{1} << 32) - VIRTUAL_LOSS_COUNT);
+}
+
+void UCTNode::accumulate_eval(float eval, std::uint64_t visits_vl_delta) {
+    auto fixed = std::llround(double(eval) * EVAL_ONE);
+    auto squared = std::llround(double(eval) * double(eval) * EVAL_ONE);
+    // Add the evals before the visit, so that a reader which sees the
+    // visit also sees its eval.
+    m_blackevals.fetch_add(fixed, std::memory_order_relaxed);
+    m_squared_blackevals.fetch_add(squared, std::memory_order_relaxed);
+    m_visits_vl.fetch_add(visits_vl_delta, std::memory_order_release);
 }
 
 bool UCTNode::has_children() const {
@@ -239,11 +283,23 @@ void UCTNode::set_policy(float policy) {
 }
 
 float UCTNode::get_eval_variance(float default_var) const {
-    return m_visits > 1 ? m_squared_eval_diff / (m_visits - 1) : default_var;
+    auto visits = get_visits();
+    if (visits < 2) {
+        return default_var;
+    }
+    auto sum = m_blackevals.load(std::memory_order_relaxed) / EVAL_ONE;
+    auto sum_squares =
+        m_squared_blackevals.load(std::memory_order_relaxed) / EVAL_ONE;
+    // Every eval and square was rounded to 2^-32 when it was added, and
+    // the subtraction is done in double, so this is only accurate while
+    // the variance is well above those rounding errors. The small
+    // constant avoids accidental zero variances at low visits.
+    auto squared_diff = std::max(0.0, sum_squares - sum * sum / visits);
+    return static_cast<float>((squared_diff + 1e-4) / (visits - 1));
 }
 
 int UCTNode::get_visits() const {
-    return m_visits;
+    return visits_of(m_visits_vl.load(std::memory_order_acquire));
 }
 
 float UCTNode::get_eval_lcb(int color) const {
@@ -262,9 +318,13 @@ float UCTNode::get_eval_lcb(int color) const {
 }
 
 float UCTNode::get_raw_eval(int tomove, int virtual_loss) const {
-    auto visits = get_visits() + virtual_loss;
+    return get_raw_eval(tomove, get_visits(), virtual_loss);
+}
+
+float UCTNode::get_raw_eval(int tomove, int visits, int virtual_loss) const {
+    visits += virtual_loss;
     assert(visits > 0);
-    auto blackeval = get_blackevals();
+    auto blackeval = m_blackevals.load(std::memory_order_relaxed) / EVAL_ONE;
     if (tomove == FastBoard::WHITE) {
         blackeval += static_cast<double>(virtual_loss);
     }
@@ -277,9 +337,12 @@ float UCTNode::get_raw_eval(int tomove, int virtual_loss) const {
 
 float UCTNode::get_eval(int tomove) const {
     // Due to the use of atomic updates and virtual losses, it is
-    // possible for the visit count to change underneath us. Make sure
-    // to return a consistent result to the caller by caching the values.
-    return get_raw_eval(tomove, m_virtual_loss);
+    // possible for the visit count to change underneath us. Take the
+    // visits and virtual losses from a single load so the result is
+    // consistent.
+    auto visits_vl = m_visits_vl.load(std::memory_order_acquire);
+    return get_raw_eval(tomove, visits_of(visits_vl),
+                        virtual_loss_of(visits_vl));
 }
 
 float UCTNode::get_net_eval(int tomove) const {
@@ -289,14 +352,6 @@ float UCTNode::get_net_eval(int tomove) const {
     return m_net_eval;
 }
 
-double UCTNode::get_blackevals() const {
-    return m_blackevals;
-}
-
-void UCTNode::accumulate_eval(float eval) {
-    atomic_add(m_blackevals, double(eval));
-}
-
 UCTNode* UCTNode::uct_select_child(int color, bool is_root) {
     wait_expanded();
 
@@ -433,6 +488,54 @@ size_t UCTNode::count_nodes_and_clear_expand_state() {
     return nodecount;
 }
 
+size_t UCTNode::count_nodes() const {
+    auto nodecount = m_children.size();
+    for (const auto& child : m_children) {
+        if (child.is_inflated()) {
+            nodecount += child->count_nodes();
+        }
+    }
+    return nodecount;
+}
+
+// Turn subtrees that received few visits back into uninflated pointers,
+// so their memory can be reused by the ongoing search. The most visited
+// child is always kept, which protects the principal variation.
+// This runs concurrently with the search, so only fully expanded nodes
+// are traversed and the detached nodes are not deleted here.
+void UCTNode::collapse_children(int max_visits,
+                                std::vector<UCTNode*>& detached) {
+    if (m_expand_state.load() != ExpandState::EXPANDED) {
+        return;
+    }
+
+    auto best = static_cast<UCTNodePointer*>(nullptr);
+    auto best_visits = -1;
+    for (auto& child : m_children) {
+        const auto visits = child.get_visits();
+        if (visits > best_visits) {
+            best_visits = visits;
+            best = &child;
+        }
+    }
+
+    for (auto& child : m_children) {
+        if (!child.is_inflated()) {
+            continue;
+        }
+        if (&child != best
+            && child.valid()
+            && child.get_visits() <= max_visits) {
+            auto node = child.deflate();
+            if (node != nullptr) {
+                detached.emplace_back(node);
+            }
+        } else {
+            child->collapse_children(max_visits, detached);
+        }
+    }
+}
+
 void UCTNode::invalidate() {
     m_status = INVALID;
 }
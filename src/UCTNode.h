@@ -37,6 +37,7 @@
 #include <vector>
 #include <cassert>
 #include <cstring>
+#include <cstdint>
 
 #include "GameState.h"
 #include "Network.h"
@@ -49,6 +50,9 @@ public:
     // to it to encourage other CPUs to explore other parts of the
     // search tree.
     static constexpr auto VIRTUAL_LOSS_COUNT = 3;
+    // Fixed-point scale of the eval accumulators. Each eval is rounded to
+    // 32 fractional bits, which leaves room for 2^31 visits.
+    static constexpr auto EVAL_ONE = double(std::int64_t{1} << 32);
     // Defined in UCTNode.cpp
     explicit UCTNode(int vertex, float policy);
     UCTNode() = delete;
@@ -58,6 +62,12 @@ public:
                          std::atomic<int>& nodecount,
                          GameState& state, float& eval,
                          float min_psa_ratio = 0.0f);
+    // Expand with an evaluation made beforehand, see
+    // UCTSearch::play_round().
+    bool create_children(const Network::Netresult& raw_netlist,
+                         std::atomic<int>& nodecount,
+                         GameState& state, float& eval,
+                         float min_psa_ratio = 0.0f);
 
     const std::vector<UCTNodePointer>& get_children() const;
     void sort_children(int color, float lcb_min_visits);
@@ -65,6 +75,8 @@ public:
     UCTNode* uct_select_child(int color, bool is_root);
 
     size_t count_nodes_and_clear_expand_state();
+    size_t count_nodes() const;
+    void collapse_children(int max_visits, std::vector<UCTNode*>& detached);
     bool first_visit() const;
     bool has_children() const;
     bool expandable(const float min_psa_ratio = 0.0f) const;
@@ -83,6 +95,9 @@ public:
     void virtual_loss();
     void virtual_loss_undo();
     void update(float eval);
+    // update() and virtual_loss_undo(), with the visit and the virtual
+    // loss undo in one atomic add.
+    void update_and_virtual_loss_undo(float eval);
     float get_eval_lcb(int color) const;
 
     // Defined in UCTNodeRoot.cpp, only to be called on m_root in UCTSearch
@@ -103,11 +118,17 @@ private:
         PRUNED,
         ACTIVE
     };
+    bool start_expanding(const GameState& state, float min_psa_ratio);
+    void expand(const Network::Netresult& raw_netlist,
+                std::atomic<int>& nodecount,
+                GameState& state, float& eval, float min_psa_ratio);
     void link_nodelist(std::atomic<int>& nodecount,
                        std::vector<Network::PolicyVertexPair>& nodelist,
                        float min_psa_ratio);
-    double get_blackevals() const;
-    void accumulate_eval(float eval);
+    static int visits_of(std::uint64_t visits_vl);
+    static int virtual_loss_of(std::uint64_t visits_vl);
+    float get_raw_eval(int tomove, int visits, int virtual_loss) const;
+    void accumulate_eval(float eval, std::uint64_t visits_vl_delta);
     void kill_superkos(const GameState& state);
     void dirichlet_noise(float epsilon, float alpha);
 
@@ -117,20 +138,7 @@ private:
 
     // Move
     std::int16_t m_move;
-    // UCT
-    std::atomic<std::int16_t> m_virtual_loss{0};
-    std::atomic<int> m_visits{0};
-    // UCT eval
-    float m_policy;
-    // Original net eval for this node (not children).
-    float m_net_eval{0.0f};
-    // Variable used for calculating variance of evaluations.
-    // Initialized to small non-zero value to avoid accidental zero variances
-    // at low visits.
-    std::atomic<float> m_squared_eval_diff{1e-4f};
-    std::atomic<double> m_blackevals{0.0};
     std::atomic<Status> m_status{ACTIVE};
-
     // m_expand_state acts as the lock for m_children.
     // see manipulation methods below for possible state transition
     enum class ExpandState : std::uint8_t {
@@ -148,8 +156,26 @@ private:
     };
     std::atomic<ExpandState> m_expand_state{ExpandState::INITIAL};
 
+    // UCT eval
+    float m_policy;
+    // Original net eval for this node (not children).
+    float m_net_eval{0.0f};
     // Tree data
     std::atomic<float> m_min_psa_ratio_children{2.0f};
+
+    // UCT
+    // Visits in the upper half and virtual losses in the lower half, so
+    // that a backup can count its visit and take back its virtual loss
+    // in the same fetch_add, and a reader sees both from one load. With
+    // the two eval sums below a backup is three fetch_adds, on top of
+    // the one that added the virtual loss on the way down.
+    std::atomic<std::uint64_t> m_visits_vl{0};
+    // Sums of the evals from black's side and of their squares, in fixed
+    // point with EVAL_ONE as 1.0, so they are updated with fetch_add
+    // instead of a compare-exchange loop.
+    std::atomic<std::int64_t> m_blackevals{0};
+    std::atomic<std::int64_t> m_squared_blackevals{0};
+
     std::vector<UCTNodePointer> m_children;
 
     //  m_expand_state manipulation methods
@@ -37,18 +37,29 @@
 #include "UCTNode.h"
 
 std::atomic<size_t> UCTNodePointer::m_tree_size = {0};
+thread_local std::atomic<size_t>* UCTNodePointer::m_current_tree_size =
+    &UCTNodePointer::m_tree_size;
 
 size_t UCTNodePointer::get_tree_size() {
-    return m_tree_size.load();
+    return m_current_tree_size->load();
 }
 
 void UCTNodePointer::increment_tree_size(size_t sz) {
-    m_tree_size += sz;
+    *m_current_tree_size += sz;
 }
 
 void UCTNodePointer::decrement_tree_size(size_t sz) {
-    assert(UCTNodePointer::m_tree_size >= sz);
-    m_tree_size -= sz;
+    assert(*m_current_tree_size >= sz);
+    *m_current_tree_size -= sz;
+}
+
+UCTNodePointer::TreeSizeScope::TreeSizeScope(std::atomic<size_t>& tree_size)
+    : m_previous(m_current_tree_size) {
+    m_current_tree_size = &tree_size;
+}
+
+UCTNodePointer::TreeSizeScope::~TreeSizeScope() {
+    m_current_tree_size = m_previous;
 }
 
 UCTNodePointer::~UCTNodePointer() {
@@ -72,13 +83,17 @@ UCTNodePointer::UCTNodePointer(UCTNodePointer&& n) {
     increment_tree_size(sizeof(UCTNodePointer));
 }
 
-UCTNodePointer::UCTNodePointer(std::int16_t vertex, float policy) {
+std::uint64_t UCTNodePointer::pack(std::int16_t vertex, float policy) {
     std::uint32_t i_policy;
     auto i_vertex = static_cast<std::uint16_t>(vertex);
     std::memcpy(&i_policy, &policy, sizeof(i_policy));
 
-    m_data =  (static_cast<std::uint64_t>(i_policy) << 32)
-            | (static_cast<std::uint64_t>(i_vertex) << 16);
+    return  (static_cast<std::uint64_t>(i_policy) << 32)
+          | (static_cast<std::uint64_t>(i_vertex) << 16);
+}
+
+UCTNodePointer::UCTNodePointer(std::int16_t vertex, float policy) {
+    m_data = pack(vertex, policy);
     increment_tree_size(sizeof(UCTNodePointer));
 }
 
@@ -120,6 +135,20 @@ void UCTNodePointer::inflate() const {
     }
 }
 
+UCTNode * UCTNodePointer::deflate() {
+    auto v = m_data.load();
+    if (!is_inflated(v)) return nullptr;
+
+    auto node = read_ptr(v);
+    auto v2 = pack(node->get_move(), node->get_policy());
+    if (!m_data.compare_exchange_strong(v, v2)) {
+        // somebody else got here first
+        return nullptr;
+    }
+    decrement_tree_size(sizeof(UCTNode));
+    return node;
+}
+
 bool UCTNodePointer::valid() const {
     auto v = m_data.load();
     if (is_inflated(v)) return read_ptr(v)->valid();
@@ -60,6 +60,7 @@ private:
     static constexpr std::uint64_t UNINFLATED = 0;
 
     static std::atomic<size_t> m_tree_size;
+    static thread_local std::atomic<size_t>* m_current_tree_size;
     static void increment_tree_size(size_t sz);
     static void decrement_tree_size(size_t sz);
 
@@ -95,9 +96,27 @@ private:
         return (v & 3ULL) == POINTER;
     }
 
+    static std::uint64_t pack(std::int16_t vertex, float policy);
+
 public:
+    // Memory used by the nodes of the tree the calling thread works on,
+    // see TreeSizeScope.
     static size_t get_tree_size();
 
+    // Makes the calling thread count the nodes it creates and deletes
+    // in tree_size until the scope ends, so that concurrent searches
+    // each keep track of their own tree. Outside of any scope, nodes
+    // count in a process wide total.
+    class TreeSizeScope {
+    public:
+        explicit TreeSizeScope(std::atomic<size_t>& tree_size);
+        ~TreeSizeScope();
+        TreeSizeScope(const TreeSizeScope&) = delete;
+        TreeSizeScope& operator=(const TreeSizeScope&) = delete;
+    private:
+        std::atomic<size_t>* m_previous;
+    };
+
     ~UCTNodePointer();
     UCTNodePointer(UCTNodePointer&& n);
     UCTNodePointer(std::int16_t vertex, float policy);
@@ -124,6 +143,12 @@ public:
     // construct UCTNode instance from the vertex/policy pair
     void inflate() const;
 
+    // the reverse of inflate(): turn the pointer back into a vertex/policy
+    // pair. The detached UCTNode (and its subtree) is returned to the caller,
+    // who is responsible for deleting it once no other thread can still be
+    // holding a reference to it. Returns nullptr if not inflated.
+    UCTNode * deflate();
+
     // proxy of UCTNode methods which can be called without
     // constructing UCTNode
     bool valid() const;
@@ -32,11 +32,13 @@
 
 #include <boost/format.hpp>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
 #include <functional>
 #include <limits>
 #include <memory>
+#include <thread>
 #include <type_traits>
 #include <algorithm>
 
@@ -45,6 +47,8 @@
 #include "FullBoard.h"
 #include "GTP.h"
 #include "GameState.h"
+#include "PerfCounters.h"
+#include "Random.h"
 #include "TimeControl.h"
 #include "Timing.h"
 #include "Training.h"
@@ -56,6 +60,8 @@
 using namespace Utils;
 
 constexpr int UCTSearch::UNLIMITED_PLAYOUTS;
+constexpr float UCTSearch::GC_HIGH_WATERMARK;
+constexpr float UCTSearch::GC_LOW_WATERMARK;
 
 class OutputAnalysisData {
 public:
@@ -110,10 +116,26 @@ UCTSearch::UCTSearch(GameState& g, Network& network)
     : m_rootstate(g), m_network(network) {
     set_playout_limit(cfg_max_playouts);
     set_visit_limit(cfg_max_visits);
+    set_thread_count(cfg_num_threads);
 
     m_root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f);
 }
 
+UCTSearch::~UCTSearch() {
+    // The deleting threads count against our trees.
+    for (auto& tg : m_delete_futures) {
+        tg.wait_all();
+    }
+    {
+        UCTNodePointer::TreeSizeScope scope(m_root_cache_size);
+        m_root_cache.clear();
+    }
+    TreeScope scope(*this);
+    m_root.reset();
+    assert(m_tree_size == 0 && m_root_cache_size == 0);
+    assert(m_root_cache_deleting == 0);
+}
+
 bool UCTSearch::advance_to_new_rootstate() {
     if (!m_root || !m_last_rootstate) {
         // No current state
@@ -151,21 +173,12 @@ bool UCTSearch::advance_to_new_rootstate() {
 
     // Try to replay moves advancing m_root
     for (auto i = 0; i < depth; i++) {
-        ThreadGroup tg(thread_pool);
-
         test->forward_move();
         const auto move = test->get_last_move();
 
         auto oldroot = std::move(m_root);
         m_root = oldroot->find_child(move);
-
-        // Lazy tree destruction.  Instead of calling the destructor of the
-        // old root node on the main thread, send the old root to a separate
-        // thread and destroy it from the child thread.  This will save a
-        // bit of time when dealing with large trees.
-        auto p = oldroot.release();
-        tg.add_task([p]() { delete p; });
-        m_delete_futures.push_back(std::move(tg));
+        delete_tree(std::move(oldroot));
 
         if (!m_root) {
             // Tree hasn't been expanded this far
@@ -184,18 +197,132 @@ bool UCTSearch::advance_to_new_rootstate() {
     return true;
 }
 
-void UCTSearch::update_root() {
+// Lazy tree destruction.  Instead of calling the destructor of the
+// old root node on the main thread, send the old root to a separate
+// thread and destroy it from the child thread.  This will save a
+// bit of time when dealing with large trees.
+void UCTSearch::delete_tree(std::unique_ptr<UCTNode> root) {
+    delete_tree(std::move(root), m_tree_size);
+}
+
+void UCTSearch::delete_tree(std::unique_ptr<UCTNode> root,
+                            std::atomic<size_t>& tree_size) {
+    if (!root) {
+        return;
+    }
+    ThreadGroup tg(thread_pool);
+    auto p = root.release();
+    tg.add_task([p, &tree_size]() {
+        UCTNodePointer::TreeSizeScope scope(tree_size);
+        delete p;
+    });
+    m_delete_futures.push_back(std::move(tg));
+}
+
+// Bytes the nodes below root count for in the tree size, root itself
+// is owned outside of any UCTNodePointer.
+static size_t tree_bytes(const UCTNode& root) {
+    auto bytes = size_t{0};
+    for (const auto& child : root.get_children()) {
+        bytes += sizeof(UCTNodePointer);
+        if (child.is_inflated()) {
+            bytes += sizeof(UCTNode) + tree_bytes(*child);
+        }
+    }
+    return bytes;
+}
+
+void UCTSearch::cache_root(std::unique_ptr<UCTNode> root,
+                           const GameState& state) {
+    // Nothing worth keeping.
+    if (!root || root->get_visits() <= 1) {
+        delete_tree(std::move(root));
+        return;
+    }
+
+    const auto bytes = tree_bytes(*root);
+    const auto budget = size_t(ROOT_CACHE_SHARE * max_tree_size());
+    if (bytes > budget) {
+        delete_tree(std::move(root));
+        return;
+    }
+
+    // A position we searched again replaces its older tree.
+    delete_tree(find_cached_root(state));
+
+    m_root_cache.push_front(CachedRoot{state.board.get_hash(),
+                                       state.get_movenum(),
+                                       state.get_komi(),
+                                       bytes, std::move(root)});
+    m_tree_size -= bytes;
+    m_root_cache_size += bytes;
+
+    // Trees being deleted count too, they still take up the memory. The
+    // tree just added always stays, it fits the budget by itself.
+    while (m_root_cache.size() > 1
+           && (m_root_cache.size() > ROOT_CACHE_ENTRIES
+               || m_root_cache_size + m_root_cache_deleting > budget)) {
+        auto& oldest = m_root_cache.back();
+        m_root_cache_size -= oldest.bytes;
+        m_root_cache_deleting += oldest.bytes;
+        delete_tree(std::move(oldest.root), m_root_cache_deleting);
+        m_root_cache.pop_back();
+    }
+}
+
+std::unique_ptr<UCTNode> UCTSearch::find_cached_root(const GameState& state) {
+    auto it = std::find_if(begin(m_root_cache), end(m_root_cache),
+        [&state](const CachedRoot& entry) {
+            return entry.hash == state.board.get_hash()
+                && entry.movenum == state.get_movenum()
+                && entry.komi == state.get_komi();
+        });
+    if (it == end(m_root_cache)) {
+        return nullptr;
+    }
+    auto root = std::move(it->root);
+    m_root_cache_size -= it->bytes;
+    m_tree_size += it->bytes;
+    m_root_cache.erase(it);
+    return root;
+}
+
+void UCTSearch::update_root(bool use_cache) {
     // Definition of m_playouts is playouts per search call.
     // So reset this count now.
     m_playouts = 0;
+    m_round = 0;
+    m_gc_passes = 0;
+    m_gc_collapsed = 0;
 
 #ifndef NDEBUG
     auto start_nodes = m_root->count_nodes_and_clear_expand_state();
 #endif
 
-    if (!advance_to_new_rootstate() || !m_root) {
+    auto advanced = advance_to_new_rootstate() && m_root;
+    if (use_cache) {
+        // Keep the tree we are leaving. Whenever advancing failed m_root
+        // still matches m_last_rootstate, as far as it got.
+        if (!advanced && m_root && m_last_rootstate) {
+            cache_root(std::move(m_root), *m_last_rootstate);
+        }
+        auto cached = find_cached_root(m_rootstate);
+        if (cached && (!advanced
+                       || cached->get_visits() > m_root->get_visits())) {
+            myprintf("Reusing the earlier search of this position, "
+                     "%d visits.\n", cached->get_visits());
+            delete_tree(std::move(m_root));
+            m_root = std::move(cached);
+            advanced = true;
+        } else {
+            delete_tree(std::move(cached));
+        }
+    }
+    if (!advanced) {
+        delete_tree(std::move(m_root));
         m_root = std::make_unique<UCTNode>(FastBoard::PASS, 0.0f);
     }
+    report_speculative_reuse();
     // Clear last_rootstate to prevent accidental use.
     m_last_rootstate.reset(nullptr);
 
@@ -210,8 +337,12 @@ void UCTSearch::update_root() {
 #endif
 }
 
+size_t UCTSearch::max_tree_size() const {
+    return m_max_tree_size ? m_max_tree_size : cfg_max_tree_size;
+}
+
 float UCTSearch::get_min_psa_ratio() const {
-    const auto mem_full = UCTNodePointer::get_tree_size() / static_cast<float>(cfg_max_tree_size);
+    const auto mem_full = m_tree_size / static_cast<float>(max_tree_size());
     // If we are halfway through our memory budget, start trimming
     // moves with very low policy priors.
     if (mem_full > 0.5f) {
@@ -252,7 +383,15 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
     }
 
     if (node->has_children() && !result.valid()) {
-        auto next = node->uct_select_child(color, node == m_root.get());
+        auto next = static_cast<UCTNode*>(nullptr);
+        {
+            Perf::ScopedTimer timer(Perf::SELECT);
+            if (node == m_root.get() && !m_spec_replies.empty()) {
+                next = select_speculative_reply();
+            } else {
+                next = node->uct_select_child(color, node == m_root.get());
+            }
+        }
         auto move = next->get_move();
 
         currstate.play_move(move);
@@ -263,10 +402,14 @@ SearchResult UCTSearch::play_simulation(GameState & currstate,
         }
     }
 
-    if (result.valid()) {
-        node->update(result.eval());
+    {
+        Perf::ScopedTimer timer(Perf::BACKUP);
+        if (result.valid()) {
+            node->update_and_virtual_loss_undo(result.eval());
+        } else {
+            node->virtual_loss_undo();
+        }
     }
-    node->virtual_loss_undo();
 
     return result;
 }
@@ -297,9 +440,7 @@ void UCTSearch::dump_stats(FastState & state, UCTNode & parent) {
         if (++movecount > 2 && !node->get_visits()) break;
 
         auto move = state.move_to_text(node->get_move());
-        auto tmpstate = FastState{state};
-        tmpstate.play_move(node->get_move());
-        auto pv = move + " " + get_pv(tmpstate, *node);
+        auto pv = move + " " + get_pv(state, !color, *node);
 
         myprintf("%4s -> %7d (V: %5.2f%%) (LCB: %5.2f%%) (N: %5.2f%%) PV: %s\n",
             move.c_str(),
@@ -312,7 +453,10 @@ void UCTSearch::dump_stats(FastState & state, UCTNode & parent) {
     tree_stats(parent);
 }
 
-void UCTSearch::output_analysis(FastState & state, UCTNode & parent) {
+void UCTSearch::output_analysis(const FastState & state, UCTNode & parent,
+                                PVCache & pv_cache) {
+    TreeReader reader(*this);
+
     // We need to make a copy of the data before sorting
     auto sortable_data = std::vector<OutputAnalysisData>();
 
@@ -335,14 +479,20 @@ void UCTSearch::output_analysis(FastState & state, UCTNode & parent) {
             continue;
         }
         auto move = state.move_to_text(node->get_move());
-        auto tmpstate = FastState{state};
-        tmpstate.play_move(node->get_move());
-        auto rest_of_pv = get_pv(tmpstate, *node);
-        auto pv = move + (rest_of_pv.empty() ? "" : " " + rest_of_pv);
-        auto move_eval = node->get_visits() ? node->get_raw_eval(color) : 0.0f;
+        auto visits = node->get_visits();
+        // A subtree that got no new visits can't have a different PV.
+        auto& cached = pv_cache[node.get()];
+        if (cached.pv.empty() || cached.move != node->get_move()
+            || cached.visits != visits) {
+            auto rest_of_pv = get_pv(state, !color, *node);
+            cached.move = node->get_move();
+            cached.visits = visits;
+            cached.pv = move + (rest_of_pv.empty() ? "" : " " + rest_of_pv);
+        }
+        const auto& pv = cached.pv;
+        auto move_eval = visits ? node->get_raw_eval(color) : 0.0f;
         auto policy = node->get_policy();
         auto lcb = node->get_eval_lcb(color);
-        auto visits = node->get_visits();
         // Need at least 2 visits for valid LCB.
         auto lcb_ratio_exceeded = visits > 2 &&
             visits > max_visits * cfg_lcb_min_visit_ratio;
@@ -353,16 +503,73 @@ void UCTSearch::output_analysis(FastState & state, UCTNode & parent) {
     // Sort array to decide order
     std::stable_sort(rbegin(sortable_data), rend(sortable_data));
 
+    // Build the whole line first so that analysis lines from searches
+    // running on other threads don't interleave with it.
+    auto line = m_output_prefix;
     auto i = 0;
-    // Output analysis data in gtp stream
     for (const auto& node : sortable_data) {
         if (i > 0) {
-            gtp_printf_raw(" ");
+            line += " ";
         }
-        gtp_printf_raw(node.get_info_string(i).c_str());
+        line += node.get_info_string(i);
         i++;
     }
-    gtp_printf_raw("\n");
+    // Output analysis data in gtp stream
+    gtp_printf_raw("%s\n", line.c_str());
+}
+
+void UCTSearch::start_reporter() {
+    if (!cfg_analyze_tags.interval_centis()) {
+        return;
+    }
+    m_reporter_stop = false;
+    m_reporter = std::thread(&UCTSearch::analysis_reporter, this,
+                             cfg_analyze_tags);
+}
+
+void UCTSearch::stop_reporter() {
+    if (!m_reporter.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_reporter_mutex);
+        m_reporter_stop = true;
+    }
+    m_reporter_cv.notify_one();
+    m_reporter.join();
+}
+
+void UCTSearch::analysis_reporter(AnalyzeTags tags) {
+    // Building the PVs inflates nodes.
+    TreeScope scope(*this);
+    // output_analysis reads the tags of the thread it runs on.
+    cfg_analyze_tags = std::move(tags);
+    const auto interval =
+        std::chrono::milliseconds(10 * cfg_analyze_tags.interval_centis());
+
+    auto pv_cache = PVCache{};
+    auto gc_passes = m_gc_passes.load();
+    auto posted = false;
+    std::unique_lock<std::mutex> lock(m_reporter_mutex);
+    while (!m_reporter_cv.wait_for(lock, interval,
+                                   [this] { return m_reporter_stop; })) {
+        lock.unlock();
+        // Collapsed subtrees may have lost the nodes of a cached PV.
+        if (gc_passes != m_gc_passes) {
+            gc_passes = m_gc_passes.load();
+            pv_cache.clear();
+        }
+        output_analysis(m_rootstate, *m_root, pv_cache);
+        posted = true;
+        lock.lock();
+    }
+    lock.unlock();
+
+    // Make sure to post at least once.
+    if (!posted) {
+        output_analysis(m_rootstate, *m_root, pv_cache);
+    }
+    cfg_analyze_tags = {};
 }
 
 void UCTSearch::tree_stats(const UCTNode& node) {
@@ -588,7 +795,8 @@ int UCTSearch::get_best_move(passflag_t passflag) {
     return bestmove;
 }
 
-std::string UCTSearch::get_pv(FastState & state, UCTNode& parent) {
+std::string UCTSearch::get_pv(const FastState & state, int color,
+                              UCTNode& parent) {
     if (!parent.has_children()) {
         return std::string();
     }
@@ -601,16 +809,14 @@ std::string UCTSearch::get_pv(FastState & state, UCTNode& parent) {
         return std::string();
     }
 
-    auto& best_child = parent.get_best_root_child(state.get_to_move());
+    auto& best_child = parent.get_best_root_child(color);
     if (best_child.first_visit()) {
         return std::string();
     }
     auto best_move = best_child.get_move();
     auto res = state.move_to_text(best_move);
 
-    state.play_move(best_move);
-
-    auto next = get_pv(state, best_child);
+    auto next = get_pv(state, !color, best_child);
     if (!next.empty()) {
         res.append(" ").append(next);
     }
@@ -618,17 +824,17 @@ std::string UCTSearch::get_pv(FastState & state, UCTNode& parent) {
 }
 
 std::string UCTSearch::get_analysis(int playouts) {
-    FastState tempstate = m_rootstate;
-    int color = tempstate.board.get_to_move();
+    TreeReader reader(*this);
+    int color = m_rootstate.board.get_to_move();
 
-    auto pvstring = get_pv(tempstate, *m_root);
+    auto pvstring = get_pv(m_rootstate, color, *m_root);
     float winrate = 100.0f * m_root->get_raw_eval(color);
     return str(boost::format("Playouts: %d, Win: %5.2f%%, PV: %s")
         % playouts % winrate % pvstring.c_str());
 }
 
 bool UCTSearch::is_running() const {
-    return m_run && UCTNodePointer::get_tree_size() < cfg_max_tree_size;
+    return m_run && m_tree_size < max_tree_size();
 }
 
 int UCTSearch::est_playouts_left(int elapsed_centis, int time_for_move) const {
@@ -637,12 +843,21 @@ int UCTSearch::est_playouts_left(int elapsed_centis, int time_for_move) const {
         std::max(0, std::min(m_maxplayouts - playouts,
                              m_maxvisits - m_root->get_visits()));
 
+    // The playout rate depends on the machine and its load, so keep it
+    // out of decisions that shape a deterministic search.
+    if (cfg_deterministic) {
+        return playouts_left;
+    }
+
     // Wait for at least 1 second and 100 playouts
-    // so we get a reliable playout_rate.
-    if (elapsed_centis < 100 || playouts < 100) {
+    // so we get a reliable playout_rate. Until then, fall back
+    // on what previous searches achieved.
+    auto playout_rate = m_rootstate.get_timecontrol().get_playout_rate();
+    if (elapsed_centis >= 100 && playouts >= 100) {
+        playout_rate = 1.0f * playouts / elapsed_centis;
+    } else if (playout_rate <= 0.0f) {
         return playouts_left;
     }
-    const auto playout_rate = 1.0f * playouts / elapsed_centis;
     const auto time_left = std::max(0, time_for_move - elapsed_centis);
     return std::min(playouts_left,
                     static_cast<int>(std::ceil(playout_rate * time_left)));
@@ -724,27 +939,322 @@ bool UCTSearch::have_alternate_moves(int elapsed_centis, int time_for_move) {
     return false;
 }
 
+bool UCTSearch::lcb_separated(int elapsed_centis, int time_for_move) {
+    if (cfg_lcb_stop_alpha <= 0.0f) {
+        return false;
+    }
+    // Only moves with enough visits to be picked by get_best_move are
+    // contenders, the same rule the LCB sort in sort_children uses.
+    const auto color = m_rootstate.get_to_move();
+    auto max_visits = 0;
+    for (const auto& child : m_root->get_children()) {
+        max_visits = std::max(max_visits, child.get_visits());
+    }
+    const auto min_visits =
+        std::max(2, int(cfg_lcb_min_visit_ratio * max_visits));
+
+    auto best_lcb = -1e6f;
+    auto best_ucb = -1e6f;
+    auto other_ucb = -1e6f;
+    auto contenders = 0;
+    for (const auto& child : m_root->get_children()) {
+        const auto visits = child.get_visits();
+        if (!child.valid() || visits < min_visits) {
+            continue;
+        }
+        const auto node = child.get();
+        const auto mean = node->get_raw_eval(color);
+        const auto stddev =
+            std::sqrt(node->get_eval_variance(1.0f) / visits);
+        const auto z = Utils::cached_stop_t_quantile(visits - 1);
+        const auto lcb = mean - z * stddev;
+        const auto ucb = mean + z * stddev;
+        if (lcb > best_lcb) {
+            other_ucb = std::max(other_ucb, best_ucb);
+            best_lcb = lcb;
+            best_ucb = ucb;
+        } else {
+            other_ucb = std::max(other_ucb, ucb);
+        }
+        ++contenders;
+    }
+    if (contenders < 2 || best_lcb <= other_ucb) {
+        return false;
+    }
+
+    auto saved_centis = std::max(0, time_for_move - elapsed_centis);
+    ++m_lcb_stops;
+    m_lcb_saved_centis += saved_centis;
+    myprintf("Best move separated at %.1f%% confidence, "
+             "%.1fs left, stopping early.\n",
+             100.0f * (1.0f - cfg_lcb_stop_alpha), saved_centis / 100.0f);
+    return true;
+}
+
 bool UCTSearch::stop_thinking(int elapsed_centis, int time_for_move) const {
     return m_playouts >= m_maxplayouts
            || m_root->get_visits() >= m_maxvisits
            || elapsed_centis >= time_for_move;
 }
 
+UCTWorker::UCTWorker(GameState & state, UCTSearch * search, UCTNode * root)
+    : m_rootstate(state), m_search(search), m_root(root),
+      m_analyze_tags(&cfg_analyze_tags) {}
+
 void UCTWorker::operator()() {
+    UCTSearch::TreeScope scope(*m_search);
+    // Move restrictions are per thread, so that concurrent searches
+    // can analyze with different ones. Adopt those of the thread that
+    // started the search, which don't change while it is running.
+    cfg_analyze_tags = *m_analyze_tags;
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
+        auto currstate = [this]() {
+            Perf::ScopedTimer timer(Perf::STATE_COPY);
+            return std::make_unique<GameState>(m_rootstate);
+        }();
+        UCTSearch::TreeReader reader(*m_search);
         auto result = m_search->play_simulation(*currstate, m_root);
         if (result.valid()) {
             m_search->increment_playouts();
         }
     } while (m_search->is_running());
+    cfg_analyze_tags = {};
+}
+
+UCTSearch::TreeReader::TreeReader(UCTSearch& search) {
+    // Register under the current epoch. If the collector advanced the
+    // epoch in the meantime, it may already have stopped waiting for
+    // that slot, so back out and retry.
+    while (true) {
+        const auto epoch = search.m_gc_epoch.load();
+        m_readers = &search.m_gc_readers[epoch & 1];
+        ++*m_readers;
+        if (search.m_gc_epoch.load() == epoch) {
+            return;
+        }
+        --*m_readers;
+    }
+}
+
+UCTSearch::TreeReader::~TreeReader() {
+    --*m_readers;
+}
+
+void UCTSearch::collect_tree() {
+    const auto low_water = GC_LOW_WATERMARK * max_tree_size();
+    auto max_visits = 1;
+    while (m_run && m_tree_size > low_water) {
+        auto detached = std::vector<UCTNode*>{};
+        // There are a lot of special cases where code assumes all children
+        // of the root are inflated, so only start collapsing below them.
+        for (const auto& child : m_root->get_children()) {
+            if (child.is_inflated()) {
+                child->collapse_children(max_visits, detached);
+            }
+        }
+        if (!detached.empty()) {
+            // Readers that entered before the epoch change might still
+            // be walking the detached subtrees. Wait for them to leave
+            // before freeing the memory.
+            const auto epoch = m_gc_epoch++;
+            while (m_gc_readers[epoch & 1].load() > 0) {
+                std::this_thread::yield();
+            }
+            for (const auto node : detached) {
+                m_nodes -= node->count_nodes();
+                delete node;
+            }
+            m_gc_collapsed += static_cast<int>(detached.size());
+        } else if (max_visits > m_root->get_visits()) {
+            // Nothing left that we are willing to collapse.
+            break;
+        }
+        max_visits *= 2;
+    }
+    m_gc_passes++;
+}
+
+void UCTSearch::tree_collector() {
+    TreeScope scope(*this);
+    const auto high_water = GC_HIGH_WATERMARK * max_tree_size();
+    while (m_run) {
+        if (m_tree_size > high_water) {
+            collect_tree();
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
 }
 
 void UCTSearch::increment_playouts() {
     m_playouts++;
 }
 
+void UCTSearch::search_once() {
+    if (cfg_deterministic) {
+        play_round();
+        return;
+    }
+
+    auto currstate = [this]() {
+        Perf::ScopedTimer timer(Perf::STATE_COPY);
+        return std::make_unique<GameState>(m_rootstate);
+    }();
+
+    TreeReader reader(*this);
+    auto result = play_simulation(*currstate, m_root.get());
+    if (result.valid()) {
+        increment_playouts();
+    }
+}
+
+void UCTSearch::play_round() {
+    // Collect between rounds, when no leaf is in flight.
+    if (cfg_tree_gc && m_tree_size > GC_HIGH_WATERMARK * max_tree_size()) {
+        collect_tree();
+    }
+
+    // Don't start more playouts than the limits allow, so that the
+    // last round doesn't depend on when the stop condition is checked.
+    const auto playouts_left =
+        std::min(m_maxplayouts - m_playouts.load(),
+                 m_maxvisits - m_root->get_visits());
+    const auto size = static_cast<size_t>(
+        std::max(1, std::min(static_cast<int>(m_threads), playouts_left)));
+
+    // Each round has its own random stream, which seeds the selection
+    // on this thread and the evaluation of each leaf.
+    auto round_rng = Random{1};
+    round_rng.seedrandom(cfg_rng_seed ^ (m_round++ * 0x9e3779b97f4a7c15));
+    Random::get_Rng().seedrandom(round_rng.randuint64());
+
+    auto leaves = std::vector<RoundLeaf>(size);
+    auto pending = std::unordered_set<const UCTNode*>{};
+    for (auto& leaf : leaves) {
+        {
+            Perf::ScopedTimer timer(Perf::STATE_COPY);
+            leaf.state = std::make_unique<GameState>(m_rootstate);
+        }
+        leaf.seed = round_rng.randuint64();
+        select_leaf(leaf, pending);
+    }
+
+    // Every leaf gets a thread of its own. As each leaf reseeds the
+    // random stream, which thread evaluates it makes no difference.
+    const auto tags = &cfg_analyze_tags;
+    ThreadGroup tg(thread_pool);
+    for (auto i = size_t{1}; i < size; i++) {
+        if (leaves[i].evaluate) {
+            tg.add_task([this, &leaf = leaves[i], tags]() {
+                cfg_analyze_tags = *tags;
+                evaluate_leaf(leaf);
+                cfg_analyze_tags = {};
+            });
+        }
+    }
+    if (leaves[0].evaluate) {
+        evaluate_leaf(leaves[0]);
+    }
+    tg.wait_all();
+
+    // The evaluations only enter the cache now, in leaf order, so that
+    // which positions it keeps doesn't depend on the thread timing.
+    Perf::ScopedTimer timer(Perf::BACKUP);
+    for (auto& leaf : leaves) {
+        if (leaf.evaluate && leaf.result.valid()) {
+            m_network.nncache_insert(leaf.state->board.get_hash(),
+                                     leaf.netresult);
+        }
+        for (auto node = leaf.path.rbegin(); node != leaf.path.rend(); ++node) {
+            if (leaf.result.valid()) {
+                (*node)->update_and_virtual_loss_undo(leaf.result.eval());
+            } else {
+                (*node)->virtual_loss_undo();
+            }
+        }
+        if (leaf.result.valid()) {
+            increment_playouts();
+        }
+    }
+}
+
+void UCTSearch::select_leaf(RoundLeaf& leaf,
+                            std::unordered_set<const UCTNode*>& pending) {
+    // Walks down like play_simulation(), but stops at the node to expand
+    // instead of evaluating it.
+    auto& currstate = *leaf.state;
+    auto node = m_root.get();
+    while (true) {
+        node->virtual_loss();
+        leaf.path.emplace_back(node);
+
+        if (node->expandable()) {
+            if (currstate.get_passes() >= 2) {
+                auto score = currstate.final_score();
+                leaf.result = SearchResult::from_score(score);
+                return;
+            }
+            const auto min_psa_ratio = get_min_psa_ratio();
+            if (node->expandable(min_psa_ratio)) {
+                if (!node->has_children()) {
+                    // Another leaf of this round already expands it,
+                    // only undo the virtual loss.
+                    if (pending.insert(node).second) {
+                        leaf.min_psa_ratio = min_psa_ratio;
+                        leaf.evaluate = true;
+                    }
+                    return;
+                }
+                // Widening a node that was expanded before doesn't back
+                // up an eval, so do it right away.
+                float eval;
+                node->create_children(m_network, m_nodes, currstate, eval,
+                                      min_psa_ratio);
+            }
+        }
+        if (!node->has_children()) {
+            return;
+        }
+
+        auto next = static_cast<UCTNode*>(nullptr);
+        {
+            Perf::ScopedTimer timer(Perf::SELECT);
+            if (node == m_root.get() && !m_spec_replies.empty()) {
+                next = select_speculative_reply();
+            } else {
+                next = node->uct_select_child(currstate.get_to_move(),
+                                              node == m_root.get());
+            }
+        }
+        auto move = next->get_move();
+
+        currstate.play_move(move);
+        if (move != FastBoard::PASS && currstate.superko()) {
+            next->invalidate();
+            return;
+        }
+        node = next;
+    }
+}
+
+void UCTSearch::evaluate_leaf(RoundLeaf& leaf) {
+    TreeScope scope(*this);
+    // The symmetry comes from the leaf's own stream. Evaluations of this
+    // round are only cached once the round is over, see play_round().
+    Random::get_Rng().seedrandom(leaf.seed);
+    leaf.netresult = m_network.get_output(leaf.state.get(),
+                                          Network::Ensemble::RANDOM_SYMMETRY,
+                                          -1, true, false);
+    float eval;
+    if (leaf.path.back()->create_children(leaf.netresult, m_nodes,
+                                          *leaf.state, eval,
+                                          leaf.min_psa_ratio)) {
+        leaf.result = SearchResult::from_eval(eval);
+    }
+}
+
 int UCTSearch::think(int color, passflag_t passflag) {
+    TreeScope scope(*this);
     // Start counting time for us
     m_rootstate.start_clock(color);
 
@@ -755,44 +1265,63 @@ int UCTSearch::think(int color, passflag_t passflag) {
     // set side to move
     m_rootstate.board.set_to_move(color);
 
-    auto time_for_move =
-        m_rootstate.get_timecontrol().max_time_for_move(
-            m_rootstate.board.get_boardsize(),
-            color, m_rootstate.get_movenum());
-
-    myprintf("Thinking at most %.1f seconds...\n", time_for_move/100.0f);
-
     // create a sorted list of legal moves (make sure we
     // play something legal and decent even in time trouble)
     m_root->prepare_root_node(m_network, color, m_nodes, m_rootstate);
 
+    // How much of the search we already have from the previous moves,
+    // and how decided it is.
+    const auto reused_visits = m_root->get_visits();
+    auto child_visits = 0;
+    auto leader_visits = 0;
+    for (const auto& node : m_root->get_children()) {
+        child_visits += node->get_visits();
+        leader_visits = std::max(leader_visits, node->get_visits());
+    }
+    const auto leader_share =
+        child_visits > 0 ? float(leader_visits) / child_visits : 0.0f;
+
+    const auto& tc = m_rootstate.get_timecontrol();
+    const auto base_time_for_move =
+        tc.max_time_for_move(m_rootstate.board.get_boardsize(),
+                             color, m_rootstate.get_movenum());
+    // Only visits below the root tell how decided the position is.
+    const auto time_for_move =
+        tc.scale_time_for_move(color, base_time_for_move,
+                               child_visits, leader_share);
+
+    myprintf("Thinking at most %.1f seconds...\n", time_for_move/100.0f);
+    if (time_for_move != base_time_for_move) {
+        myprintf("Budget %.1fs scaled %.2fx: %d visits reused, "
+                 "%.0f%% on the leading move, %.0f playouts/s expected.\n",
+                 base_time_for_move/100.0f,
+                 float(time_for_move) / base_time_for_move,
+                 reused_visits, leader_share * 100.0f,
+                 tc.get_playout_rate() * 100.0f);
+    }
+
     m_run = true;
-    int cpus = cfg_num_threads;
     ThreadGroup tg(thread_pool);
-    for (int i = 1; i < cpus; i++) {
-        tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
+    // A deterministic search runs its rounds from this thread.
+    if (!cfg_deterministic) {
+        for (auto i = size_t{1}; i < m_threads; i++) {
+            tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
+        }
+        if (cfg_tree_gc) {
+            tg.add_task([this]() { tree_collector(); });
+        }
     }
 
+    start_reporter();
+
     auto keeprunning = true;
     auto last_update = 0;
-    auto last_output = 0;
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-
-        auto result = play_simulation(*currstate, m_root.get());
-        if (result.valid()) {
-            increment_playouts();
-        }
+        search_once();
 
         Time elapsed;
         int elapsed_centis = Time::timediff_centis(start, elapsed);
 
-        if (cfg_analyze_tags.interval_centis() &&
-            elapsed_centis - last_output > cfg_analyze_tags.interval_centis()) {
-            last_output = elapsed_centis;
-            output_analysis(m_rootstate, *m_root);
-        }
-
         // output some stats every few seconds
         // check if we should still search
         if (!cfg_quiet && elapsed_centis - last_update > 250) {
@@ -802,12 +1331,11 @@ int UCTSearch::think(int color, passflag_t passflag) {
         keeprunning  = is_running();
         keeprunning &= !stop_thinking(elapsed_centis, time_for_move);
         keeprunning &= have_alternate_moves(elapsed_centis, time_for_move);
+        keeprunning = keeprunning
+                      && !lcb_separated(elapsed_centis, time_for_move);
     } while (keeprunning);
 
-    // Make sure to post at least once.
-    if (cfg_analyze_tags.interval_centis() && last_output == 0) {
-        output_analysis(m_rootstate, *m_root);
-    }
+    stop_reporter();
 
     // Stop the search.
     m_run = false;
@@ -826,10 +1354,22 @@ int UCTSearch::think(int color, passflag_t passflag) {
     // Display search info.
     myprintf("\n");
     dump_stats(m_rootstate, *m_root);
-    Training::record(m_network, m_rootstate, *m_root);
+    if (m_training_output) {
+        Training::record(m_network, m_rootstate, *m_root);
+    }
 
     Time elapsed;
     int elapsed_centis = Time::timediff_centis(start, elapsed);
+    m_rootstate.record_search(m_playouts, elapsed_centis,
+                              reused_visits, m_root->get_visits());
+    if (m_lcb_stops > 0) {
+        myprintf("LCB early stop: %d searches, %.1fs saved in total\n",
+                 m_lcb_stops, m_lcb_saved_centis / 100.0f);
+    }
+    if (m_gc_passes > 0) {
+        myprintf("Tree collector: %d passes, %d subtrees collapsed\n",
+                 m_gc_passes.load(), m_gc_collapsed);
+    }
     myprintf("%d visits, %d nodes, %d playouts, %.0f n/s\n\n",
              m_root->get_visits(),
              m_nodes.load(),
@@ -865,47 +1405,155 @@ std::string UCTSearch::explain_last_think() const {
     return m_think_output;
 }
 
-void UCTSearch::ponder() {
+float UCTSearch::get_root_eval(int color) const {
+    return m_root->get_eval(color);
+}
+
+int UCTSearch::get_root_visits() const {
+    return m_root->get_visits();
+}
+
+int UCTSearch::get_playouts() const {
+    return m_playouts;
+}
+
+void UCTSearch::prepare_speculative_replies() {
+    auto replies = std::vector<UCTNode*>{};
+    for (const auto& child : m_root->get_children()) {
+        if (child->valid()) {
+            replies.emplace_back(child.get());
+        }
+    }
+    const auto count = std::min(replies.size(),
+                                static_cast<size_t>(cfg_ponder_replies));
+    std::partial_sort(begin(replies), begin(replies) + count, end(replies),
+        [](const UCTNode* a, const UCTNode* b) {
+            return a->get_policy() > b->get_policy();
+        });
+
+    auto policy_sum = 0.0f;
+    for (auto i = size_t{0}; i < count; i++) {
+        policy_sum += replies[i]->get_policy();
+    }
+
+    m_spec_replies = std::vector<SpeculativeReply>(count);
+    for (auto i = size_t{0}; i < count; i++) {
+        auto& reply = m_spec_replies[i];
+        reply.node = replies[i];
+        if (policy_sum > std::numeric_limits<float>::min()) {
+            reply.share = replies[i]->get_policy() / policy_sum;
+        } else {
+            reply.share = 1.0f / count;
+        }
+        reply.start_visits = replies[i]->get_visits();
+    }
+}
+
+UCTNode* UCTSearch::select_speculative_reply() {
+    // Send the playout to the reply that is furthest behind
+    // its share of the work.
+    auto best = &m_spec_replies.front();
+    auto best_ratio = std::numeric_limits<float>::max();
+    for (auto& reply : m_spec_replies) {
+        const auto work = reply.start_visits + reply.dispatched.load() + 1;
+        const auto ratio = work / reply.share;
+        if (ratio < best_ratio) {
+            best_ratio = ratio;
+            best = &reply;
+        }
+    }
+    best->dispatched++;
+    return best->node;
+}
+
+void UCTSearch::report_speculative_replies() {
+    m_spec_last.clear();
+    m_spec_movenum = m_rootstate.get_movenum();
+
+    myprintf("Speculative ponder on %d replies:\n",
+             static_cast<int>(m_spec_replies.size()));
+    for (const auto& reply : m_spec_replies) {
+        const auto move = reply.node->get_move();
+        const auto visits = reply.node->get_visits();
+        m_spec_last.emplace_back(move, visits);
+        myprintf("%4s -> %7d visits (+%d) (N: %5.2f%%)\n",
+                 m_rootstate.move_to_text(move).c_str(),
+                 visits, visits - reply.start_visits,
+                 reply.node->get_policy() * 100.0f);
+    }
+    m_spec_replies.clear();
+}
+
+void UCTSearch::report_speculative_reuse() {
+    // Only report once the opponent actually replied.
+    if (m_spec_last.empty() || m_rootstate.get_movenum() <= m_spec_movenum) {
+        return;
+    }
+
+    const auto move = m_rootstate.get_last_move();
+    const auto hit = std::any_of(begin(m_spec_last), end(m_spec_last),
+        [move](const std::pair<int, int>& reply) {
+            return reply.first == move;
+        });
+    m_spec_ponders++;
+    if (hit) {
+        m_spec_hits++;
+    }
+    myprintf("Speculative ponder %s on %s, reusing %d visits (%d/%d hits).\n",
+             hit ? "hit" : "miss",
+             m_rootstate.move_to_text(move).c_str(),
+             m_root->get_visits(), m_spec_hits, m_spec_ponders);
+    m_spec_last.clear();
+}
+
+void UCTSearch::ponder(bool speculative) {
+    ponder(speculative, []() { return Utils::input_pending(); });
+}
+
+void UCTSearch::analyze(const std::atomic<bool>& stop) {
+    ponder(false, [&stop]() { return stop.load(); });
+}
+
+void UCTSearch::ponder(bool speculative,
+                       const std::function<bool()>& interrupted) {
+    TreeScope scope(*this);
     auto disable_reuse = cfg_analyze_tags.has_move_restrictions();
     if (disable_reuse) {
         m_last_rootstate.reset(nullptr);
     }
 
-    update_root();
+    update_root(!disable_reuse);
 
     m_root->prepare_root_node(m_network, m_rootstate.board.get_to_move(),
                               m_nodes, m_rootstate);
 
+    // Spread the ponder time over the opponent's most likely replies,
+    // as those are the subtrees we can reuse when it is our turn again.
+    if (speculative && !disable_reuse && cfg_ponder_replies > 0) {
+        prepare_speculative_replies();
+    }
+
     m_run = true;
     ThreadGroup tg(thread_pool);
-    for (auto i = size_t{1}; i < cfg_num_threads; i++) {
-        tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
+    // A deterministic search runs its rounds from this thread.
+    if (!cfg_deterministic) {
+        for (auto i = size_t{1}; i < m_threads; i++) {
+            tg.add_task(UCTWorker(m_rootstate, this, m_root.get()));
+        }
+        if (cfg_tree_gc) {
+            tg.add_task([this]() { tree_collector(); });
+        }
     }
-    Time start;
+    start_reporter();
+
     auto keeprunning = true;
-    auto last_output = 0;
     do {
-        auto currstate = std::make_unique<GameState>(m_rootstate);
-        auto result = play_simulation(*currstate, m_root.get());
-        if (result.valid()) {
-            increment_playouts();
-        }
-        if (cfg_analyze_tags.interval_centis()) {
-            Time elapsed;
-            int elapsed_centis = Time::timediff_centis(start, elapsed);
-            if (elapsed_centis - last_output > cfg_analyze_tags.interval_centis()) {
-                last_output = elapsed_centis;
-                output_analysis(m_rootstate, *m_root);
-            }
-        }
+        search_once();
         keeprunning  = is_running();
         keeprunning &= !stop_thinking(0, 1);
-    } while (!Utils::input_pending() && keeprunning);
+    } while (!interrupted() && keeprunning);
 
-    // Make sure to post at least once.
-    if (cfg_analyze_tags.interval_centis() && last_output == 0) {
-        output_analysis(m_rootstate, *m_root);
-    }
+    stop_reporter();
 
     // Stop the search.
     m_run = false;
@@ -914,7 +1562,14 @@ void UCTSearch::ponder() {
     // Display search info.
     myprintf("\n");
     dump_stats(m_rootstate, *m_root);
+    if (!m_spec_replies.empty()) {
+        report_speculative_replies();
+    }
 
+    if (m_gc_passes > 0) {
+        myprintf("Tree collector: %d passes, %d subtrees collapsed\n",
+                 m_gc_passes.load(), m_gc_collapsed);
+    }
     myprintf("\n%d visits, %d nodes\n\n", m_root->get_visits(), m_nodes.load());
 
     // Copy the root state. Use to check for tree re-use in future calls.
@@ -938,3 +1593,30 @@ void UCTSearch::set_visit_limit(int visits) {
     m_maxvisits = std::min(visits, UNLIMITED_PLAYOUTS);
 }
 
+void UCTSearch::reserve_pool_threads(size_t searches) {
+    // Every running search keeps a pool thread busy with its tree
+    // collector, on top of the cfg_num_threads its helpers share.
+    const auto collectors = cfg_tree_gc ? searches : 0;
+    thread_pool.ensure_threads(size_t{cfg_num_threads} + collectors);
+}
+
+void UCTSearch::set_max_tree_size(size_t bytes) {
+    m_max_tree_size = bytes;
+}
+
+size_t UCTSearch::get_tree_size() const {
+    return m_tree_size + m_root_cache_size + m_root_cache_deleting;
+}
+
+void UCTSearch::set_thread_count(size_t threads) {
+    m_threads = std::max(threads, size_t{1});
+}
+
+void UCTSearch::set_output_prefix(const std::string& prefix) {
+    m_output_prefix = prefix;
+}
+
+void UCTSearch::set_training_output(bool record) {
+    m_training_output = record;
+}
+
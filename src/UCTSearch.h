@@ -31,11 +31,20 @@
 #define UCTSEARCH_H_INCLUDED
 
 #include <list>
+#include <array>
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <functional>
 #include <future>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "ThreadPool.h"
 #include "FastBoard.h"
@@ -44,6 +53,7 @@
 #include "UCTNode.h"
 #include "Network.h"
 
+class AnalyzeTags;
 
 class SearchResult {
 public:
@@ -107,57 +117,225 @@ public:
     static constexpr auto UNLIMITED_PLAYOUTS =
         std::numeric_limits<int>::max() / 2;
 
+    /*
+        Tree collector watermarks, as a fraction of the tree memory limit.
+        Collection starts when the tree grows past the high mark
+        and continues until it is back under the low mark.
+    */
+    static constexpr float GC_HIGH_WATERMARK = 0.90f;
+    static constexpr float GC_LOW_WATERMARK = 0.75f;
+
+    /*
+        Root cache limits. Trees the search moved away from are kept so
+        that going back to a recent position, after an undo, a loadsgf
+        or while reviewing a game, continues the earlier search. The
+        least recently used tree goes first. Cached trees are accounted
+        apart from the tree being searched: they take up to
+        ROOT_CACHE_SHARE of the memory limit on top of it, and don't
+        make the search stop or collect early.
+    */
+    static constexpr auto ROOT_CACHE_ENTRIES = size_t{8};
+    static constexpr float ROOT_CACHE_SHARE = 0.25f;
+
+    /*
+        Every thread that walks the search tree while the tree collector
+        may be running must hold a TreeReader. Subtrees detached by the
+        collector are only deleted once all readers which could have
+        seen them are gone.
+    */
+    class TreeReader {
+    public:
+        explicit TreeReader(UCTSearch& search);
+        ~TreeReader();
+        TreeReader(const TreeReader&) = delete;
+        TreeReader& operator=(const TreeReader&) = delete;
+    private:
+        std::atomic<int>* m_readers;
+    };
+
+    /*
+        Every thread that creates or deletes nodes of the search tree
+        must hold a TreeScope, so that they count against the size of
+        this tree and not against those of other searches.
+    */
+    class TreeScope {
+    public:
+        explicit TreeScope(UCTSearch& search)
+            : m_scope(search.m_tree_size) {}
+    private:
+        UCTNodePointer::TreeSizeScope m_scope;
+    };
+
     UCTSearch(GameState& g, Network & network);
+    ~UCTSearch();
     int think(int color, passflag_t passflag = NORMAL);
     void set_playout_limit(int playouts);
     void set_visit_limit(int visits);
-    void ponder();
+    // Search threads, including the caller of think() or ponder().
+    void set_thread_count(size_t threads);
+    // Grow the thread pool for this many searches running at once.
+    static void reserve_pool_threads(size_t searches);
+    // Memory limit of this search tree, instead of cfg_max_tree_size,
+    // for searches that share the memory budget.
+    void set_max_tree_size(size_t bytes);
+    // Memory used by this search tree, cached trees included.
+    size_t get_tree_size() const;
+    void ponder(bool speculative = false);
+    // Ponder until stop is set instead of until there is input.
+    void analyze(const std::atomic<bool>& stop);
+    // Prepended to every analysis line, to tell concurrent searches apart.
+    void set_output_prefix(const std::string& prefix);
+    // Whether think() records its searches for training. Modes which
+    // never dump training data turn this off to save an evaluation and
+    // the record per move.
+    void set_training_output(bool record);
     bool is_running() const;
     void increment_playouts();
     std::string explain_last_think() const;
+    // Root winrate for color and visits after the last search.
+    float get_root_eval(int color) const;
+    int get_root_visits() const;
+    int get_playouts() const;
     SearchResult play_simulation(GameState& currstate, UCTNode* const node);
 
 private:
+    size_t max_tree_size() const;
     float get_min_psa_ratio() const;
     void dump_stats(FastState& state, UCTNode& parent);
     void tree_stats(const UCTNode& node);
-    std::string get_pv(FastState& state, UCTNode& parent);
+    std::string get_pv(const FastState& state, int color, UCTNode& parent);
     std::string get_analysis(int playouts);
     bool should_resign(passflag_t passflag, float besteval);
     bool have_alternate_moves(int elapsed_centis, int time_for_move);
+    bool lcb_separated(int elapsed_centis, int time_for_move);
     int est_playouts_left(int elapsed_centis, int time_for_move) const;
     size_t prune_noncontenders(int color, int elapsed_centis = 0, int time_for_move = 0,
                                bool prune = true);
     bool stop_thinking(int elapsed_centis = 0, int time_for_move = 0) const;
     int get_best_move(passflag_t passflag);
-    void update_root();
+    void ponder(bool speculative, const std::function<bool()>& interrupted);
+    void update_root(bool use_cache = true);
     bool advance_to_new_rootstate();
-    void output_analysis(FastState & state, UCTNode & parent);
+    void delete_tree(std::unique_ptr<UCTNode> root);
+    void delete_tree(std::unique_ptr<UCTNode> root,
+                     std::atomic<size_t>& tree_size);
+    void cache_root(std::unique_ptr<UCTNode> root, const GameState& state);
+    std::unique_ptr<UCTNode> find_cached_root(const GameState& state);
+    // The PV of a root child is only rebuilt when its visit count changed
+    // since the previous analysis line.
+    struct CachedPV {
+        int move;
+        int visits;
+        std::string pv;
+    };
+    using PVCache = std::unordered_map<const UCTNode*, CachedPV>;
+    void output_analysis(const FastState & state, UCTNode & parent,
+                         PVCache & pv_cache);
+    void start_reporter();
+    void stop_reporter();
+    void analysis_reporter(AnalyzeTags tags);
+    void collect_tree();
+    void tree_collector();
+    void prepare_speculative_replies();
+    UCTNode* select_speculative_reply();
+    void report_speculative_replies();
+    void report_speculative_reuse();
+    void search_once();
+
+    // Deterministic search, see cfg_deterministic. A round selects one
+    // leaf per thread in a fixed order, evaluates the leaves in parallel
+    // and backs them up in the same fixed order.
+    struct RoundLeaf {
+        std::unique_ptr<GameState> state;
+        std::vector<UCTNode*> path;
+        std::uint64_t seed{0};
+        float min_psa_ratio{0.0f};
+        bool evaluate{false};
+        Network::Netresult netresult;
+        SearchResult result;
+    };
+    void play_round();
+    void select_leaf(RoundLeaf& leaf,
+                     std::unordered_set<const UCTNode*>& pending);
+    void evaluate_leaf(RoundLeaf& leaf);
 
     GameState & m_rootstate;
     std::unique_ptr<GameState> m_last_rootstate;
     std::unique_ptr<UCTNode> m_root;
     std::atomic<int> m_nodes{0};
     std::atomic<int> m_playouts{0};
+    std::uint64_t m_round{0};
     std::atomic<bool> m_run{false};
+    // Bytes in the tree being searched, in the cached trees and in the
+    // evicted cached trees that are still being deleted, see TreeScope.
+    // Only the first counts against max_tree_size().
+    std::atomic<size_t> m_tree_size{0};
+    std::atomic<size_t> m_root_cache_size{0};
+    std::atomic<size_t> m_root_cache_deleting{0};
+    size_t m_max_tree_size{0};
     int m_maxplayouts;
     int m_maxvisits;
+    size_t m_threads;
     std::string m_think_output;
+    std::string m_output_prefix;
+    bool m_training_output{true};
 
     std::list<Utils::ThreadGroup> m_delete_futures;
 
+    // Recently searched positions, most recent first, see
+    // ROOT_CACHE_ENTRIES.
+    struct CachedRoot {
+        std::uint64_t hash;
+        size_t movenum;
+        float komi;
+        size_t bytes;
+        std::unique_ptr<UCTNode> root;
+    };
+    std::list<CachedRoot> m_root_cache;
+
+    // Analysis reporter, which posts lz-analyze lines while the search
+    // threads keep playing out.
+    std::thread m_reporter;
+    std::mutex m_reporter_mutex;
+    std::condition_variable m_reporter_cv;
+    bool m_reporter_stop{false};
+
+    // Tree collector state, see TreeReader.
+    std::atomic<unsigned int> m_gc_epoch{0};
+    std::array<std::atomic<int>, 2> m_gc_readers{{{0}, {0}}};
+    std::atomic<int> m_gc_passes{0};
+    int m_gc_collapsed{0};
+
+    // Speculative pondering: the opponent replies being searched, the
+    // share of the ponder playouts each should get, and how many it got.
+    struct SpeculativeReply {
+        UCTNode* node{nullptr};
+        float share{0.0f};
+        int start_visits{0};
+        std::atomic<int> dispatched{0};
+    };
+    std::vector<SpeculativeReply> m_spec_replies;
+    std::vector<std::pair<int, int>> m_spec_last;
+    size_t m_spec_movenum{0};
+    int m_spec_hits{0};
+    int m_spec_ponders{0};
+
+    // Searches cut short by lcb_separated and the time they gave back.
+    int m_lcb_stops{0};
+    int m_lcb_saved_centis{0};
+
     Network & m_network;
 };
 
 class UCTWorker {
 public:
-    UCTWorker(GameState & state, UCTSearch * search, UCTNode * root)
-      : m_rootstate(state), m_search(search), m_root(root) {}
+    UCTWorker(GameState & state, UCTSearch * search, UCTNode * root);
     void operator()();
 private:
     GameState & m_rootstate;
     UCTSearch * m_search;
     UCTNode * m_root;
+    const AnalyzeTags * m_analyze_tags;
 };
 
 #endif
@@ -31,6 +31,7 @@
 #include "Utils.h"
 
 #include <mutex>
+#include <cerrno>
 #include <cstdarg>
 #include <cstdio>
 
@@ -41,6 +42,7 @@
 #include <windows.h>
 #else
 #include <sys/select.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <pwd.h>
@@ -52,26 +54,43 @@ Utils::ThreadPool thread_pool;
 
 auto constexpr z_entries = 1000;
 std::array<float, z_entries> z_lookup;
+std::array<float, z_entries> z_stop_lookup;
 
-void Utils::create_z_table() {
+static void fill_z_table(std::array<float, z_entries>& table, float alpha) {
     for (auto i = 1; i < z_entries + 1; i++) {
         boost::math::students_t dist(i);
-        auto z = boost::math::quantile(boost::math::complement(dist, cfg_ci_alpha));
-        z_lookup[i - 1] = z;
+        auto z = boost::math::quantile(boost::math::complement(dist, alpha));
+        table[i - 1] = z;
     }
 }
 
-float Utils::cached_t_quantile(int v) {
+static float lookup_z_table(const std::array<float, z_entries>& table,
+                            int v) {
     if (v < 1) {
-        return z_lookup[0];
+        return table[0];
     }
     if (v < z_entries) {
-        return z_lookup[v - 1];
+        return table[v - 1];
     }
     // z approaches constant when v is high enough.
     // With default lookup table size the function is flat enough that we
     // can just return the last entry for all v bigger than it.
-    return z_lookup[z_entries - 1];
+    return table[z_entries - 1];
+}
+
+void Utils::create_z_table() {
+    fill_z_table(z_lookup, cfg_ci_alpha);
+    if (cfg_lcb_stop_alpha > 0.0f) {
+        fill_z_table(z_stop_lookup, cfg_lcb_stop_alpha);
+    }
+}
+
+float Utils::cached_t_quantile(int v) {
+    return lookup_z_table(z_lookup, v);
+}
+
+float Utils::cached_stop_t_quantile(int v) {
+    return lookup_z_table(z_stop_lookup, v);
 }
 
 bool Utils::input_pending() {
@@ -161,9 +180,11 @@ static void gtp_base_printf(int id, std::string prefix,
     if (id != -1) {
         prefix += std::to_string(id);
     }
+    // Background analyses print from other threads, don't let
+    // their lines split a response.
+    std::lock_guard<std::mutex> lock(IOmutex);
     gtp_fprintf(stdout, prefix, fmt, ap);
     if (cfg_logfile_handle) {
-        std::lock_guard<std::mutex> lock(IOmutex);
         gtp_fprintf(cfg_logfile_handle, prefix, fmt, ap);
     }
 }
@@ -176,13 +197,13 @@ void Utils::gtp_printf(int id, const char *fmt, ...) {
 }
 
 void Utils::gtp_printf_raw(const char *fmt, ...) {
+    std::lock_guard<std::mutex> lock(IOmutex);
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stdout, fmt, ap);
     va_end(ap);
 
     if (cfg_logfile_handle) {
-        std::lock_guard<std::mutex> lock(IOmutex);
         va_start(ap, fmt);
         vfprintf(cfg_logfile_handle, fmt, ap);
         va_end(ap);
@@ -232,3 +253,25 @@ const std::string Utils::leelaz_file(std::string file) {
     dir /= file;
     return dir.string();
 }
+
+std::uint32_t Utils::process_id() {
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return getpid();
+#endif
+}
+
+bool Utils::process_alive(std::uint32_t pid) {
+#ifdef _WIN32
+    const auto process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    if (process == nullptr) {
+        return GetLastError() == ERROR_ACCESS_DENIED;
+    }
+    const auto alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+#else
+    return kill(pid_t(pid), 0) == 0 || errno != ESRCH;
+#endif
+}
@@ -33,6 +33,7 @@
 #include "config.h"
 
 #include <atomic>
+#include <cstdint>
 #include <limits>
 #include <string>
 
@@ -68,8 +69,13 @@ namespace Utils {
 
     const std::string leelaz_file(std::string file);
 
+    std::uint32_t process_id();
+    // True unless the process is known to have exited.
+    bool process_alive(std::uint32_t pid);
+
     void create_z_table();
     float cached_t_quantile(int v);
+    float cached_stop_t_quantile(int v);
 }
 
 #endif
@@ -0,0 +1,305 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+// Micro-benchmarks of the board, search and network code. Built on Google
+// Benchmark, so the usual flags apply, and
+//
+//     microbench --benchmark_format=json --benchmark_out=run.json
+//
+// gives machine-readable results. With --weights the full search is
+// timed too.
+//
+//     microbench [benchmark flags] [--weights file]
+
+#include "config.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "CPUPipe.h"
+#include "FastBoard.h"
+#include "FullBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "NNCache.h"
+#include "Network.h"
+#include "Random.h"
+#include "ThreadPool.h"
+#include "UCTNode.h"
+#include "UCTSearch.h"
+#include "Utils.h"
+#include "Zobrist.h"
+
+namespace {
+
+constexpr auto GAME_LENGTH = 200;
+
+// A game of random moves that don't fill own eyes, the same every run.
+std::vector<std::pair<int, int>> random_game() {
+    auto rng = Random{5489};
+    auto state = GameState{};
+    state.init_game(BOARD_SIZE, KOMI);
+
+    auto moves = std::vector<std::pair<int, int>>{};
+    while (moves.size() < GAME_LENGTH) {
+        const auto color = state.get_to_move();
+        auto candidates = std::vector<int>{};
+        for (auto i = 0; i < NUM_INTERSECTIONS; i++) {
+            const auto vertex = state.board.get_vertex(i % BOARD_SIZE,
+                                                       i / BOARD_SIZE);
+            if (state.board.get_state(vertex) == FastBoard::EMPTY
+                && state.is_move_legal(color, vertex)
+                && !state.board.is_eye(color, vertex)) {
+                candidates.emplace_back(vertex);
+            }
+        }
+        if (candidates.empty()) {
+            break;
+        }
+        auto next = state;
+        const auto vertex = candidates[rng.randuint64(candidates.size())];
+        next.play_move(vertex);
+        if (next.superko()) {
+            continue;
+        }
+        state = next;
+        moves.emplace_back(color, vertex);
+    }
+    return moves;
+}
+
+GameState play_game(const std::vector<std::pair<int, int>>& moves) {
+    auto state = GameState{};
+    state.init_game(BOARD_SIZE, KOMI);
+    for (const auto& move : moves) {
+        state.play_move(move.first, move.second);
+    }
+    return state;
+}
+
+void BM_UpdateBoard(benchmark::State& bstate) {
+    const auto moves = random_game();
+    auto empty = FullBoard{};
+    empty.reset_board(BOARD_SIZE);
+    for (auto _ : bstate) {
+        auto board = empty;
+        for (const auto& move : moves) {
+            benchmark::DoNotOptimize(
+                board.update_board(move.first, move.second));
+        }
+    }
+    bstate.SetItemsProcessed(bstate.iterations() * moves.size());
+}
+BENCHMARK(BM_UpdateBoard);
+
+void BM_Superko(benchmark::State& bstate) {
+    const auto state = play_game(random_game());
+    for (auto _ : bstate) {
+        benchmark::DoNotOptimize(state.superko());
+    }
+}
+BENCHMARK(BM_Superko);
+
+void BM_GatherFeatures(benchmark::State& bstate) {
+    const auto state = play_game(random_game());
+    auto symmetry = 0;
+    for (auto _ : bstate) {
+        benchmark::DoNotOptimize(Network::gather_features(&state, symmetry));
+        symmetry = (symmetry + 1) % Network::NUM_SYMMETRIES;
+    }
+}
+BENCHMARK(BM_GatherFeatures);
+
+// Half of the lookups hit, the others insert, so the threads contend
+// on both paths.
+void BM_NNCache(benchmark::State& bstate) {
+    static NNCache cache{NNCache::MIN_CACHE_COUNT};
+    const auto keys = std::uint64_t{2 * NNCache::MIN_CACHE_COUNT};
+    auto rng = Random{std::uint64_t(bstate.thread_index()) + 1};
+    auto result = NNCache::Netresult{};
+    auto hits = 0;
+    for (auto _ : bstate) {
+        const auto hash = rng.randuint64(keys);
+        if (cache.lookup(hash, result)) {
+            hits++;
+        } else {
+            cache.insert(hash, result);
+        }
+    }
+    bstate.counters["hit_rate"] = benchmark::Counter(
+        hits, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_NNCache)->ThreadRange(1, 8)->UseRealTime();
+
+void BM_UCTSelectChild(benchmark::State& bstate) {
+    auto state = GameState{};
+    state.init_game(BOARD_SIZE, KOMI);
+    auto netresult = NNCache::Netresult{};
+    netresult.policy.fill(1.0f / (NUM_INTERSECTIONS + 1));
+    netresult.policy_pass = 1.0f / (NUM_INTERSECTIONS + 1);
+    netresult.winrate = 0.5f;
+
+    std::atomic<int> nodecount{0};
+    auto eval = 0.0f;
+    UCTNode root{FastBoard::PASS, 0.0f};
+    root.create_children(netresult, nodecount, state, eval);
+    root.update(eval);
+
+    // Spread some visits over the children, as a search would.
+    auto rng = Random{5489};
+    for (auto i = 0; i < bstate.range(0); i++) {
+        const auto child = root.uct_select_child(FastBoard::BLACK, true);
+        const auto child_eval = rng.randuint64(1000) / 1000.0f;
+        child->update(child_eval);
+        root.update(child_eval);
+    }
+
+    for (auto _ : bstate) {
+        benchmark::DoNotOptimize(
+            root.uct_select_child(FastBoard::BLACK, true));
+    }
+}
+BENCHMARK(BM_UCTSelectChild)->Arg(100)->Arg(10000);
+
+class NoHeads : public ForwardPipe::OutputHeads {
+public:
+    void compute(size_t, std::vector<float>&, std::vector<float>&,
+                 std::vector<float>&, std::vector<float>&) const override {}
+};
+
+// The input convolution and one residual block of the given width, with
+// random weights. Reports convolutions per second.
+void BM_CPUPipe(benchmark::State& bstate) {
+    const auto channels = static_cast<size_t>(bstate.range(0));
+    auto rng = Random{5489};
+    const auto random_weights = [&rng](size_t size) {
+        auto weights = std::vector<float>(size);
+        for (auto& w : weights) {
+            w = rng.randuint64(1000) / 1000.0f - 0.5f;
+        }
+        return weights;
+    };
+
+    auto weights = std::make_shared<ForwardPipe::ForwardPipeWeights>();
+    const auto inputs = std::vector<size_t>{
+        size_t{Network::INPUT_CHANNELS}, channels, channels};
+    for (const auto input : inputs) {
+        weights->m_conv_weights.emplace_back(
+            random_weights(WINOGRAD_TILE * channels * input));
+        weights->m_batchnorm_means.emplace_back(random_weights(channels));
+        weights->m_batchnorm_stddevs.emplace_back(
+            std::vector<float>(channels, 1.0f));
+    }
+    weights->m_conv_pol_w =
+        random_weights(Network::OUTPUTS_POLICY * channels);
+    weights->m_conv_val_w =
+        random_weights(Network::OUTPUTS_VALUE * channels);
+
+    CPUPipe pipe;
+    pipe.initialize(channels);
+    pipe.push_weights(3, Network::INPUT_CHANNELS, channels, weights);
+    pipe.set_output_heads(std::make_shared<NoHeads>());
+
+    const auto input =
+        random_weights(Network::INPUT_CHANNELS * NUM_INTERSECTIONS);
+    auto output_pol = std::vector<float>{};
+    auto output_val = std::vector<float>{};
+    for (auto _ : bstate) {
+        pipe.forward(input, output_pol, output_val);
+    }
+    bstate.SetItemsProcessed(bstate.iterations() * inputs.size());
+}
+BENCHMARK(BM_CPUPipe)->Arg(32)->Arg(64)->Arg(128)->Arg(192)->Arg(256);
+
+std::unique_ptr<Network> s_network;
+
+void BM_Think(benchmark::State& bstate) {
+    const auto visits = static_cast<int>(bstate.range(0));
+    auto total_visits = 0;
+    for (auto _ : bstate) {
+        bstate.PauseTiming();
+        auto state = GameState{};
+        state.init_game(BOARD_SIZE, KOMI);
+        s_network->nncache_clear();
+        bstate.ResumeTiming();
+
+        UCTSearch search(state, *s_network);
+        search.set_visit_limit(visits);
+        search.think(FastBoard::BLACK, UCTSearch::NORESIGN);
+        total_visits += search.get_root_visits();
+    }
+    bstate.counters["visits"] = benchmark::Counter(
+        total_visits, benchmark::Counter::kIsRate);
+}
+
+}
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+
+    GTP::setup_default_parameters();
+    cfg_quiet = true;
+    cfg_noise = false;
+    cfg_random_cnt = 0;
+    cfg_timemanage = TimeManagement::OFF;
+
+    auto weights = std::string{};
+    for (auto i = 1; i < argc; i++) {
+        const auto arg = std::string{argv[i]};
+        if (arg == "--weights" && i + 1 < argc) {
+            weights = argv[++i];
+        } else {
+            printf("Unknown option %s\n", arg.c_str());
+            printf("Usage: %s [benchmark flags] [--weights file]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    thread_pool.initialize(cfg_num_threads);
+    auto rng = std::make_unique<Random>(5489);
+    Zobrist::init_zobrist(*rng);
+    Random::get_Rng().seedrandom(cfg_rng_seed);
+    Utils::create_z_table();
+
+    if (!weights.empty()) {
+        s_network = std::make_unique<Network>();
+        s_network->initialize(cfg_max_playouts, weights);
+        benchmark::RegisterBenchmark("BM_Think", BM_Think)
+            ->Arg(100)->Arg(800)
+            ->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
@@ -32,17 +32,35 @@
 
 #include <cstdint>
 #include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <numeric>
 #include <regex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
+#include <boost/filesystem.hpp>
 
+#include "BatchScheduler.h"
+#include "EvalServer.h"
 #include "GTP.h"
 #include "GameState.h"
+#include "Match.h"
 #include "NNCache.h"
+#include "PerfCounters.h"
 #include "Random.h"
+#include "SGFParser.h"
+#include "SGFTree.h"
+#include "SessionManager.h"
 #include "ThreadPool.h"
+#include "Training.h"
+#include "TunerDatabase.h"
+#include "UCTNode.h"
+#include "UCTNodePointer.h"
+#include "UCTSearch.h"
 #include "Utils.h"
 #include "Zobrist.h"
 
@@ -221,6 +239,54 @@ TEST_F(LeelaTest, MoveOnOccupiedPnt) {
     EXPECT_NE(output.find("illegal move"), std::string::npos);
 }
 
+// Collapsing a node must restore the original vertex/policy pair
+// and release the memory accounted for the node.
+TEST_F(LeelaTest, DeflateNodePointer) {
+    const auto start_size = UCTNodePointer::get_tree_size();
+    {
+        UCTNodePointer ptr(123, 0.25f);
+        ptr.inflate();
+        EXPECT_TRUE(ptr.is_inflated());
+        ptr->update(0.75f);
+        EXPECT_EQ(ptr.get_visits(), 1);
+
+        auto node = std::unique_ptr<UCTNode>(ptr.deflate());
+        ASSERT_NE(node, nullptr);
+        EXPECT_FALSE(ptr.is_inflated());
+        EXPECT_EQ(ptr.get_move(), 123);
+        EXPECT_EQ(ptr.get_policy(), 0.25f);
+        EXPECT_EQ(ptr.get_visits(), 0);
+        EXPECT_EQ(ptr.deflate(), nullptr);
+    }
+    EXPECT_EQ(UCTNodePointer::get_tree_size(), start_size);
+}
+
+TEST_F(LeelaTest, NodeBackup) {
+    UCTNode node{FastBoard::PASS, 0.0f};
+    auto threads = std::vector<std::thread>{};
+    for (auto t = 0; t < 4; t++) {
+        threads.emplace_back([&node, t] {
+            for (auto i = 0; i < 10000; i++) {
+                node.virtual_loss();
+                if (i % 10 == 0) {
+                    node.virtual_loss_undo();
+                } else {
+                    node.update_and_virtual_loss_undo(t % 2 ? 0.25f : 0.75f);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // No visit or eval lost, and no virtual loss left behind.
+    EXPECT_EQ(node.get_visits(), 36000);
+    EXPECT_FLOAT_EQ(node.get_eval(FastBoard::BLACK), 0.5f);
+    EXPECT_FLOAT_EQ(node.get_raw_eval(FastBoard::BLACK), 0.5f);
+    EXPECT_NEAR(node.get_eval_variance(), 0.0625f, 1e-4f);
+}
+
 // Basic TimeControl test
 TEST_F(LeelaTest, TimeControl) {
     std::pair<std::string, std::string> result;
@@ -266,6 +332,29 @@ TEST_F(LeelaTest, TimeControl2) {
     expect_regex(result.second, "White time: 00:02:00, 1 period\\(s\\) of 120 seconds left");
 }
 
+// Time scaling from the running search model
+TEST_F(LeelaTest, TimeControlSearchModel) {
+    // 10 minutes absolute
+    TimeControl tc(60000, 0, 0, 0);
+
+    // No model yet, nothing changes.
+    EXPECT_EQ(tc.scale_time_for_move(FastBoard::BLACK, 1000, 0, 0.0f), 1000);
+
+    // 10 playouts per centisecond, half of the visits reused.
+    tc.record_search(10000, 1000, 10000, 20000);
+    EXPECT_FLOAT_EQ(tc.get_playout_rate(), 10.0f);
+
+    // A big reused tree that settled on one move needs less time.
+    EXPECT_LT(tc.scale_time_for_move(FastBoard::BLACK, 1000, 100000, 1.0f),
+              1000);
+    // A reused tree that is still split gets more, as its visits carry
+    // over to later moves.
+    EXPECT_GT(tc.scale_time_for_move(FastBoard::BLACK, 1000, 100000, 0.2f),
+              1000);
+    // A fresh tree tells nothing about the position.
+    EXPECT_EQ(tc.scale_time_for_move(FastBoard::BLACK, 1000, 0, 0.0f), 1000);
+}
+
 void LeelaTest::test_analyze_cmd(std::string cmd, bool valid, int who, int interval,
         int avoidlen, int avoidcolor, int avoiduntil) {
     // std::cout << "testing " << cmd << std::endl;
@@ -284,6 +373,599 @@ void LeelaTest::test_analyze_cmd(std::string cmd, bool valid, int who, int inter
     }
 }
 
+// The mapped collection must cut games exactly like chop_stream, and
+// a saved index must be reused.
+TEST_F(LeelaTest, SGFCollection) {
+    const auto sgf = std::string{
+        "(;GM[1]SZ[19]C[a \\] b ) (]RE[B+R];B[pd];W[dp])\n"
+        "  ( ;GM[1]SZ[19]RE[W+R];B[pd](;W[dd])(;W[dp]))\n"};
+    const auto path = boost::filesystem::temp_directory_path()
+        / boost::filesystem::unique_path();
+    const auto filename = path.string() + ".sgf";
+    const auto index_file = path.string() + ".lzidx";
+    {
+        std::ofstream out(filename, std::ofstream::binary);
+        out << sgf;
+    }
+
+    auto ins = std::istringstream{sgf};
+    const auto expected = SGFParser::chop_stream(ins);
+    ASSERT_EQ(expected.size(), 2u);
+    EXPECT_EQ(SGFParser::chop_all(filename), expected);
+    EXPECT_EQ(SGFParser::chop_from_file(filename, 1), expected[1]);
+
+    {
+        auto collection = SGFCollection{filename, index_file};
+        ASSERT_EQ(collection.size(), 2u);
+        EXPECT_EQ(collection.get_game(0), expected[0]);
+        EXPECT_TRUE(boost::filesystem::exists(index_file));
+    }
+    {
+        auto collection = SGFCollection{filename, index_file};
+        ASSERT_EQ(collection.size(), 2u);
+        EXPECT_EQ(collection.get_game(1), expected[1]);
+        EXPECT_THROW(collection.get_game(2), std::runtime_error);
+    }
+
+    boost::filesystem::remove(filename);
+    boost::filesystem::remove(index_file);
+}
+
+// Positions rebuilt from checkpoints must match a straight replay,
+// on the main line and in a variation.
+TEST_F(LeelaTest, SGFTreeReplay) {
+    auto move = [](int i) {
+        const auto point = (i * 47) % NUM_INTERSECTIONS;
+        return std::string(i % 2 ? ";W[" : ";B[")
+            + char('a' + point % BOARD_SIZE)
+            + char('a' + point / BOARD_SIZE) + "]";
+    };
+    auto sgf = std::string{"GM[1]SZ[19]KM[7.5]RE[B+R]"};
+    for (auto i = 0; i < 34; i++) {
+        sgf += move(i);
+    }
+    sgf += "(";
+    for (auto i = 34; i < 80; i++) {
+        sgf += move(i);
+    }
+    sgf += ")(" + move(100) + "))";
+
+    auto tree = SGFTree{};
+    tree.load_from_string(sgf);
+
+    const SGFTree* node = &tree;
+    for (auto i = 0; i < 70; i++) {
+        node = node->get_child(0);
+        ASSERT_NE(node, nullptr);
+    }
+    EXPECT_EQ(node->get_state().board.get_hash(),
+              tree.follow_mainline_state(70).board.get_hash());
+
+    node = &tree;
+    for (auto i = 0; i < 34; i++) {
+        node = node->get_child(0);
+    }
+    auto expected = tree.follow_mainline_state(34);
+    const auto variation = node->get_child(1);
+    ASSERT_NE(variation, nullptr);
+    const auto colored_move = variation->get_colored_move();
+    expected.play_move(colored_move.first, colored_move.second);
+    EXPECT_EQ(variation->get_state().board.get_hash(),
+              expected.board.get_hash());
+}
+
+// Binary training records must survive a round trip, with the
+// probabilities rounded to fp16.
+TEST_F(LeelaTest, BinaryTrainingRecord) {
+    auto step = TimeStep{};
+    step.planes.resize(Network::INPUT_CHANNELS);
+    step.planes[0][0] = true;
+    step.planes[3][NUM_INTERSECTIONS - 1] = true;
+    step.planes[15][100] = true;
+    step.to_move = FastBoard::WHITE;
+    step.probabilities.resize(POTENTIAL_MOVES);
+    step.probabilities[42] = 1.0f / 3.0f;
+    step.probabilities[NUM_INTERSECTIONS] = 2.0f / 3.0f;
+
+    auto data = Training::binary_header();
+    Training::encode_binary(data, step, FastBoard::BLACK);
+    EXPECT_TRUE(Training::check_binary_header(data));
+    EXPECT_EQ(data.size(),
+              Training::BINARY_HEADER_SIZE + Training::BINARY_RECORD_SIZE);
+
+    auto pos = Training::BINARY_HEADER_SIZE;
+    auto decoded = TimeStep{};
+    auto result = 0;
+    ASSERT_TRUE(Training::decode_binary(data, pos, decoded, result));
+    EXPECT_EQ(pos, data.size());
+    EXPECT_EQ(result, -1);
+    EXPECT_EQ(decoded.to_move, FastBoard::WHITE);
+    for (auto p = 0; p < 16; p++) {
+        EXPECT_EQ(decoded.planes[p], step.planes[p]);
+    }
+    for (auto i = 0; i < POTENTIAL_MOVES; i++) {
+        EXPECT_NEAR(decoded.probabilities[i], step.probabilities[i], 1e-3f);
+    }
+    EXPECT_FALSE(Training::decode_binary(data, pos, decoded, result));
+}
+
+// Closing a chunker waits for its own chunks only, and only reports
+// its own errors.
+TEST_F(LeelaTest, OutputChunkerClose) {
+    const auto dir = boost::filesystem::temp_directory_path()
+                     / boost::filesystem::unique_path();
+    boost::filesystem::create_directory(dir);
+    const auto good_name = (dir / "good").string();
+    const auto bad_name = (dir / "missing" / "bad").string();
+    {
+        auto good = OutputChunker{good_name, true};
+        good.append("game\n");
+        {
+            // Handed to the writer when it goes out of scope.
+            auto bad = OutputChunker{bad_name, true};
+            bad.append("game\n");
+        }
+        EXPECT_NO_THROW(good.close());
+        EXPECT_TRUE(boost::filesystem::exists(good_name + ".0.gz"));
+    }
+    {
+        auto bad = OutputChunker{bad_name, true};
+        bad.append("game\n");
+        EXPECT_THROW(bad.close(), std::runtime_error);
+    }
+    {
+        // Chunks are written in order, so the background one is on disk
+        // once a later chunker has closed.
+        auto background = OutputChunker{(dir / "background").string(), true};
+        background.append("game\n");
+        background.close_in_background();
+        auto later = OutputChunker{(dir / "later").string(), true};
+        later.append("game\n");
+        EXPECT_NO_THROW(later.close());
+        EXPECT_TRUE(boost::filesystem::exists(dir / "background.0.gz"));
+    }
+    boost::filesystem::remove_all(dir);
+}
+
+// Bad arguments are rejected without touching any file.
+TEST_F(LeelaTest, DumpSupervisedArguments) {
+    for (const auto& args : {"99999999999999999999999", "0", "-1", "1025",
+                             "4x", "shuffled"}) {
+        const auto result = gtp_execute(
+            std::string{"dump_supervised missing.sgf out.txt "} + args);
+        expect_regex(result.first, "\\? syntax not understood");
+    }
+    expect_regex(gtp_execute("dump_supervised missing.sgf out.txt 2").first,
+                 "\\? Error opening file");
+}
+
+// Counters of exited threads must survive, and lz-perf reset
+// must bring everything back to zero.
+TEST_F(LeelaTest, PerfCounters) {
+    gtp_execute("lz-perf reset");
+    std::thread([]() {
+        for (auto i = 0; i < 3; i++) {
+            Perf::record(Perf::SELECT, std::chrono::microseconds(10));
+        }
+        Perf::record_batch(4);
+        Perf::record_batch(4);
+        Perf::record_batch(1000);
+    }).join();
+
+    auto result = gtp_execute("lz-perf");
+    expect_regex(result.first, "select\\s+3\\s+0\\.0\\s+10\\.00");
+    expect_regex(result.first, "batch sizes 4:2 64\\+:1");
+
+    gtp_execute("lz-perf reset");
+    result = gtp_execute("lz-perf");
+    expect_regex(result.first, "select\\s+0\\s");
+    expect_regex(result.first, "batches 0,");
+
+    // Stage timers only read the clock once switched on.
+    { Perf::ScopedTimer timer(Perf::BACKUP); }
+    expect_regex(gtp_execute("lz-perf").first, "backup\\s+0\\s");
+    gtp_execute("lz-perf on");
+    { Perf::ScopedTimer timer(Perf::BACKUP); }
+    gtp_execute("lz-perf off");
+    { Perf::ScopedTimer timer(Perf::BACKUP); }
+    expect_regex(gtp_execute("lz-perf").first, "backup\\s+1\\s");
+}
+
+// A mock backend whose latency grows slowly with the batch size, fed
+// by search threads that wait for their evaluations.
+TEST_F(LeelaTest, BatchScheduler) {
+    using us = std::chrono::microseconds;
+    auto backend = [](size_t size) { return us(200 + 50 * size); };
+    // A closed loop like the search: each thread queues an evaluation,
+    // waits for it and then works for think microseconds before queueing
+    // the next one. One backend runs the batches. Returns the time the
+    // last batch came back, to continue from.
+    auto run = [&](BatchScheduler& scheduler, size_t threads, int think,
+                   us now = us(0)) {
+        const auto start = BatchScheduler::clock::time_point{};
+        auto ready = std::vector<us>(threads);
+        auto queued = std::vector<bool>(threads, false);
+        for (auto i = size_t{0}; i < threads; i++) {
+            ready[i] = now + us(i);
+        }
+        auto order = std::vector<size_t>(threads);
+        auto sort_ready = [&] {
+            std::iota(begin(order), end(order), size_t{0});
+            std::stable_sort(begin(order), end(order),
+                [&](size_t a, size_t b) { return ready[a] < ready[b]; });
+        };
+        auto queue_until = [&](us until) {
+            sort_ready();
+            for (const auto i : order) {
+                if (!queued[i] && ready[i] <= until) {
+                    scheduler.add_arrival(start + ready[i]);
+                    queued[i] = true;
+                }
+            }
+        };
+        for (auto batch = 0; batch < 300; batch++) {
+            sort_ready();
+            const auto batch_size = scheduler.batch_size();
+            const auto first = std::max(now, ready[order[0]]);
+            auto dispatch = first + scheduler.timeout();
+            if (batch_size <= threads) {
+                dispatch = std::min(dispatch, ready[order[batch_size - 1]]);
+            }
+            dispatch = std::max(dispatch, first);
+            queue_until(dispatch);
+            auto size = size_t{0};
+            for (const auto i : order) {
+                if (size < batch_size && ready[i] <= dispatch) {
+                    size++;
+                }
+            }
+            now = dispatch + backend(size);
+            queue_until(now);
+            scheduler.add_batch(size, backend(size), size < batch_size);
+            for (auto j = size_t{0}; j < size; j++) {
+                ready[order[j]] = now + us(think);
+                queued[order[j]] = false;
+            }
+        }
+        // Whatever is still queued comes back too.
+        const auto left = static_cast<size_t>(
+            std::count(begin(queued), end(queued), true));
+        if (left > 0) {
+            scheduler.add_batch(left, backend(left), true);
+        }
+        return now;
+    };
+
+    // Plenty of work: the largest batch has the best throughput.
+    auto fast = BatchScheduler{16, us(5000)};
+    run(fast, 16, 20);
+    EXPECT_EQ(fast.batch_size(), 16u);
+    EXPECT_LE(fast.timeout().count() + backend(16).count(), 5000);
+
+    // Threads mostly busy elsewhere, so don't wait for a batch.
+    auto slow = BatchScheduler{16, us(3000)};
+    run(slow, 16, 50000);
+    EXPECT_LE(slow.batch_size(), 2u);
+
+    // Only four threads feed the backend, larger batches never fill up.
+    auto starved = BatchScheduler{16, us(5000)};
+    const auto elapsed = run(starved, 4, 20);
+    EXPECT_EQ(starved.batch_size(), 4u);
+    EXPECT_EQ(starved.estimated_latency(4), backend(4));
+
+    // More threads join: the batches grow with them.
+    run(starved, 16, 20, elapsed);
+    EXPECT_EQ(starved.batch_size(), 16u);
+}
+
+// The slot protocol of the evaluation ring, without a second process.
+TEST_F(LeelaTest, EvalRingSlots) {
+    using namespace EvalRing;
+    auto slot = std::make_unique<Slot>();
+    slot->state = FREE;
+    slot->since = 0;
+
+    EXPECT_TRUE(claim(*slot, 7, 100));
+    EXPECT_FALSE(claim(*slot, 8, 100));
+    EXPECT_FALSE(start(*slot));
+    submit(*slot);
+    EXPECT_EQ(state(*slot), SUBMITTED);
+    EXPECT_TRUE(start(*slot));
+    EXPECT_FALSE(start(*slot));
+    finish(*slot, 200);
+    EXPECT_EQ(state(*slot), DONE);
+    release(*slot);
+    EXPECT_EQ(state(*slot), FREE);
+
+    // Slots are only taken back from engines that are gone, and only
+    // after STALE_MS.
+    auto alive = std::vector<std::uint32_t>{8};
+    auto is_alive = [&](std::uint32_t pid) {
+        return std::find(begin(alive), end(alive), pid) != end(alive);
+    };
+    const auto later = 300 + STALE_MS;
+    EXPECT_TRUE(claim(*slot, 7, 300));
+    EXPECT_FALSE(reclaim(*slot, later - 1, is_alive));
+    EXPECT_TRUE(reclaim(*slot, later, is_alive));
+    EXPECT_EQ(state(*slot), FREE);
+
+    EXPECT_TRUE(claim(*slot, 8, 300));
+    EXPECT_FALSE(reclaim(*slot, later, is_alive));
+    submit(*slot);
+    alive.clear();
+    // A submitted request is still served, and only then freed.
+    EXPECT_FALSE(reclaim(*slot, later, is_alive));
+    EXPECT_TRUE(start(*slot));
+    EXPECT_FALSE(reclaim(*slot, later, is_alive));
+    finish(*slot, later);
+    EXPECT_FALSE(reclaim(*slot, later, is_alive));
+    EXPECT_TRUE(reclaim(*slot, later + STALE_MS, is_alive));
+    EXPECT_TRUE(claim(*slot, 9, later + STALE_MS));
+
+    EXPECT_TRUE(Utils::process_alive(Utils::process_id()));
+}
+
+TEST_F(LeelaTest, TunerDatabase) {
+    auto filename = (boost::filesystem::temp_directory_path()
+                     / boost::filesystem::unique_path()).string();
+    {
+        auto file = std::ofstream{filename};
+        file << "1;XgemmBatched;256;8;256;16;-DMWG=16;OpenCL: gpu" << std::endl;
+        file << "not a tuning line" << std::endl;
+    }
+    auto key = TunerDatabase::Key{1, "XgemmBatched", 256, 8, 256, 16,
+                                  "OpenCL: gpu", "driver 2"};
+    auto other_size = key;
+    other_size.n = 16;
+
+    // Entries without a driver match any driver of the device.
+    auto database = TunerDatabase{filename};
+    EXPECT_EQ(database.size(), 1u);
+    EXPECT_EQ(database.find(key), "-DMWG=16");
+    EXPECT_EQ(database.find(other_size), "");
+
+    EXPECT_TRUE(database.store(key, "-DMWG=32"));
+    EXPECT_TRUE(database.store(other_size, "-DMWG=64"));
+
+    auto reloaded = TunerDatabase{filename};
+    EXPECT_EQ(reloaded.size(), 2u);
+    EXPECT_EQ(reloaded.find(key), "-DMWG=32");
+    EXPECT_EQ(reloaded.find(other_size), "-DMWG=64");
+    auto new_driver = key;
+    new_driver.driver = "driver 3";
+    EXPECT_EQ(reloaded.find(new_driver), "");
+
+    auto file = std::ifstream{filename};
+    auto line = std::string{};
+    std::getline(file, line);
+    EXPECT_EQ(line, "not a tuning line");
+    file.close();
+
+    // Tuners storing at the same time keep each other's entries.
+    std::atomic<int> stored{0};
+    auto threads = std::vector<std::thread>{};
+    auto own_key = [&key](int thread, int i) {
+        auto own = key;
+        own.m = 16 * (thread + 1);
+        own.k = 16 * (i + 1);
+        return own;
+    };
+    for (auto t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            auto own = TunerDatabase{filename};
+            for (auto i = 0; i < 10; i++) {
+                stored += own.store(own_key(t, i), "-DMWG=16");
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(stored, 40);
+    auto merged = TunerDatabase{filename};
+    EXPECT_EQ(merged.size(), 42u);
+    for (auto t = 0; t < 4; t++) {
+        for (auto i = 0; i < 10; i++) {
+            EXPECT_EQ(merged.find(own_key(t, i)), "-DMWG=16");
+        }
+    }
+    boost::filesystem::remove(filename);
+    boost::filesystem::remove(filename + ".lock");
+}
+
+// Going back to a position searched before picks up that search again.
+TEST_F(LeelaTest, RootCache) {
+    cfg_max_playouts = 50;
+    gtp_execute("clear_board");
+    gtp_execute("play b D4");
+    gtp_execute("genmove w");
+    gtp_execute("undo");
+    gtp_execute("undo");
+    auto result = gtp_execute("genmove b");
+    expect_regex(result.second, "Reusing the earlier search", false);
+
+    gtp_execute("undo");
+    gtp_execute("play b D4");
+    result = gtp_execute("genmove w");
+    expect_regex(result.second, "Reusing the earlier search of this position");
+
+    // A new game starts without any of this.
+    gtp_execute("clear_board");
+}
+
+// A tree that overflows the cache budget pushes out the older trees,
+// not itself.
+TEST_F(LeelaTest, RootCacheBudget) {
+    auto network = std::make_unique<Network>();
+    network->initialize(cfg_max_playouts, "../src/tests/0k.txt");
+    auto game = GameState{};
+    game.init_game(19, 7.5f);
+    auto search = std::make_unique<UCTSearch>(game, *network);
+    search->set_playout_limit(50);
+
+    // Search two positions, each time going back to the empty board so
+    // that the tree is cached.
+    game.play_textmove("b", "D4");
+    search->think(FastBoard::WHITE, UCTSearch::NORESIGN);
+    // Room for one such tree, but not for two.
+    search->set_max_tree_size(6 * search->get_tree_size());
+    game.undo_move();
+    search->think(FastBoard::BLACK, UCTSearch::NORESIGN);
+    game.play_textmove("b", "Q16");
+    search->think(FastBoard::WHITE, UCTSearch::NORESIGN);
+    game.undo_move();
+    search->think(FastBoard::BLACK, UCTSearch::NORESIGN);
+
+    game.play_textmove("b", "Q16");
+    testing::internal::CaptureStderr();
+    search->think(FastBoard::WHITE, UCTSearch::NORESIGN);
+    expect_regex(testing::internal::GetCapturedStderr(),
+                 "Reusing the earlier search of this position");
+
+    game.undo_move();
+    game.play_textmove("b", "D4");
+    testing::internal::CaptureStderr();
+    search->think(FastBoard::WHITE, UCTSearch::NORESIGN);
+    expect_regex(testing::internal::GetCapturedStderr(),
+                 "Reusing the earlier search", false);
+}
+
+// Every search counts its own tree against the memory limit, so a
+// large tree doesn't stop the other searches in the same process.
+TEST_F(LeelaTest, TreeSizePerSearch) {
+    cfg_quiet = true;
+    auto network = std::make_unique<Network>();
+    network->initialize(cfg_max_playouts, "../src/tests/0k.txt");
+    const auto outside = UCTNodePointer::get_tree_size();
+    {
+        auto first_game = GameState{};
+        first_game.init_game(19, 7.5f);
+        auto second_game = GameState{};
+        second_game.init_game(19, 7.5f);
+        auto first = std::make_unique<UCTSearch>(first_game, *network);
+        auto second = std::make_unique<UCTSearch>(second_game, *network);
+        first->set_playout_limit(100);
+        second->set_playout_limit(10);
+
+        first->think(FastBoard::BLACK, UCTSearch::NORESIGN);
+        EXPECT_GT(first->get_tree_size(), 0u);
+        EXPECT_EQ(second->get_tree_size(), 0u);
+        EXPECT_EQ(UCTNodePointer::get_tree_size(), outside);
+
+        cfg_max_tree_size = first->get_tree_size();
+        second->think(FastBoard::BLACK, UCTSearch::NORESIGN);
+        EXPECT_EQ(second->get_playouts(), 10);
+        EXPECT_LT(second->get_tree_size(), first->get_tree_size());
+    }
+    EXPECT_EQ(UCTNodePointer::get_tree_size(), outside);
+}
+
+// A session analyzing in the background doesn't count against the
+// tree of the selected one, which starts empty after clear_board.
+TEST_F(LeelaTest, SessionTrees) {
+    cfg_max_playouts = 50;
+    gtp_execute("clear_board");
+    auto created = gtp_execute("lz-session new").first;
+    expect_regex(created, "^= 1");
+    expect_regex(gtp_execute("lz-session analyze 1 b interval 100").first,
+                 "^=");
+    gtp_execute("genmove b");
+    gtp_execute("clear_board");
+    gtp_execute("genmove b");
+    expect_regex(gtp_execute("lz-session stop 1").first, "^=");
+    expect_regex(gtp_execute("lz-session close 1").first, "^=");
+    gtp_execute("clear_board");
+
+    // Each session keeps its own tree and its own analysis lines while
+    // the other one searches.
+    auto network = std::make_unique<Network>();
+    network->initialize(cfg_max_playouts, "../src/tests/0k.txt");
+    auto maingame = GameState{};
+    maingame.init_game(19, 7.5f);
+    SessionManager sessions{*network, maingame};
+    auto& first = *sessions.find(0);
+    auto& second = *sessions.find(sessions.create());
+    second.game->play_textmove("b", "D4");
+    auto analyze = [&sessions](SessionManager::Session& session,
+                               const std::string& who) {
+        auto cmdstream = std::istringstream{who + " interval 5"};
+        testing::internal::CaptureStdout();
+        sessions.start_analysis(session, AnalyzeTags{cmdstream,
+                                                     *session.game});
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        sessions.stop_analysis(session);
+        return testing::internal::GetCapturedStdout();
+    };
+
+    auto output = analyze(second, "w");
+    expect_regex(output, "session 1 info move");
+    expect_regex(output, "session 0", false);
+    const auto second_size = second.search->get_tree_size();
+    EXPECT_GT(second_size, 0u);
+    EXPECT_EQ(first.search->get_tree_size(), 0u);
+
+    output = analyze(first, "b");
+    expect_regex(output, "session 0 info move");
+    expect_regex(output, "session 1", false);
+    EXPECT_GT(first.search->get_tree_size(), 0u);
+    EXPECT_EQ(second.search->get_tree_size(), second_size);
+    EXPECT_EQ(first.game->get_movenum(), 0u);
+    EXPECT_EQ(second.game->get_movenum(), 1u);
+}
+
+TEST_F(LeelaTest, DeterministicSearch) {
+    cfg_deterministic = true;
+    cfg_num_threads = 4;
+    cfg_max_playouts = 200;
+    auto search = [this]() {
+        gtp_execute("clear_board");
+        gtp_execute("play b D4");
+        const auto stats = gtp_execute("genmove w").second;
+        // Only the per-move statistics, not the timing.
+        auto lines = std::string{};
+        auto in = std::istringstream{stats};
+        for (auto line = std::string{}; std::getline(in, line); ) {
+            if (line.find(" -> ") != std::string::npos) {
+                lines += line + "\n";
+            }
+        }
+        return lines;
+    };
+    const auto first = search();
+    EXPECT_FALSE(first.empty());
+    EXPECT_EQ(search(), first);
+}
+
+TEST_F(LeelaTest, MatchSprt) {
+    auto add = [](Sprt& sprt, int wins, int losses) {
+        sprt.add_draw();
+        for (auto i = 0; i < wins; i++) sprt.add_win();
+        for (auto i = 0; i < losses; i++) sprt.add_loss();
+    };
+
+    auto even = Sprt{0.0, 35.0, 0.05, 0.05};
+    add(even, 100, 100);
+    auto status = even.status();
+    EXPECT_EQ(status.result, Sprt::CONTINUE);
+    EXPECT_NEAR(status.llr, -1.02, 0.01);
+    EXPECT_NEAR(status.upper_bound, 2.94, 0.01);
+
+    auto better = Sprt{0.0, 35.0, 0.05, 0.05};
+    add(better, 50, 15);
+    EXPECT_EQ(better.status().result, Sprt::ACCEPT_H1);
+
+    auto worse = Sprt{0.0, 35.0, 0.05, 0.05};
+    add(worse, 30, 60);
+    EXPECT_EQ(worse.status().result, Sprt::ACCEPT_H0);
+
+    // Only losses, decided on the count alone.
+    auto shutout = Sprt{0.0, 35.0, 0.05, 0.05};
+    add(shutout, 0, 18);
+    EXPECT_EQ(shutout.status().result, Sprt::CONTINUE);
+    shutout.add_loss();
+    EXPECT_EQ(shutout.status().result, Sprt::ACCEPT_H0);
+}
+
 // Test parsing the lz-analyze command line
 TEST_F(LeelaTest, AnalyzeParse) {
     gtp_execute("clear_board");
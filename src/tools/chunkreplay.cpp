@@ -0,0 +1,307 @@
+/*
+    This file is part of Leela Zero.
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+
+    Leela Zero is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Leela Zero is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Leela Zero.  If not, see <http://www.gnu.org/licenses/>.
+
+    Additional permission under GNU GPL version 3 section 7
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with NVIDIA Corporation's libraries from the
+    NVIDIA CUDA Toolkit and/or the NVIDIA CUDA Deep Neural
+    Network library and/or the NVIDIA TensorRT inference library
+    (or a modified version of those libraries), containing parts covered
+    by the terms of the respective license agreement, the licensors of
+    this Program grant you additional permission to convey the resulting
+    work.
+*/
+
+
+// Reads training chunks, decodes every record, checks it by replaying the
+// games through GameState, encodes it again and compares the bytes.
+// Reports how fast each of these steps goes.
+//
+//     chunkreplay train.0.gz train.1.gz ...
+
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "FastBoard.h"
+#include "GTP.h"
+#include "GameState.h"
+#include "Random.h"
+#include "Timing.h"
+#include "Training.h"
+#include "Zobrist.h"
+#include "zlib.h"
+
+namespace {
+
+struct Stats {
+    size_t files{0};
+    size_t compressed_bytes{0};
+    size_t raw_bytes{0};
+    size_t records{0};
+    size_t games{0};
+    size_t verified{0};
+    size_t unverified{0};
+    double inflate_seconds{0.0};
+    double decode_seconds{0.0};
+    double validate_seconds{0.0};
+    double encode_seconds{0.0};
+    std::map<std::string, size_t> errors;
+    size_t error_count{0};
+};
+
+// Keep the report readable on badly broken input.
+constexpr auto MAX_ERROR_DETAILS = 10;
+
+void report_error(Stats& stats, const std::string& file, size_t record,
+                  const std::string& what) {
+    if (stats.error_count++ < MAX_ERROR_DETAILS) {
+        printf("%s: record %zu: %s\n", file.c_str(), record, what.c_str());
+    }
+    stats.errors[what]++;
+}
+
+bool read_gz(const std::string& file, std::string& data) {
+    auto gz = gzopen(file.c_str(), "rb");
+    if (!gz) {
+        return false;
+    }
+    data.clear();
+    auto buffer = std::vector<char>(1 << 20);
+    int count;
+    while ((count = gzread(gz, buffer.data(), buffer.size())) > 0) {
+        data.append(buffer.data(), count);
+    }
+    gzclose(gz);
+    return count == 0;
+}
+
+// Follows a game record by record. The move between two records is the
+// stone the previous side to move gained, which is played on our own
+// GameState, whose input planes must then match the record exactly.
+class Replayer {
+public:
+    // Returns an empty string if the record is consistent.
+    std::string check(const TimeStep& step, int result, Stats& stats);
+private:
+    std::string check_policy(const TimeStep& step) const;
+    std::string advance(const TimeStep& step, int result);
+
+    GameState m_game;
+    bool m_synced{false};
+    TimeStep m_prev;
+    int m_prev_result{0};
+};
+
+std::string Replayer::check(const TimeStep& step, int result,
+                            Stats& stats) {
+    auto error = check_policy(step);
+
+    auto game_start = step.to_move == FastBoard::BLACK;
+    for (auto p = size_t{0}; p < 16 && game_start; p++) {
+        game_start = step.planes[p].none();
+    }
+    if (game_start) {
+        stats.games++;
+        m_game.init_game(BOARD_SIZE, KOMI);
+        m_synced = true;
+    } else if (m_synced) {
+        const auto replay_error = advance(step, result);
+        if (error.empty()) {
+            error = replay_error;
+        }
+    }
+
+    if (!error.empty()) {
+        m_synced = false;
+    }
+    if (m_synced) {
+        stats.verified++;
+    } else {
+        // Games that don't start from an empty board, or the rest of a
+        // game after an error, can't be followed.
+        stats.unverified++;
+    }
+    m_prev = step;
+    m_prev_result = result;
+    return error;
+}
+
+std::string Replayer::check_policy(const TimeStep& step) const {
+    auto sum = 0.0;
+    for (auto idx = size_t{0}; idx < step.probabilities.size(); idx++) {
+        const auto prob = step.probabilities[idx];
+        if (prob < 0.0f) {
+            return "negative move probability";
+        }
+        if (prob > 0.0f && idx < NUM_INTERSECTIONS
+            && (step.planes[0][idx] || step.planes[8][idx])) {
+            return "move probability on an occupied point";
+        }
+        sum += prob;
+    }
+    // Terminal positions have no probabilities at all.
+    if (sum != 0.0 && std::abs(sum - 1.0) > 0.01) {
+        return "move probabilities don't add up to 1";
+    }
+    return "";
+}
+
+std::string Replayer::advance(const TimeStep& step, int result) {
+    const auto mover = m_prev.to_move;
+    if (step.to_move == mover) {
+        return "side to move did not change";
+    }
+    if (result != -m_prev_result) {
+        return "game result changed within a game";
+    }
+
+    // Planes 8 to 15 are the stones of the side that just moved.
+    auto move = int{FastBoard::PASS};
+    for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+        if (step.planes[8][idx] && !m_prev.planes[0][idx]) {
+            if (move != FastBoard::PASS) {
+                return "more than one stone added";
+            }
+            move = m_game.board.get_vertex(idx % BOARD_SIZE,
+                                           idx / BOARD_SIZE);
+        }
+    }
+    if (!m_game.is_move_legal(mover, move)) {
+        return "illegal move";
+    }
+    m_game.play_move(mover, move);
+
+    const auto planes = Training::get_planes(&m_game);
+    for (auto p = size_t{0}; p < 16; p++) {
+        if (planes[p] != step.planes[p]) {
+            return "input planes differ from the replayed game";
+        }
+    }
+    return "";
+}
+
+void process_file(const std::string& file, Stats& stats) {
+    auto data = std::string{};
+    auto start = Time();
+    if (!read_gz(file, data)) {
+        printf("%s: could not read\n", file.c_str());
+        stats.errors["unreadable file"]++;
+        stats.error_count++;
+        return;
+    }
+    stats.inflate_seconds += Time::timediff_seconds(start, Time());
+    stats.files++;
+    stats.compressed_bytes += boost::filesystem::file_size(file);
+    stats.raw_bytes += data.size();
+
+    const auto binary = Training::check_binary_header(data);
+    // serialize_training picks the format from this.
+    cfg_binary_training = binary;
+
+    auto replayer = std::make_unique<Replayer>();
+    auto pos = binary ? Training::BINARY_HEADER_SIZE : size_t{0};
+    auto step = TimeStep{};
+    auto result = 0;
+    for (auto record = size_t{0}; pos < data.size(); record++) {
+        const auto record_start = pos;
+        auto t0 = Time();
+        const auto decoded = binary
+            ? Training::decode_binary(data, pos, step, result)
+            : Training::decode_text(data, pos, step, result);
+        auto t1 = Time();
+        stats.decode_seconds += Time::timediff_seconds(t0, t1);
+        if (!decoded) {
+            report_error(stats, file, record, "record can't be decoded");
+            return;
+        }
+        stats.records++;
+
+        const auto error = replayer->check(step, result, stats);
+        auto t2 = Time();
+        stats.validate_seconds += Time::timediff_seconds(t1, t2);
+        if (!error.empty()) {
+            report_error(stats, file, record, error);
+        }
+
+        const auto winner = result == 1 ? step.to_move : !step.to_move;
+        const auto encoded =
+            Training::serialize_training({step}, winner);
+        stats.encode_seconds += Time::timediff_seconds(t2, Time());
+        if (data.compare(record_start, pos - record_start, encoded) != 0) {
+            report_error(stats, file, record,
+                         "record changes when encoded again");
+        }
+    }
+}
+
+void print_rate(const char* what, double seconds,
+                double megabytes, size_t records) {
+    seconds = std::max(seconds, 1e-9);
+    printf("%-9s %8.2fs %9.1f MB/s %11.0f positions/s\n",
+           what, seconds, megabytes / seconds, records / seconds);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s chunk.gz...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    GTP::setup_default_parameters();
+    // Same hashes as leelaz, so superko is judged the same way.
+    auto rng = std::make_unique<Random>(5489);
+    Zobrist::init_zobrist(*rng);
+
+    auto stats = Stats{};
+    for (auto i = 1; i < argc; i++) {
+        process_file(argv[i], stats);
+    }
+
+    const auto raw_mb = stats.raw_bytes / double(MiB);
+    printf("%zu files, %.1f MB compressed, %.1f MB raw, "
+           "%zu positions, %zu games\n",
+           stats.files, stats.compressed_bytes / double(MiB), raw_mb,
+           stats.records, stats.games);
+    print_rate("inflate", stats.inflate_seconds, raw_mb, stats.records);
+    print_rate("decode", stats.decode_seconds, raw_mb, stats.records);
+    print_rate("validate", stats.validate_seconds, raw_mb, stats.records);
+    print_rate("encode", stats.encode_seconds, raw_mb, stats.records);
+    printf("%zu positions replayed, %zu could not be followed.\n",
+           stats.verified, stats.unverified);
+
+    if (stats.error_count == 0) {
+        printf("No errors.\n");
+        return EXIT_SUCCESS;
+    }
+    printf("%zu errors:\n", stats.error_count);
+    for (const auto& error : stats.errors) {
+        printf("%8zu %s\n", error.second, error.first.c_str());
+    }
+    return EXIT_FAILURE;
+}